@@ -0,0 +1,516 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "hamiltonian_io.hpp"
+#include <pybind11/stl.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+TCM_NAMESPACE_BEGIN
+
+namespace {
+// [HamiltonianParser] {{{
+/// A hand-written parser for the `.hamiltonian` format. It keeps track of
+/// the current line and column so that errors can point to the exact place
+/// in the input.
+class HamiltonianParser {
+  private:
+    std::string_view _text;
+    std::string_view _filename;
+    size_t           _position;   ///< Current offset in `_text`
+    size_t           _line;       ///< Current line (counting from 1)
+    size_t           _line_start; ///< Offset of the first char of `_line`
+    HamiltonianSpec  _spec;
+
+  public:
+    HamiltonianParser(std::string_view text, std::string_view filename)
+        : _text{text}
+        , _filename{filename}
+        , _position{0}
+        , _line{1}
+        , _line_start{0}
+        , _spec{}
+    {}
+
+    auto parse() -> HamiltonianSpec
+    {
+        while (!at_end()) {
+            skip_blanks();
+            switch (peek()) {
+            case '\0':
+            case '\n': break;
+            case '#': parse_comment(); break;
+            default: parse_edges(); break;
+            }
+            end_of_line();
+        }
+        return std::move(_spec);
+    }
+
+  private:
+    auto at_end() const noexcept -> bool { return _position == _text.size(); }
+
+    /// Returns the current character or `'\0'` at the end of input.
+    auto peek() const noexcept -> char
+    {
+        return at_end() ? '\0' : _text[_position];
+    }
+
+    auto column() const noexcept -> size_t
+    {
+        return _position - _line_start + 1;
+    }
+
+    [[noreturn]] auto error(size_t const column, std::string_view message) const
+        -> void
+    {
+        TCM_ERROR(std::invalid_argument,
+                  fmt::format("{}:{}:{}: {}", _filename, _line, column,
+                              message));
+    }
+
+    [[noreturn]] auto error(std::string_view message) const -> void
+    {
+        error(column(), message);
+    }
+
+    auto skip_blanks() noexcept -> void
+    {
+        while (peek() == ' ' || peek() == '\t' || peek() == '\r') {
+            ++_position;
+        }
+    }
+
+    auto skip_until_end_of_line() noexcept -> void
+    {
+        while (!at_end() && peek() != '\n') {
+            ++_position;
+        }
+    }
+
+    auto expect(char const c) -> void
+    {
+        if (TCM_UNLIKELY(peek() != c)) {
+            error(fmt::format("expected '{}'", c));
+        }
+        ++_position;
+    }
+
+    /// Consumes trailing blanks and (optionally) a comment and moves to the
+    /// next line.
+    auto end_of_line() -> void
+    {
+        skip_blanks();
+        if (peek() == '#') { skip_until_end_of_line(); }
+        if (at_end()) { return; }
+        if (TCM_UNLIKELY(peek() != '\n')) { error("expected end of line"); }
+        ++_position;
+        ++_line;
+        _line_start = _position;
+    }
+
+    /// Parses `open elem, elem, ... close`. A trailing comma is allowed.
+    template <class Function>
+    auto parse_list(char const open, char const close, Function&& parse_element)
+        -> void
+    {
+        expect(open);
+        skip_blanks();
+        while (peek() != close) {
+            parse_element();
+            skip_blanks();
+            if (peek() == ',') {
+                ++_position;
+                skip_blanks();
+            }
+            else if (TCM_UNLIKELY(peek() != close)) {
+                error(fmt::format("expected ',' or '{}'", close));
+            }
+        }
+        ++_position;
+    }
+
+    /// Parses a site index.
+    auto parse_index() -> unsigned
+    {
+        constexpr auto max_index = std::numeric_limits<uint16_t>::max();
+        auto const     start     = column();
+        if (TCM_UNLIKELY(peek() < '0' || peek() > '9')) {
+            error("expected a non-negative integer");
+        }
+        auto index = 0UL;
+        for (; peek() >= '0' && peek() <= '9'; ++_position) {
+            index = 10 * index + static_cast<unsigned long>(peek() - '0');
+            if (TCM_UNLIKELY(index > max_index)) {
+                error(start, fmt::format("site index is too big; expected at "
+                                         "most {}",
+                                         max_index));
+            }
+        }
+        return static_cast<unsigned>(index);
+    }
+
+    auto parse_coupling() -> real_type
+    {
+        auto const start = _position;
+        while (!at_end() && peek() != ' ' && peek() != '\t' && peek() != '\r'
+               && peek() != '\n' && peek() != '[' && peek() != '#') {
+            ++_position;
+        }
+        // std::strtod requires a null-terminated string
+        auto const token = std::string{_text.substr(start, _position - start)};
+        char*      end   = nullptr;
+        auto const value = std::strtod(token.c_str(), &end);
+        if (TCM_UNLIKELY(token.empty() || end != token.c_str() + token.size()
+                         || !std::isfinite(value))) {
+            error(start - _line_start + 1,
+                  fmt::format("expected a coupling, but got '{}'", token));
+        }
+        return value;
+    }
+
+    /// Parses `coupling [(i, j), ...]`.
+    auto parse_edges() -> void
+    {
+        auto const coupling = parse_coupling();
+        skip_blanks();
+        parse_list('[', ']', [this, coupling]() {
+            auto const c = peek();
+            if (TCM_UNLIKELY(c != '(' && c != '[')) {
+                error("expected '(' or '['");
+            }
+            auto const start = column();
+            auto       sites = std::array<unsigned, 2>{};
+            auto       count = size_t{0};
+            parse_list(c, c == '(' ? ')' : ']', [this, &sites, &count]() {
+                auto const i = parse_index();
+                if (count < sites.size()) { sites[count] = i; }
+                ++count;
+            });
+            if (TCM_UNLIKELY(count != sites.size())) {
+                error(start, fmt::format("an edge must consist of exactly two "
+                                         "sites, but got {}",
+                                         count));
+            }
+            _spec.edges.emplace_back(coupling,
+                                     static_cast<uint16_t>(sites[0]),
+                                     static_cast<uint16_t>(sites[1]));
+        });
+    }
+
+    /// Parses a comment. Symmetries are specified in comments to keep files
+    /// readable by other tools:
+    ///
+    ///     # symmetry: [1, 2, 3, 0]
+    auto parse_comment() -> void
+    {
+        constexpr auto keyword = std::string_view{"symmetry:"};
+        expect('#');
+        skip_blanks();
+        if (_text.substr(_position, keyword.size()) != keyword) {
+            skip_until_end_of_line();
+            return;
+        }
+        _position += keyword.size();
+        skip_blanks();
+        auto const start       = column();
+        auto       permutation = std::vector<unsigned>{};
+        parse_list('[', ']', [this, &permutation]() {
+            permutation.push_back(parse_index());
+        });
+        if (TCM_UNLIKELY(!_spec.symmetries.empty()
+                         && permutation.size()
+                                != _spec.symmetries.front().size())) {
+            error(start, fmt::format("symmetry has wrong length: {}; expected "
+                                     "{}",
+                                     permutation.size(),
+                                     _spec.symmetries.front().size()));
+        }
+        _spec.symmetries.push_back(std::move(permutation));
+    }
+}; // }}}
+
+// [MappedFile] {{{
+/// Read-only memory mapping of a whole file.
+class MappedFile {
+  private:
+    void*  _data;
+    size_t _size;
+
+  public:
+    explicit MappedFile(std::string const& filename) : _data{nullptr}, _size{0}
+    {
+        auto const fd = ::open(filename.c_str(), O_RDONLY);
+        TCM_CHECK(fd != -1, std::runtime_error,
+                  fmt::format("failed to open '{}' for reading: {}", filename,
+                              std::strerror(errno)));
+        struct stat info;
+        if (TCM_UNLIKELY(::fstat(fd, &info) != 0)) {
+            auto const code = errno;
+            ::close(fd);
+            TCM_ERROR(std::runtime_error,
+                      fmt::format("failed to stat '{}': {}", filename,
+                                  std::strerror(code)));
+        }
+        _size = static_cast<size_t>(info.st_size);
+        if (_size != 0) {
+            _data = ::mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        auto const code = errno;
+        // The mapping stays valid after the descriptor is closed
+        ::close(fd);
+        TCM_CHECK(_data != MAP_FAILED, std::runtime_error,
+                  fmt::format("failed to mmap '{}': {}", filename,
+                              std::strerror(code)));
+    }
+
+    MappedFile(MappedFile const&) = delete;
+    MappedFile(MappedFile&&)      = delete;
+    MappedFile& operator=(MappedFile const&) = delete;
+    MappedFile& operator=(MappedFile&&) = delete;
+
+    ~MappedFile()
+    {
+        if (_data != nullptr) { ::munmap(_data, _size); }
+    }
+
+    auto data() const noexcept -> char const*
+    {
+        return static_cast<char const*>(_data);
+    }
+    auto size() const noexcept -> size_t { return _size; }
+}; // }}}
+
+constexpr char hamiltonian_magic[8] = {'N', 'Q', 'S', 'H', 'M', '\0', '\0', '\1'};
+
+struct CachedEdge {
+    double   coupling;
+    uint16_t first;
+    uint16_t second;
+    uint32_t _padding;
+};
+static_assert(sizeof(CachedEdge) == 16, TCM_STATIC_ASSERT_BUG_MESSAGE);
+} // namespace
+
+auto parse_hamiltonian(std::string_view text, std::string_view filename)
+    -> HamiltonianSpec
+{
+    return HamiltonianParser{text, filename}.parse();
+}
+
+auto read_hamiltonian(std::string const& filename) -> HamiltonianSpec
+{
+    std::ifstream in{filename, std::ios::binary};
+    TCM_CHECK(in, std::runtime_error,
+              fmt::format("failed to open '{}' for reading", filename));
+    std::ostringstream buffer;
+    buffer << in.rdbuf();
+    TCM_CHECK(in, std::runtime_error,
+              fmt::format("failed to read from '{}'", filename));
+    return parse_hamiltonian(buffer.str(), filename);
+}
+
+auto save_hamiltonian_cache(std::string const&     filename,
+                            HamiltonianSpec const& spec) -> void
+{
+    auto const number_edges = static_cast<uint64_t>(spec.edges.size());
+    auto const number_symmetries =
+        static_cast<uint64_t>(spec.symmetries.size());
+    auto const length = static_cast<uint64_t>(
+        spec.symmetries.empty() ? 0 : spec.symmetries.front().size());
+
+    auto edges = std::vector<CachedEdge>{};
+    edges.reserve(spec.edges.size());
+    for (auto const& [coupling, first, second] : spec.edges) {
+        edges.push_back(CachedEdge{coupling, first, second, 0});
+    }
+    auto symmetries = std::vector<uint16_t>{};
+    symmetries.reserve(number_symmetries * length);
+    for (auto const& permutation : spec.symmetries) {
+        TCM_CHECK(permutation.size() == length, std::invalid_argument,
+                  fmt::format("symmetries have different lengths: {} != {}",
+                              permutation.size(), length));
+        for (auto const i : permutation) {
+            TCM_CHECK(i <= std::numeric_limits<uint16_t>::max(),
+                      std::invalid_argument,
+                      fmt::format("site index is too big: {}", i));
+            symmetries.push_back(static_cast<uint16_t>(i));
+        }
+    }
+
+    std::array<char, 64> header{};
+    std::memcpy(header.data(), hamiltonian_magic, 8);
+    std::memcpy(header.data() + 8, &number_edges, 8);
+    std::memcpy(header.data() + 16, &number_symmetries, 8);
+    std::memcpy(header.data() + 24, &length, 8);
+
+    std::ofstream out{filename, std::ios::binary};
+    TCM_CHECK(out, std::runtime_error,
+              fmt::format("failed to open '{}' for writing", filename));
+    out.write(header.data(), static_cast<std::streamsize>(header.size()));
+    out.write(reinterpret_cast<char const*>(edges.data()),
+              static_cast<std::streamsize>(edges.size() * sizeof(CachedEdge)));
+    out.write(reinterpret_cast<char const*>(symmetries.data()),
+              static_cast<std::streamsize>(symmetries.size()
+                                           * sizeof(uint16_t)));
+    TCM_CHECK(out, std::runtime_error,
+              fmt::format("failed to write to '{}'", filename));
+}
+
+auto load_hamiltonian_cache(std::string const& filename) -> HamiltonianSpec
+{
+    MappedFile const file{filename};
+    auto const       size = file.size();
+    TCM_CHECK(size >= 64 && std::memcmp(file.data(), hamiltonian_magic, 8) == 0,
+              std::runtime_error,
+              fmt::format("'{}' is not a Hamiltonian cache", filename));
+    uint64_t number_edges, number_symmetries, length;
+    std::memcpy(&number_edges, file.data() + 8, 8);
+    std::memcpy(&number_symmetries, file.data() + 16, 8);
+    std::memcpy(&length, file.data() + 24, 8);
+    // Checks are ordered such that the products below can't overflow
+    TCM_CHECK(number_edges <= size / sizeof(CachedEdge)
+                  && length <= size / sizeof(uint16_t)
+                  && (number_symmetries == 0
+                      || (length != 0
+                          && number_symmetries
+                                 <= size / sizeof(uint16_t) / length))
+                  && size
+                         == 64 + number_edges * sizeof(CachedEdge)
+                                + number_symmetries * length
+                                      * sizeof(uint16_t),
+              std::runtime_error,
+              fmt::format("'{}' is corrupted: header does not match the file "
+                          "size",
+                          filename));
+
+    HamiltonianSpec spec;
+    spec.edges.reserve(number_edges);
+    auto const* p = file.data() + 64;
+    for (auto i = uint64_t{0}; i < number_edges; ++i, p += sizeof(CachedEdge)) {
+        CachedEdge edge;
+        std::memcpy(&edge, p, sizeof(CachedEdge));
+        spec.edges.emplace_back(edge.coupling, edge.first, edge.second);
+    }
+    spec.symmetries.reserve(number_symmetries);
+    for (auto i = uint64_t{0}; i < number_symmetries; ++i) {
+        auto permutation = std::vector<unsigned>(length);
+        for (auto& x : permutation) {
+            uint16_t site;
+            std::memcpy(&site, p, sizeof(uint16_t));
+            x = site;
+            p += sizeof(uint16_t);
+        }
+        spec.symmetries.push_back(std::move(permutation));
+    }
+    return spec;
+}
+
+auto bind_hamiltonian_io(PyObject* module) -> void
+{
+    namespace py = pybind11;
+    auto m       = py::module{py::reinterpret_borrow<py::object>(module)};
+
+    auto const to_tuple = [](HamiltonianSpec&& spec) {
+        return std::make_tuple(std::move(spec.edges),
+                               std::move(spec.symmetries));
+    };
+
+    m.def(
+        "parse_hamiltonian",
+        [to_tuple](std::string const& text, std::string const& filename) {
+            return to_tuple(parse_hamiltonian(text, filename));
+        },
+        py::arg{"text"}, py::arg{"filename"} = "<string>",
+        R"EOF(
+            Parses a Hamiltonian in the ``.hamiltonian`` text format.
+
+            :param text: contents of the file (either ``str`` or ``bytes``).
+            :param filename: name of the file which is used in error messages.
+            :return: a tuple ``(edges, symmetries)`` where ``edges`` is a list
+                     of ``(coupling, i, j)`` and ``symmetries`` is a list of
+                     site permutations.
+            :raises ValueError: if the input is malformed. The message
+                                contains the line and column of the error.
+        )EOF");
+
+    m.def(
+        "read_hamiltonian",
+        [to_tuple](std::string const& filename) {
+            return to_tuple(read_hamiltonian(filename));
+        },
+        py::arg{"filename"},
+        R"EOF(
+            Same as :py:func:`parse_hamiltonian`, but reads the text from
+            ``filename``.
+        )EOF");
+
+    m.def(
+        "save_hamiltonian_cache",
+        [](std::string const& filename, Heisenberg::spec_type edges,
+           std::vector<std::vector<unsigned>> symmetries) {
+            save_hamiltonian_cache(filename,
+                                   HamiltonianSpec{std::move(edges),
+                                                   std::move(symmetries)});
+        },
+        py::arg{"filename"}, py::arg{"edges"}, py::arg{"symmetries"},
+        R"EOF(
+            Saves a Hamiltonian to ``filename`` in a compact binary format
+            which can be memory-mapped by :py:func:`load_hamiltonian_cache`.
+        )EOF");
+
+    m.def(
+        "load_hamiltonian_cache",
+        [](std::string const& filename) {
+            auto spec = load_hamiltonian_cache(filename);
+            // Edges go straight from the mapped file into the Hamiltonian
+            // without a round trip through Python objects
+            return std::make_tuple(std::make_shared<Heisenberg>(spec.edges),
+                                   std::move(spec.symmetries));
+        },
+        py::arg{"filename"},
+        R"EOF(
+            Loads a Hamiltonian saved by :py:func:`save_hamiltonian_cache`.
+
+            :return: a tuple ``(hamiltonian, symmetries)`` where
+                     ``hamiltonian`` is a :py:class:`Heisenberg`.
+        )EOF");
+}
+
+TCM_NAMESPACE_END
@@ -0,0 +1,80 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+
+#include "config.hpp"
+#include "errors.hpp"
+#include "polynomial.hpp"
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+TCM_NAMESPACE_BEGIN
+
+/// Contents of a `.hamiltonian` file.
+struct HamiltonianSpec {
+    Heisenberg::spec_type edges; ///< `(coupling, i, j)` triples
+    std::vector<std::vector<unsigned>> symmetries; ///< Site permutations
+};
+
+/// Parses a Hamiltonian in the text format used by `data/*.hamiltonian`:
+///
+///     # Lines starting with '#' are comments, except for symmetries:
+///     # symmetry: [1, 2, 3, 0]
+///     1.0    [(0, 1), (1, 2), (2, 3), (3, 0)]
+///
+/// i.e. every non-comment line consists of a coupling followed by a list of
+/// edges. Edges may be written either as tuples or as lists. On malformed
+/// input `std::invalid_argument` is thrown with a message of the form
+/// `<filename>:<line>:<column>: <what went wrong>`.
+auto parse_hamiltonian(std::string_view text,
+                       std::string_view filename = "<string>")
+    -> HamiltonianSpec;
+
+/// Reads the whole of `filename` and passes it to #parse_hamiltonian.
+auto read_hamiltonian(std::string const& filename) -> HamiltonianSpec;
+
+/// Saves `spec` to `filename` in a compact binary format which is
+/// memory-mapped by #load_hamiltonian_cache: a 64-byte header followed by
+/// the edges and then the symmetries.
+///
+/// The header consists of an 8-byte magic string `"NQSHM\0\0\1"`, the number
+/// of edges, the number of symmetries, and the length of each symmetry (all
+/// `uint64_t`). The rest is zero. Every edge is stored in 16 bytes: the
+/// coupling (`double`), two site indices (`uint16_t`) and 4 bytes of padding.
+/// Symmetries are stored as a row-major matrix of `uint16_t`.
+auto save_hamiltonian_cache(std::string const&     filename,
+                            HamiltonianSpec const& spec) -> void;
+
+/// Loads a Hamiltonian previously saved by #save_hamiltonian_cache.
+auto load_hamiltonian_cache(std::string const& filename) -> HamiltonianSpec;
+
+auto bind_hamiltonian_io(PyObject*) -> void;
+
+TCM_NAMESPACE_END
@@ -0,0 +1,312 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "jacobian.hpp"
+#include <mkl_cblas.h>
+#include <pybind11/stl.h>
+#include <torch/extension.h>
+
+#include <cmath>
+#include <limits>
+#include <string>
+#include <vector>
+
+TCM_NAMESPACE_BEGIN
+
+namespace {
+/// Applies `activation` to `n` pre-activations `z` in place and stores the
+/// derivatives `f'(z)` in `derivative`.
+auto activate(Activation const activation, float* z, float* derivative,
+              size_t const n) noexcept -> void
+{
+    switch (activation) {
+    case Activation::identity:
+        std::fill(derivative, derivative + n, 1.0f);
+        break;
+    case Activation::relu:
+        for (auto i = size_t{0}; i < n; ++i) {
+            derivative[i] = z[i] > 0.0f ? 1.0f : 0.0f;
+            z[i]          = std::max(z[i], 0.0f);
+        }
+        break;
+    case Activation::softplus:
+        for (auto i = size_t{0}; i < n; ++i) {
+            // Same as torch.nn.functional.softplus, i.e. the function is
+            // linear above the threshold
+            if (z[i] > 20.0f) { derivative[i] = 1.0f; }
+            else {
+                auto const e  = std::exp(z[i]);
+                derivative[i] = e / (1.0f + e);
+                z[i]          = std::log1p(e);
+            }
+        }
+        break;
+    case Activation::tanh:
+        for (auto i = size_t{0}; i < n; ++i) {
+            z[i]          = std::tanh(z[i]);
+            derivative[i] = 1.0f - z[i] * z[i];
+        }
+        break;
+    } // end switch
+}
+
+auto check_layers(gsl::span<DenseSpec const> layers) -> void
+{
+    TCM_CHECK(!layers.empty(), std::invalid_argument,
+              "a multilayer perceptron must have at least one layer");
+    for (auto i = size_t{1}; i < layers.size(); ++i) {
+        TCM_CHECK(layers[i].in_features == layers[i - 1].out_features,
+                  std::invalid_argument,
+                  fmt::format("layer {} has {} input features, but the "
+                              "previous layer has {} output features",
+                              i, layers[i].in_features,
+                              layers[i - 1].out_features));
+    }
+    auto const& last = layers[layers.size() - 1];
+    TCM_CHECK(last.out_features == 1, std::invalid_argument,
+              fmt::format("the last layer must have a single output, but "
+                          "it has {}",
+                          last.out_features));
+    for (auto const& layer : layers) {
+        TCM_CHECK(layer.in_features <= static_cast<size_t>(
+                      std::numeric_limits<int>::max())
+                      && layer.out_features <= static_cast<size_t>(
+                             std::numeric_limits<int>::max()),
+                  std::overflow_error, "layer is too big");
+    }
+}
+
+auto parse_activation(std::string const& name) -> Activation
+{
+    if (name == "identity") { return Activation::identity; }
+    if (name == "relu") { return Activation::relu; }
+    if (name == "softplus") { return Activation::softplus; }
+    if (name == "tanh") { return Activation::tanh; }
+    TCM_ERROR(std::invalid_argument,
+              fmt::format("unsupported activation: '{}'", name));
+}
+} // namespace
+
+auto number_parameters(gsl::span<DenseSpec const> layers) noexcept -> size_t
+{
+    auto count = size_t{0};
+    for (auto const& layer : layers) {
+        count += layer.out_features * layer.in_features;
+        if (layer.bias != nullptr) { count += layer.out_features; }
+    }
+    return count;
+}
+
+auto mlp_jacobian(gsl::span<DenseSpec const> layers,
+                  gsl::span<float const> inputs, size_t const batch_size,
+                  float* out, size_t const row_stride,
+                  size_t const column_stride) -> void
+{
+    check_layers(layers);
+    TCM_CHECK(inputs.size() == batch_size * layers[0].in_features,
+              std::invalid_argument,
+              fmt::format("inputs has wrong size: {}; expected {}",
+                          inputs.size(), batch_size * layers[0].in_features));
+    TCM_CHECK(batch_size
+                  <= static_cast<size_t>(std::numeric_limits<int>::max()),
+              std::overflow_error,
+              fmt::format("batch size is too big: {}", batch_size));
+    if (batch_size == 0) { return; }
+    auto const n = static_cast<int>(batch_size);
+
+    // Forward pass: activations[l] are the outputs of layer l, and deltas[l]
+    // first hold f'(zₗ) and are then turned into δₗ = ∂f/∂zₗ.
+    std::vector<aligned_vector<float>> activations(layers.size());
+    std::vector<aligned_vector<float>> deltas(layers.size());
+    for (auto l = size_t{0}; l < layers.size(); ++l) {
+        auto const& layer = layers[l];
+        auto const* x = l == 0 ? inputs.data() : activations[l - 1].data();
+        auto&       z = activations[l];
+        z.resize(batch_size * layer.out_features);
+        deltas[l].resize(z.size());
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasTrans, n,
+                    static_cast<int>(layer.out_features),
+                    static_cast<int>(layer.in_features), /*alpha=*/1.0f, x,
+                    static_cast<int>(layer.in_features), layer.weight,
+                    static_cast<int>(layer.in_features), /*beta=*/0.0f,
+                    z.data(), static_cast<int>(layer.out_features));
+        auto* derivative = deltas[l].data();
+        auto* data       = z.data();
+        auto const* bias = layer.bias;
+        auto const  cols = layer.out_features;
+        auto const  func = layer.activation;
+#pragma omp parallel for default(none)                                         \
+    firstprivate(data, derivative, bias, cols, func, n) schedule(static)
+        for (auto i = 0; i < n; ++i) {
+            auto* row = data + static_cast<size_t>(i) * cols;
+            if (bias != nullptr) {
+                for (auto j = size_t{0}; j < cols; ++j) {
+                    row[j] += bias[j];
+                }
+            }
+            activate(func, row, derivative + static_cast<size_t>(i) * cols,
+                     cols);
+        }
+    }
+
+    // Backward pass: δₗ₋₁ = (δₗ Wₗ) ∘ f'(zₗ₋₁). The output is a scalar, so
+    // δ of the last layer is just f'(z).
+    aligned_vector<float> product;
+    for (auto l = layers.size() - 1; l > 0; --l) {
+        auto const& layer = layers[l];
+        auto&       delta = deltas[l - 1];
+        product.resize(delta.size());
+        cblas_sgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans, n,
+                    static_cast<int>(layer.in_features),
+                    static_cast<int>(layer.out_features), /*alpha=*/1.0f,
+                    deltas[l].data(), static_cast<int>(layer.out_features),
+                    layer.weight, static_cast<int>(layer.in_features),
+                    /*beta=*/0.0f, product.data(),
+                    static_cast<int>(layer.in_features));
+        for (auto i = size_t{0}; i < delta.size(); ++i) {
+            delta[i] *= product[i];
+        }
+    }
+
+    // Per-sample gradients: ∂f/∂Wₗ = δₗ ⊗ aₗ₋₁ and ∂f/∂bₗ = δₗ. Every thread
+    // fills whole rows of out.
+#pragma omp parallel for default(none)                                         \
+    firstprivate(layers, inputs, out, row_stride, column_stride, n)            \
+        shared(activations, deltas) schedule(static)
+    for (auto i = 0; i < n; ++i) {
+        auto const s      = static_cast<size_t>(i);
+        auto*      column = out + s * row_stride;
+        for (auto l = size_t{0}; l < layers.size(); ++l) {
+            auto const& layer = layers[l];
+            auto const  rows  = layer.out_features;
+            auto const  cols  = layer.in_features;
+            auto const* a     = (l == 0 ? inputs.data()
+                                        : activations[l - 1].data())
+                            + s * cols;
+            auto const* delta = deltas[l].data() + s * rows;
+            for (auto j = size_t{0}; j < rows; ++j) {
+                for (auto k = size_t{0}; k < cols; ++k) {
+                    column[k * column_stride] = delta[j] * a[k];
+                }
+                column += cols * column_stride;
+            }
+            if (layer.bias != nullptr) {
+                for (auto j = size_t{0}; j < rows; ++j) {
+                    column[j * column_stride] = delta[j];
+                }
+                column += rows * column_stride;
+            }
+        }
+    }
+}
+
+auto bind_jacobian(PyObject* module) -> void
+{
+    namespace py = pybind11;
+    auto m       = py::module{py::reinterpret_borrow<py::object>(module)};
+
+    using Layer =
+        std::tuple<torch::Tensor, optional<torch::Tensor>, std::string>;
+
+    m.def(
+        "mlp_jacobian",
+        [](std::vector<Layer> const& layers, torch::Tensor const& inputs,
+           torch::Tensor const& out) {
+            auto const check_matrix = [](torch::Tensor const& x,
+                                         char const*          name) {
+                TCM_CHECK_TYPE(x.scalar_type(), torch::kFloat32);
+                TCM_CHECK(x.dim() == 2, std::domain_error,
+                          fmt::format("{} has wrong number of dimensions: "
+                                      "{}; expected 2",
+                                      name, x.dim()));
+            };
+            std::vector<DenseSpec> specs;
+            specs.reserve(layers.size());
+            for (auto const& [weight, bias, activation] : layers) {
+                check_matrix(weight, "weight");
+                TCM_CHECK(weight.is_contiguous(), std::invalid_argument,
+                          "weight must be contiguous");
+                auto const out_features = static_cast<size_t>(weight.size(0));
+                auto const in_features  = static_cast<size_t>(weight.size(1));
+                if (bias.has_value()) {
+                    TCM_CHECK_TYPE(bias->scalar_type(), torch::kFloat32);
+                    TCM_CHECK(bias->dim() == 1 && bias->is_contiguous()
+                                  && static_cast<size_t>(bias->size(0))
+                                         == out_features,
+                              std::invalid_argument,
+                              fmt::format("bias must be a contiguous vector "
+                                          "of length {}",
+                                          out_features));
+                }
+                auto const func = parse_activation(activation);
+                specs.push_back(DenseSpec{
+                    weight.data_ptr<float>(),
+                    bias.has_value() ? bias->data_ptr<float>() : nullptr,
+                    in_features, out_features, func});
+            }
+            check_matrix(inputs, "inputs");
+            TCM_CHECK(inputs.is_contiguous(), std::invalid_argument,
+                      "inputs must be contiguous");
+            check_matrix(out, "out");
+            auto const batch_size = static_cast<size_t>(inputs.size(0));
+            TCM_CHECK(static_cast<size_t>(out.size(0)) == batch_size
+                          && static_cast<size_t>(out.size(1))
+                                 == number_parameters(specs),
+                      std::invalid_argument,
+                      fmt::format("out has wrong shape: [{}, {}]; expected "
+                                  "[{}, {}]",
+                                  out.size(0), out.size(1), batch_size,
+                                  number_parameters(specs)));
+            TCM_CHECK(out.stride(0) >= 0 && out.stride(1) >= 0,
+                      std::invalid_argument,
+                      "out must have non-negative strides");
+            mlp_jacobian(specs,
+                         {inputs.data_ptr<float>(),
+                          static_cast<size_t>(inputs.numel())},
+                         batch_size, out.data_ptr<float>(),
+                         static_cast<size_t>(out.stride(0)),
+                         static_cast<size_t>(out.stride(1)));
+        },
+        py::arg{"layers"}, py::arg{"inputs"}, py::arg{"out"},
+        R"EOF(
+            Computes the Jacobian ``∂f(inputs)/∂W`` of a multilayer
+            perceptron ``f`` using a single batched forward and backward
+            pass.
+
+            :param layers: a list of ``(weight, bias, activation)`` tuples
+                where ``activation`` is one of ``"identity"``, ``"relu"``,
+                ``"softplus"``, and ``"tanh"``, and ``bias`` may be ``None``.
+                The last layer must have a single output.
+            :param inputs: a contiguous ``float32`` tensor of shape
+                ``(batch_size, in_features)``.
+            :param out: a ``float32`` tensor of shape ``(batch_size,
+                #parameters)`` into which the Jacobian is written. It need not
+                be contiguous.
+        )EOF");
+}
+
+TCM_NAMESPACE_END
@@ -0,0 +1,83 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+
+#include "common.hpp"
+#include "config.hpp"
+#include "errors.hpp"
+
+#include <gsl/gsl-lite.hpp>
+#include <pybind11/pybind11.h>
+
+TCM_NAMESPACE_BEGIN
+
+/// Activation functions supported by #mlp_jacobian.
+enum class Activation : unsigned char {
+    identity,
+    relu,
+    softplus, ///< `log(1 + exp(x))` with PyTorch's default threshold of 20
+    tanh,
+};
+
+/// A fully-connected layer `y = f(W x + b)` of a multilayer perceptron.
+///
+/// Parameters are not copied, i.e. they must outlive the call to
+/// #mlp_jacobian.
+struct DenseSpec {
+    float const* weight; ///< Row-major `out_features x in_features`
+    float const* bias;   ///< Of length `out_features` or `nullptr`
+    size_t       in_features;
+    size_t       out_features;
+    Activation   activation;
+};
+
+/// Returns the total number of parameters (weights and biases) in `layers`.
+auto number_parameters(gsl::span<DenseSpec const> layers) noexcept -> size_t;
+
+/// Computes the Jacobian `∂f(xᵢ)/∂W` of a multilayer perceptron `f` for all
+/// samples `xᵢ` at once.
+///
+/// A single batched forward pass stores the activations and a single batched
+/// backward pass propagates `δ = ∂f/∂z` through the layers (both using
+/// BLAS). The gradients with respect to the weights are then outer products
+/// `δᵢ ⊗ aᵢ` which are written straight into `out`. Parameters are ordered
+/// like `torch.nn.Sequential.parameters()`, i.e. `W₁, b₁, W₂, b₂, ...`.
+///
+/// \param layers     Layers of `f`. The last one must have a single output.
+/// \param inputs     Row-major `batch_size x layers[0].in_features` matrix.
+/// \param out        Row `i` starts at `out + i * row_stride` and consecutive
+///                   parameters are `column_stride` elements apart. This
+///                   allows writing into e.g. the real parts of a complex
+///                   matrix.
+auto mlp_jacobian(gsl::span<DenseSpec const> layers,
+                  gsl::span<float const> inputs, size_t batch_size, float* out,
+                  size_t row_stride, size_t column_stride) -> void;
+
+auto bind_jacobian(PyObject*) -> void;
+
+TCM_NAMESPACE_END
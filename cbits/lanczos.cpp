@@ -0,0 +1,384 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "lanczos.hpp"
+#include "random.hpp"
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+TCM_NAMESPACE_BEGIN
+
+namespace {
+// [BLAS-like helpers] {{{
+auto dot(gsl::span<real_type const> x, gsl::span<real_type const> y) noexcept
+    -> real_type
+{
+    TCM_ASSERT(x.size() == y.size(), "sizes don't match");
+    auto const  n   = static_cast<int64_t>(x.size());
+    auto const* a   = x.data();
+    auto const* b   = y.data();
+    auto        sum = real_type{0};
+#pragma omp parallel for default(none) firstprivate(n, a, b)                   \
+    reduction(+ : sum) schedule(static)
+    for (auto i = int64_t{0}; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+/// Performs `y += a * x`.
+auto axpy(real_type const a, gsl::span<real_type const> x,
+          gsl::span<real_type> y) noexcept -> void
+{
+    TCM_ASSERT(x.size() == y.size(), "sizes don't match");
+    auto const  n   = static_cast<int64_t>(x.size());
+    auto const* src = x.data();
+    auto*       dst = y.data();
+#pragma omp parallel for default(none) firstprivate(n, a, src, dst)           \
+    schedule(static)
+    for (auto i = int64_t{0}; i < n; ++i) {
+        dst[i] += a * src[i];
+    }
+}
+
+auto scale(real_type const a, gsl::span<real_type> x) noexcept -> void
+{
+    auto const n    = static_cast<int64_t>(x.size());
+    auto*      data = x.data();
+#pragma omp parallel for default(none) firstprivate(n, a, data) schedule(static)
+    for (auto i = int64_t{0}; i < n; ++i) {
+        data[i] *= a;
+    }
+}
+// }}}
+
+/// Computes the lowest eigenpair of a symmetric tridiagonal matrix with
+/// diagonal `alpha` and sub-diagonal `beta` using the implicit QL algorithm
+/// (adapted from Numerical Recipes' `tqli`). Matrices are small (at most
+/// `LanczosOptions::max_iterations`), so computing all eigenvectors is fine.
+auto tridiagonal_ground_state(std::vector<real_type> diagonal,
+                              std::vector<real_type> off_diagonal)
+    -> std::tuple<real_type, std::vector<real_type>>
+{
+    TCM_ASSERT(!diagonal.empty() && off_diagonal.size() + 1 == diagonal.size(),
+               "invalid tridiagonal matrix");
+    off_diagonal.push_back(real_type{0});
+    auto const n = static_cast<int>(diagonal.size());
+    auto* const d = diagonal.data();
+    auto* const e = off_diagonal.data();
+    // Eigenvectors are stored in columns of `z` (row-major)
+    std::vector<real_type> z(diagonal.size() * diagonal.size(), real_type{0});
+    auto const at = [p = z.data(), n](int const i, int const j) -> real_type& {
+        return p[i * n + j];
+    };
+    for (auto i = 0; i < n; ++i) {
+        at(i, i) = real_type{1};
+    }
+
+    for (auto l = 0; l < n; ++l) {
+        auto iteration = 0;
+        auto m         = l;
+        do {
+            for (m = l; m < n - 1; ++m) {
+                auto const dd = std::abs(d[m]) + std::abs(d[m + 1]);
+                if (std::abs(e[m])
+                    <= std::numeric_limits<real_type>::epsilon() * dd) {
+                    break;
+                }
+            }
+            if (m != l) {
+                TCM_CHECK(iteration++ < 60, std::runtime_error,
+                          "QL algorithm failed to converge");
+                auto g = (d[l + 1] - d[l]) / (real_type{2} * e[l]);
+                auto r = std::hypot(g, real_type{1});
+                g      = d[m] - d[l] + e[l] / (g + std::copysign(r, g));
+                auto s = real_type{1};
+                auto c = real_type{1};
+                auto p = real_type{0};
+                auto i = m - 1;
+                for (; i >= l; --i) {
+                    auto const f = s * e[i];
+                    auto const b = c * e[i];
+                    e[i + 1] = r = std::hypot(f, g);
+                    if (r == real_type{0}) {
+                        d[i + 1] -= p;
+                        e[m] = real_type{0};
+                        break;
+                    }
+                    s        = f / r;
+                    c        = g / r;
+                    g        = d[i + 1] - p;
+                    r        = (d[i] - g) * s + real_type{2} * c * b;
+                    d[i + 1] = g + (p = s * r);
+                    g        = c * r - b;
+                    for (auto k = 0; k < n; ++k) {
+                        auto const t = at(k, i + 1);
+                        at(k, i + 1) = s * at(k, i) + c * t;
+                        at(k, i)     = c * at(k, i) - s * t;
+                    }
+                }
+                if (r == real_type{0} && i >= l) { continue; }
+                d[l] -= p;
+                e[l] = g;
+                e[m] = real_type{0};
+            }
+        } while (m != l);
+    }
+
+    auto const j = static_cast<int>(std::min_element(d, d + n) - d);
+    std::vector<real_type> vector(diagonal.size());
+    for (auto k = 0; k < n; ++k) {
+        vector[static_cast<size_t>(k)] = at(k, j);
+    }
+    return {d[j], std::move(vector)};
+}
+
+constexpr char ground_state_magic[8] = {'N', 'Q', 'S', 'G', 'S', '\0', '\0', '\2'};
+
+auto write_ground_state(std::string const& filename,
+                        unsigned const number_spins, real_type const energy,
+                        size_t const                 group_size,
+                        gsl::span<SpinVector const>  states,
+                        gsl::span<real_type const>   vector) -> void
+{
+    TCM_ASSERT(states.size() == vector.size(), "sizes don't match");
+    std::array<char, 64> header{};
+    auto const spins     = static_cast<uint64_t>(number_spins);
+    auto const dimension = static_cast<uint64_t>(states.size());
+    auto const order     = static_cast<uint64_t>(group_size);
+    std::memcpy(header.data(), ground_state_magic, 8);
+    std::memcpy(header.data() + 8, &spins, 8);
+    std::memcpy(header.data() + 16, &dimension, 8);
+    std::memcpy(header.data() + 24, &energy, 8);
+    std::memcpy(header.data() + 32, &order, 8);
+
+    std::ofstream out{filename, std::ios::binary};
+    TCM_CHECK(out, std::runtime_error,
+              fmt::format("failed to open '{}' for writing", filename));
+    out.write(header.data(), static_cast<std::streamsize>(header.size()));
+    out.write(reinterpret_cast<char const*>(states.data()),
+              static_cast<std::streamsize>(states.size() * sizeof(SpinVector)));
+    out.write(reinterpret_cast<char const*>(vector.data()),
+              static_cast<std::streamsize>(vector.size() * sizeof(real_type)));
+    TCM_CHECK(out, std::runtime_error,
+              fmt::format("failed to write to '{}'", filename));
+}
+} // namespace
+
+auto lanczos(SpinHamiltonian const& hamiltonian, SectorBasis const& basis,
+             LanczosOptions const& options)
+    -> std::tuple<real_type, aligned_vector<real_type>>
+{
+    TCM_CHECK(basis.is_real(), std::invalid_argument,
+              "Lanczos is only implemented for sectors with real characters");
+    TCM_CHECK(basis.size() > 0, std::invalid_argument, "basis is empty");
+    TCM_CHECK(options.max_iterations > 0, std::invalid_argument,
+              "max_iterations must be positive");
+    auto const n = basis.size();
+
+    aligned_vector<real_type> start(n);
+    aligned_vector<real_type> v(n);
+    aligned_vector<real_type> v_prev(n);
+    aligned_vector<real_type> w(n);
+    aligned_vector<real_type> x(n);
+    {
+        auto& generator = global_random_generator();
+        std::normal_distribution<real_type> dist;
+        std::generate(std::begin(start), std::end(start),
+                      [&generator, &dist]() { return dist(generator); });
+        scale(real_type{1} / std::sqrt(dot(start, start)), start);
+    }
+
+    std::vector<real_type> alpha;
+    std::vector<real_type> beta;
+    // Runs the Lanczos recurrence starting at `start`. During the first pass
+    // (`ritz.empty()`), `alpha` and `beta` are computed. During the second
+    // one, `x` is set to `∑ⱼ ritz[j] vⱼ`.
+    auto const iterate = [&](std::vector<real_type> const& ritz) {
+        auto const first_pass = ritz.empty();
+        auto const steps =
+            first_pass ? options.max_iterations : static_cast<unsigned>(ritz.size());
+        if (first_pass) {
+            alpha.clear();
+            beta.clear();
+        }
+        else {
+            std::fill(std::begin(x), std::end(x), real_type{0});
+        }
+        std::copy(std::begin(start), std::end(start), std::begin(v));
+        std::fill(std::begin(v_prev), std::end(v_prev), real_type{0});
+        auto b_prev = real_type{0};
+        for (auto j = 0u; j < steps; ++j) {
+            if (!first_pass) {
+                axpy(ritz[j], v, x);
+                if (j + 1 == steps) { break; }
+            }
+            matvec(hamiltonian, basis, gsl::span<real_type const>{v},
+                   gsl::span<real_type>{w});
+            auto const a = dot(v, w);
+            axpy(-a, v, w);
+            axpy(-b_prev, v_prev, w);
+            auto const b = std::sqrt(dot(w, w));
+            if (first_pass) {
+                alpha.push_back(a);
+                // Invariant subspace found: the result is exact
+                if (b <= std::numeric_limits<real_type>::epsilon()
+                             * std::max(std::abs(a), real_type{1})) {
+                    break;
+                }
+                beta.push_back(b);
+            }
+            std::swap(v_prev, v);
+            std::swap(v, w);
+            scale(real_type{1} / b, v);
+            b_prev = b;
+        }
+    };
+
+    auto energy = real_type{0};
+    for (auto restart = 0u;; ++restart) {
+        iterate({});
+        auto const k = alpha.size();
+        auto const residual_beta =
+            beta.size() == k ? beta.back() : real_type{0};
+        beta.resize(k - 1);
+        auto [theta, ritz] = tridiagonal_ground_state(alpha, beta);
+        energy             = theta;
+        iterate(ritz);
+        scale(real_type{1} / std::sqrt(dot(x, x)), x);
+        // Standard Lanczos estimate of ‖Hx - θx‖
+        auto const residual = std::abs(residual_beta * ritz.back());
+        if (residual <= options.tolerance * std::max(std::abs(theta),
+                                                     real_type{1})
+            || restart == options.max_restarts) {
+            break;
+        }
+        // Restart from the current Ritz vector
+        std::swap(start, x);
+    }
+    return {energy, std::move(x)};
+}
+
+auto save_ground_state(std::string const& filename, SectorBasis const& basis,
+                       real_type const energy, gsl::span<real_type const> vector,
+                       optional<int> magnetisation, bool const expand) -> void
+{
+    TCM_CHECK(vector.size() == basis.size(), std::invalid_argument,
+              fmt::format("vector has wrong size: {}; expected {}",
+                          vector.size(), basis.size()));
+    static_assert(sizeof(SpinVector) == 16, TCM_STATIC_ASSERT_BUG_MESSAGE);
+    auto const& group = basis.group();
+    if (expand && group.size() > 1) {
+        // ψ(σ) = cᵣ λ* √n for every σ in the sector
+        auto states = all_spins(basis.number_spins(), std::move(magnetisation));
+        std::vector<SymmetryGroup::Canonical> canonical(states.size());
+        group.canonicalise(states, canonical);
+        aligned_vector<real_type> expanded(states.size());
+        for (auto i = size_t{0}; i < states.size(); ++i) {
+            auto const& c = canonical[i];
+            if (c.norm <= real_type{0}) { continue; }
+            auto const j = basis.index(c.representative);
+            TCM_CHECK(j >= 0, std::runtime_error,
+                      "representative is not in the basis; was the basis "
+                      "constructed for a different magnetisation?");
+            expanded[i] = vector[static_cast<size_t>(j)]
+                          * std::conj(c.phase).real() * std::sqrt(c.norm);
+        }
+        write_ground_state(filename, basis.number_spins(), energy,
+                           /*group_size=*/1, states, expanded);
+        return;
+    }
+    write_ground_state(filename, basis.number_spins(), energy, group.size(),
+                       basis.states(), vector);
+}
+
+auto bind_lanczos(PyObject* module) -> void
+{
+    namespace py = pybind11;
+    auto m       = py::module{py::reinterpret_borrow<py::object>(module)};
+
+    m.def(
+        "lanczos",
+        [](SpinHamiltonian const&               hamiltonian,
+           std::shared_ptr<SymmetryGroup const> group,
+           optional<int> magnetisation, unsigned const max_iterations,
+           unsigned const max_restarts, real_type const tolerance,
+           optional<std::string> const& output, bool const expand) {
+            if (group == nullptr) {
+                TCM_CHECK(hamiltonian.size() > 0, std::invalid_argument,
+                          "can't determine the number of spins from an empty "
+                          "Hamiltonian; please, specify group");
+                group = std::make_shared<SymmetryGroup>(
+                    static_cast<unsigned>(hamiltonian.max_index() + 1),
+                    gsl::span<SymmetryGroup::Generator const>{});
+            }
+            auto const basis = SectorBasis{std::move(group), magnetisation};
+            auto [energy, vector] = lanczos(
+                hamiltonian, basis,
+                LanczosOptions{max_iterations, max_restarts, tolerance});
+            if (output.has_value()) {
+                save_ground_state(*output, basis, energy, vector,
+                                  std::move(magnetisation), expand);
+            }
+            auto states = aligned_vector<SpinVector>{
+                std::begin(basis.states()), std::end(basis.states())};
+            return py::make_tuple(energy, to_numpy_array(std::move(vector)),
+                                  to_numpy_array(std::move(states)));
+        },
+        py::arg{"hamiltonian"}, py::arg{"group"} = py::none(),
+        py::arg{"magnetisation"} = py::none(),
+        py::arg{"max_iterations"} = 200, py::arg{"max_restarts"} = 20,
+        py::arg{"tolerance"} = 1e-10, py::arg{"output"} = py::none(),
+        py::arg{"expand"} = false,
+        R"EOF(
+            Computes the ground state of ``hamiltonian`` using Lanczos.
+
+            :param hamiltonian: the Hamiltonian.
+            :param group: symmetry sector (see :py:class:`SymmetryGroup`). Only
+                          sectors with real characters are supported. If
+                          ``None``, no symmetries are used.
+            :param magnetisation: magnetisation sector.
+            :param max_iterations: dimension of the Krylov subspace.
+            :param max_restarts: maximal number of restarts.
+            :param tolerance: relative tolerance for the residual norm.
+            :param output: if not ``None``, the ground state is also saved to
+                           this file in a format which can be memory-mapped
+                           (see :py:func:`nqs_playground.core.load_exact`).
+            :param expand: if ``True``, the ground state is expanded to the
+                           full magnetisation sector before saving it to
+                           ``output``. :py:func:`nqs_playground.core.load_exact`
+                           only accepts such files when ``group`` is not
+                           trivial.
+            :return: a tuple ``(energy, coefficients, basis)``.
+        )EOF");
+}
+
+TCM_NAMESPACE_END
@@ -0,0 +1,83 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+
+#include "common.hpp"
+#include "config.hpp"
+#include "errors.hpp"
+#include "polynomial.hpp"
+#include "sector.hpp"
+
+#include <gsl/gsl-lite.hpp>
+
+#include <string>
+#include <tuple>
+
+TCM_NAMESPACE_BEGIN
+
+struct LanczosOptions {
+    unsigned  max_iterations = 200; ///< Dimension of the Krylov subspace
+    unsigned  max_restarts   = 20;  ///< Maximal number of restarts
+    real_type tolerance      = 1e-10; ///< Relative residual tolerance
+};
+
+/// Finds the ground state of `hamiltonian` in `basis` using matrix-free
+/// Lanczos.
+///
+/// The Krylov basis is not stored: the Ritz vector is reconstructed by
+/// repeating the recurrence (i.e. two passes per cycle). Hence only five
+/// vectors of size `basis.size()` are kept in memory: the starting vector,
+/// three vectors for the recurrence and the Ritz vector. If the residual
+/// norm is not small enough after `options.max_iterations` steps, Lanczos is
+/// restarted from the current Ritz vector.
+///
+/// \return A tuple `(energy, ground_state)`.
+auto lanczos(SpinHamiltonian const& hamiltonian, SectorBasis const& basis,
+             LanczosOptions const& options)
+    -> std::tuple<real_type, aligned_vector<real_type>>;
+
+/// Saves the ground state to `filename` in a format that can be
+/// memory-mapped: a 64-byte header followed by basis states (as
+/// `SpinVector`s) and then the coefficients (as `double`s).
+///
+/// The header consists of an 8-byte magic string `"NQSGS\0\0\2"`, the number
+/// of spins, dimension of the basis (both `uint64_t`), the ground state
+/// energy (`double`), and the size of the symmetry group (`uint64_t`). The
+/// rest is zero. If the group is not trivial, the states are representatives
+/// and the coefficients are `cᵣ` (see #SectorBasis).
+///
+/// If `expand` is `true`, the ground state is instead expanded to all spin
+/// configurations with the given `magnetisation` (in the order of
+/// #all_spins), i.e. `ψ(σ) = cᵣ λ* √n` are stored and the group size is `1`.
+auto save_ground_state(std::string const& filename, SectorBasis const& basis,
+                       real_type energy, gsl::span<real_type const> vector,
+                       optional<int> magnetisation, bool expand) -> void;
+
+auto bind_lanczos(PyObject*) -> void;
+
+TCM_NAMESPACE_END
@@ -0,0 +1,183 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "lattice.hpp"
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+#include <torch/extension.h>
+
+#include <algorithm>
+
+TCM_NAMESPACE_BEGIN
+
+auto LatticeLayout::check_shape() const -> void
+{
+    TCM_CHECK(std::all_of(std::begin(_shape), std::end(_shape),
+                          [](auto const x) { return x > 0; }),
+              std::invalid_argument,
+              fmt::format("invalid shape: ({}, {}, {}); all dimensions must "
+                          "be positive",
+                          _shape[0], _shape[1], _shape[2]));
+}
+
+LatticeLayout::LatticeLayout(shape_type shape,
+                             gsl::span<site_type const> sites,
+                             float const                padding)
+    : _cells{}, _shape{shape}, _number_spins{}, _padding{padding}
+{
+    check_shape();
+    TCM_CHECK(sites.size() <= SpinVector::max_size(), std::overflow_error,
+              fmt::format("too many sites: {}; expected <={}", sites.size(),
+                          SpinVector::max_size()));
+    _number_spins = static_cast<unsigned>(sites.size());
+    _cells.resize(size_t{_shape[0]} * _shape[1] * _shape[2],
+                  static_cast<uint16_t>(_number_spins));
+    for (auto i = size_t{0}; i < sites.size(); ++i) {
+        auto const [c, y, x] = sites[i];
+        TCM_CHECK(c < _shape[0] && y < _shape[1] && x < _shape[2],
+                  std::out_of_range,
+                  fmt::format("site {} is placed at ({}, {}, {}) which is "
+                              "outside of the ({}, {}, {}) lattice",
+                              i, c, y, x, _shape[0], _shape[1], _shape[2]));
+        auto& cell = _cells[(size_t{c} * _shape[1] + y) * _shape[2] + x];
+        TCM_CHECK(cell == _number_spins, std::invalid_argument,
+                  fmt::format("sites {} and {} are placed into the same cell "
+                              "({}, {}, {})",
+                              cell, i, c, y, x));
+        cell = static_cast<uint16_t>(i);
+    }
+}
+
+LatticeLayout::LatticeLayout(shape_type shape, gsl::span<int64_t const> cells,
+                             float const padding)
+    : _cells{}, _shape{shape}, _number_spins{}, _padding{padding}
+{
+    check_shape();
+    auto const number_cells = size_t{_shape[0]} * _shape[1] * _shape[2];
+    TCM_CHECK(cells.size() == number_cells, std::invalid_argument,
+              fmt::format("cells has wrong size: {}; expected {}",
+                          cells.size(), number_cells));
+    auto const max_site =
+        cells.empty() ? int64_t{-1}
+                      : *std::max_element(std::begin(cells), std::end(cells));
+    TCM_CHECK(max_site < static_cast<int64_t>(SpinVector::max_size()),
+              std::overflow_error,
+              fmt::format("too many sites: {}; expected <={}", max_site + 1,
+                          SpinVector::max_size()));
+    _number_spins = static_cast<unsigned>(max_site + 1);
+
+    std::vector<bool> used(_number_spins, false);
+    _cells.resize(number_cells);
+    for (auto j = size_t{0}; j < number_cells; ++j) {
+        auto const site = cells[j];
+        TCM_CHECK(site >= -1, std::invalid_argument,
+                  fmt::format("invalid site index in cell {}: {}", j, site));
+        if (site == -1) { _cells[j] = static_cast<uint16_t>(_number_spins); }
+        else {
+            _cells[j]                         = static_cast<uint16_t>(site);
+            used[static_cast<size_t>(site)] = true;
+        }
+    }
+    auto const unused = std::find(std::begin(used), std::end(used), false);
+    TCM_CHECK(unused == std::end(used), std::invalid_argument,
+              fmt::format("site {} is not placed onto the lattice",
+                          unused - std::begin(used)));
+}
+
+auto bind_lattice(PyObject* module) -> void
+{
+    namespace py = pybind11;
+    auto m       = py::module{py::reinterpret_borrow<py::object>(module)};
+
+    py::class_<LatticeLayout>(m, "LatticeLayout", R"EOF(
+        Placement of spins onto a ``(C, H, W)`` image. Use it to unpack
+        :py:class:`CompactSpin` directly into inputs of convolutional networks.
+    )EOF")
+        .def(py::init([](LatticeLayout::shape_type const&             shape,
+                         std::vector<LatticeLayout::site_type> const& sites,
+                         float const                                  padding) {
+                 return std::make_unique<LatticeLayout>(
+                     shape,
+                     gsl::span<LatticeLayout::site_type const>{sites.data(),
+                                                               sites.size()},
+                     padding);
+             }),
+             py::arg{"shape"}, py::arg{"sites"}, py::arg{"padding"} = 0.0f,
+             R"EOF(
+                 Creates a layout from positions of sites.
+
+                 :param shape: ``(C, H, W)`` shape of the image.
+                 :param sites: a list of ``(channel, y, x)`` tuples. ``sites[i]``
+                               is the cell where ``i``'th spin is placed.
+                 :param padding: value of cells which hold no spin.)EOF")
+        .def_static(
+            "from_cells",
+            [](LatticeLayout::shape_type const&            shape,
+               py::array_t<int64_t, py::array::c_style> cells,
+               float const                                 padding) {
+                return std::make_unique<LatticeLayout>(
+                    shape,
+                    gsl::span<int64_t const>{
+                        cells.data(), static_cast<size_t>(cells.size())},
+                    padding);
+            },
+            py::arg{"shape"}, py::arg{"cells"}, py::arg{"padding"} = 0.0f,
+            R"EOF(
+                Creates a layout from an explicit map of cells.
+
+                :param shape: ``(C, H, W)`` shape of the image.
+                :param cells: an array of ``C * H * W`` site indices. ``-1``
+                              denotes padding. The same site may appear
+                              multiple times which is useful for periodic
+                              boundary conditions.
+                :param padding: value of cells which hold no spin.)EOF")
+        .def_property_readonly("shape", &LatticeLayout::shape)
+        .def_property_readonly("number_spins", &LatticeLayout::number_spins)
+        .def_property_readonly("padding", &LatticeLayout::padding)
+        .def(
+            "unpack",
+            [](LatticeLayout const&                        self,
+               py::array_t<SpinVector, py::array::c_style> array,
+               std::string const&                          encoding) {
+                TCM_CHECK(array.ndim() == 1, std::domain_error,
+                          fmt::format("array has wrong number of dimensions: "
+                                      "{}; expected 1",
+                                      array.ndim()));
+                auto const* data = array.data();
+                return self.unpack(data, data + array.shape(0),
+                                   detail::parse_spin_encoding(encoding));
+            },
+            py::arg{"array"}.noconvert(), py::arg{"encoding"} = "sign",
+            R"EOF(
+                Unpacks an array of :py:class:`CompactSpin` into a float32
+                tensor of shape ``(len(array), C, H, W)``.
+
+                :param array: a one-dimensional array of :py:class:`CompactSpin`.
+                :param encoding: either ``"sign"`` or ``"binary"``.)EOF");
+}
+
+TCM_NAMESPACE_END
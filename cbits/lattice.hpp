@@ -0,0 +1,172 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+
+#include "common.hpp"
+#include "config.hpp"
+#include "errors.hpp"
+#include "spin.hpp"
+
+#include <gsl/gsl-lite.hpp>
+#include <torch/types.h>
+
+#include <array>
+#include <vector>
+
+TCM_NAMESPACE_BEGIN
+
+// [LatticeLayout] {{{
+/// Describes how spins of a `SpinVector` are placed onto a `[C, H, W]` image.
+///
+/// Convolutional networks want their input as `[batch, C, H, W]` tensors
+/// rather than `[batch, number_spins]`. Doing `view`/`cat` in Python to get
+/// there costs a few extra passes over the data. `LatticeLayout` precomputes
+/// for every cell of the image the site it holds, so `unpack` writes every
+/// output element exactly once.
+///
+/// A site may be mapped to multiple cells (e.g. to implement periodic
+/// boundary conditions without extra `torch.cat` calls). Cells which hold no
+/// site are filled with `padding`.
+class LatticeLayout {
+  public:
+    using shape_type = std::array<unsigned, 3>; ///< (C, H, W)
+    using site_type  = std::array<unsigned, 3>; ///< (channel, y, x)
+
+  private:
+    /// For every cell (in row-major order) -- index of the site it holds.
+    /// Padding cells hold `_number_spins`: this allows us to append `_padding`
+    /// to the row buffer and avoid branching in the inner loop.
+    aligned_vector<uint16_t> _cells;
+    shape_type               _shape;
+    unsigned                 _number_spins;
+    float                    _padding;
+
+  public:
+    /// Constructs a layout from positions of sites: `sites[i]` is the cell
+    /// which site `i` occupies.
+    LatticeLayout(shape_type shape, gsl::span<site_type const> sites,
+                  float padding = 0.0f);
+
+    /// Constructs a layout from an explicit map of cells: `cells[j]` is the
+    /// site which cell `j` holds or `-1` for padding. Every site must be used
+    /// at least once.
+    LatticeLayout(shape_type shape, gsl::span<int64_t const> cells,
+                  float padding = 0.0f);
+
+    LatticeLayout(LatticeLayout const&) = default;
+    LatticeLayout(LatticeLayout&&)      = default;
+    LatticeLayout& operator=(LatticeLayout const&) = default;
+    LatticeLayout& operator=(LatticeLayout&&) = default;
+
+    constexpr auto shape() const noexcept -> shape_type const&
+    {
+        return _shape;
+    }
+    constexpr auto number_spins() const noexcept -> unsigned
+    {
+        return _number_spins;
+    }
+    constexpr auto padding() const noexcept -> float { return _padding; }
+    auto number_cells() const noexcept -> size_t { return _cells.size(); }
+
+    /// Unpacks `[first, last)` into a contiguous float32 tensor `dst` of shape
+    /// `[last - first, C, H, W]`.
+    ///
+    /// \precondition `encoding != SpinEncoding::one_hot`: use multiple
+    ///               channels in the layout instead.
+    template <class RandomAccessIterator, class Projection = IdentityProjection>
+    auto unpack(RandomAccessIterator first, RandomAccessIterator last,
+                torch::Tensor dst, SpinEncoding encoding,
+                Projection proj = Projection{}) const -> void;
+
+    template <class RandomAccessIterator, class Projection = IdentityProjection>
+    auto unpack(RandomAccessIterator first, RandomAccessIterator last,
+                SpinEncoding encoding, Projection proj = Projection{}) const
+        -> torch::Tensor;
+
+  private:
+    auto check_shape() const -> void;
+};
+
+template <class RandomAccessIterator, class Projection>
+auto LatticeLayout::unpack(RandomAccessIterator first,
+                           RandomAccessIterator last, torch::Tensor dst,
+                           SpinEncoding const encoding, Projection proj) const
+    -> void
+{
+    TCM_CHECK(encoding != SpinEncoding::one_hot, std::invalid_argument,
+              "one-hot encoding is not supported by LatticeLayout; use "
+              "separate channels for spins up and down instead");
+    if (first == last) { return; }
+    TCM_ASSERT(last - first > 0, "Invalid range");
+    TCM_ASSERT(dst.dim() == 4, fmt::format("Invalid dimension {}", dst.dim()));
+    TCM_ASSERT(static_cast<int64_t>(last - first) == dst.size(0),
+               fmt::format("Sizes don't match: size={}, dst.size(0)={}",
+                           last - first, dst.size(0)));
+    TCM_ASSERT(dst.is_contiguous(), "Output tensor must be contiguous");
+    TCM_ASSERT(dst.scalar_type() == torch::kFloat32,
+               "Output tensor must be of type float32");
+
+    auto const values = detail::SpinValues<float>{
+        encoding == SpinEncoding::binary ? 0.0f : -1.0f, 1.0f};
+    // One extra element for padding
+    alignas(32) std::array<float, SpinVector::max_size() + 1> buffer;
+    buffer[_number_spins] = _padding;
+
+    auto const  number_cells = _cells.size();
+    auto const* cells        = _cells.data();
+    auto*       data         = dst.data_ptr<float>();
+    for (; first != last; ++first, data += number_cells) {
+        auto const spin = proj(*first);
+        TCM_CHECK(spin.size() == _number_spins, std::invalid_argument,
+                  fmt::format("spin configuration has wrong length: {}; "
+                              "expected {}",
+                              spin.size(), _number_spins));
+        detail::unpack_row(spin, buffer.data(), values);
+        for (auto j = size_t{0}; j < number_cells; ++j) {
+            data[j] = buffer[cells[j]];
+        }
+    }
+}
+
+template <class RandomAccessIterator, class Projection>
+auto LatticeLayout::unpack(RandomAccessIterator first,
+                           RandomAccessIterator last,
+                           SpinEncoding const encoding, Projection proj) const
+    -> torch::Tensor
+{
+    auto const size = static_cast<int64_t>(last - first);
+    auto out = detail::make_tensor<float>(size, _shape[0], _shape[1], _shape[2]);
+    unpack(first, last, out, encoding, std::move(proj));
+    return out;
+}
+// [LatticeLayout] }}}
+
+auto bind_lattice(PyObject*) -> void;
+
+TCM_NAMESPACE_END
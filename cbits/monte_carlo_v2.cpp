@@ -5,18 +5,23 @@
 #include <torch/extension.h>
 #include <torch/script.h>
 
+#include <algorithm>
+#include <array>
+
 TCM_NAMESPACE_BEGIN
 
 _Options::_Options(unsigned const _number_spins, int const _magnetisation,
                    unsigned const _number_chains,
                    unsigned const _number_samples, unsigned const _sweep_size,
-                   unsigned const _number_discarded)
+                   unsigned const                         _number_discarded,
+                   std::shared_ptr<SpinHamiltonian const> _hamiltonian)
     : number_spins{_number_spins}
     , magnetisation{_magnetisation}
     , number_chains{_number_chains}
     , number_samples{_number_samples}
     , sweep_size{_sweep_size}
     , number_discarded{_number_discarded}
+    , hamiltonian{std::move(_hamiltonian)}
 {
     TCM_CHECK(0 < number_spins && number_spins < SpinVector::max_size(),
               std::invalid_argument,
@@ -34,6 +39,15 @@ _Options::_Options(unsigned const _number_spins, int const _magnetisation,
     TCM_CHECK(0 < sweep_size, std::invalid_argument,
               fmt::format("invalid sweep_size: {}; expected a positive integer",
                           sweep_size));
+    TCM_CHECK(hamiltonian == nullptr || hamiltonian->size() == 0
+                  || hamiltonian->max_index() < number_spins,
+              std::invalid_argument,
+              fmt::format("hamiltonian acts on site {}, but there are only {} "
+                          "spins",
+                          hamiltonian != nullptr && hamiltonian->size() != 0
+                              ? hamiltonian->max_index()
+                              : size_t{0},
+                          number_spins));
 }
 
 namespace {
@@ -79,27 +93,23 @@ class Kernel {
     constexpr Kernel& operator=(Kernel const&) noexcept = default;
     constexpr Kernel& operator=(Kernel&&) noexcept = default;
 
-    auto operator()(gsl::span<SpinVector const> src,
-                    gsl::span<SpinVector>       dst) const -> void
+    /// Proposes new configurations `dst` given the current ones `src`, and
+    /// stores the ratios `q(dst → src) / q(src → dst)` of proposal
+    /// probabilities in `ratios`. For this kernel they are all `1`.
+    auto operator()(gsl::span<SpinVector const> src, gsl::span<SpinVector> dst,
+                    gsl::span<float> ratios) const -> void
     {
         using std::begin;
         using std::end;
-        TCM_ASSERT(src.size() == dst.size(), "dimensions don't match");
+        TCM_ASSERT(src.size() == dst.size() && src.size() == ratios.size(),
+                   "dimensions don't match");
+        std::fill(begin(ratios), end(ratios), 1.0F);
         auto m = magnetisation(src);
         auto n = static_cast<int>(size(src, dst));
 
         std::copy(begin(src), end(src), begin(dst));
         if (std::abs(m) < n) {
-            std::for_each(begin(dst), end(dst), [this, n, m](auto& s) {
-                auto const up =
-                    s.find_nth_up(std::uniform_int_distribution<unsigned>{
-                        0, static_cast<unsigned>(n + m) / 2 - 1}(*_generator));
-                auto const down =
-                    s.find_nth_down(std::uniform_int_distribution<unsigned>{
-                        0, static_cast<unsigned>(n - m) / 2 - 1}(*_generator));
-                s.flip(up);
-                s.flip(down);
-            });
+            random_exchange(dst, static_cast<unsigned>(n + m) / 2, *_generator);
         }
         TCM_ASSERT(
             std::all_of(begin(dst), end(dst),
@@ -108,6 +118,125 @@ class Kernel {
     }
 };
 
+/// Exchanges two anti-aligned spins connected by an edge of a Hamiltonian.
+///
+/// For every configuration, a byte mask of anti-aligned edges is computed
+/// from a structure-of-arrays representation of the edges (one word index
+/// and one bit mask per end), i.e. without branches. A random edge is then
+/// chosen among the anti-aligned ones. Since the number of such edges
+/// changes, the proposal is not symmetric and the kernel reports
+/// `q(σ' → σ) / q(σ → σ') = A(σ) / A(σ')` where `A` counts anti-aligned
+/// edges. The chain is ergodic if the graph is connected.
+class BondKernel {
+  private:
+    gsl::not_null<RandomGenerator*> _generator;
+    aligned_vector<uint16_t>        _first_words;
+    aligned_vector<uint16_t>        _first_masks;
+    aligned_vector<uint16_t>        _second_words;
+    aligned_vector<uint16_t>        _second_masks;
+    mutable aligned_vector<uint8_t> _anti_aligned; ///< Mask for one chain
+
+    /// Fills `_anti_aligned` for `spin` and returns the number of
+    /// anti-aligned edges.
+    auto anti_aligned(SpinVector const& spin) const noexcept -> unsigned
+    {
+        constexpr auto number_words = (SpinVector::max_size() + 15) / 16;
+        std::array<uint16_t, number_words> words;
+        for (auto i = 0u; i < number_words; ++i) {
+            words[i] = spin.word(i);
+        }
+        auto const  n     = _first_words.size();
+        auto*       mask  = _anti_aligned.data();
+        auto const* fw    = _first_words.data();
+        auto const* fm    = _first_masks.data();
+        auto const* sw    = _second_words.data();
+        auto const* sm    = _second_masks.data();
+        auto        count = 0u;
+        for (auto k = size_t{0}; k < n; ++k) {
+            mask[k] = static_cast<uint8_t>(((words[fw[k]] & fm[k]) == 0)
+                                           != ((words[sw[k]] & sm[k]) == 0));
+            count += mask[k];
+        }
+        return count;
+    }
+
+  public:
+    BondKernel(SpinHamiltonian const& hamiltonian, RandomGenerator& generator)
+        : _generator{&generator}
+        , _first_words{}
+        , _first_masks{}
+        , _second_words{}
+        , _second_masks{}
+        , _anti_aligned{}
+    {
+        std::vector<std::pair<uint16_t, uint16_t>> edges;
+        edges.reserve(hamiltonian.size());
+        for (auto const& edge : hamiltonian.edges()) {
+            if (edge.first == edge.second) { continue; }
+            edges.emplace_back(std::min(edge.first, edge.second),
+                               std::max(edge.first, edge.second));
+        }
+        std::sort(std::begin(edges), std::end(edges));
+        edges.erase(std::unique(std::begin(edges), std::end(edges)),
+                    std::end(edges));
+        TCM_CHECK(!edges.empty(), std::invalid_argument,
+                  "hamiltonian has no edges along which spins could be "
+                  "exchanged");
+        auto const mask = [](unsigned const i) {
+            return static_cast<uint16_t>(1u << (15u - i % 16u));
+        };
+        for (auto const& [first, second] : edges) {
+            _first_words.push_back(static_cast<uint16_t>(first / 16));
+            _first_masks.push_back(mask(first));
+            _second_words.push_back(static_cast<uint16_t>(second / 16));
+            _second_masks.push_back(mask(second));
+        }
+        _anti_aligned.resize(edges.size());
+    }
+
+    BondKernel(BondKernel const&) = default;
+    BondKernel(BondKernel&&)      = default;
+    BondKernel& operator=(BondKernel const&) = default;
+    BondKernel& operator=(BondKernel&&) = default;
+
+    auto operator()(gsl::span<SpinVector const> src, gsl::span<SpinVector> dst,
+                    gsl::span<float> ratios) const -> void
+    {
+        TCM_ASSERT(src.size() == dst.size() && src.size() == ratios.size(),
+                   "dimensions don't match");
+        using Dist  = std::uniform_int_distribution<unsigned>;
+        using Param = Dist::param_type;
+        Dist dist;
+        for (auto i = size_t{0}; i < src.size(); ++i) {
+            dst[i]           = src[i];
+            auto const count = anti_aligned(src[i]);
+            if (count == 0) {
+                ratios[i] = 1.0F;
+                continue;
+            }
+            // Index of the chosen edge among the anti-aligned ones
+            auto r = dist(*_generator, Param{0, count - 1});
+            auto k = size_t{0};
+            for (;; ++k) {
+                if (_anti_aligned[k] != 0) {
+                    if (r == 0) { break; }
+                    --r;
+                }
+            }
+            dst[i].flip_word(_first_words[k], _first_masks[k]);
+            dst[i].flip_word(_second_words[k], _second_masks[k]);
+            ratios[i] = static_cast<float>(count)
+                        / static_cast<float>(anti_aligned(dst[i]));
+        }
+        TCM_ASSERT(std::equal(src.begin(), src.end(), dst.begin(),
+                              [](auto const& x, auto const& y) {
+                                  return x.magnetisation()
+                                         == y.magnetisation();
+                              }),
+                   "post-condition violated");
+    }
+};
+
 
 template <class ForwardFn, class KernelFn>
 class MarkovChain {
@@ -125,15 +254,16 @@ class MarkovChain {
     SpinsT           _proposed_x;
     torch::Tensor    _proposed_x_unpacked;
     ValuesT          _current_y;
+    ValuesT          _ratios; ///< Ratios of proposal probabilities
     RandomGenerator& _generator;
     size_t           _accepted;
     size_t           _count;
 
-    static auto transition_probability(float current, float suggested) noexcept
-        -> float
+    static auto transition_probability(float current, float suggested,
+                                       float const ratio) noexcept -> float
     {
         current *= current;
-        suggested *= suggested;
+        suggested *= suggested * ratio;
         if (current <= suggested) return 1.0F;
         // return std::pow(suggested / current, 0.25F);
         return suggested / current;
@@ -168,14 +298,15 @@ class MarkovChain {
     }
 
   public:
-    MarkovChain(ForwardFn forward, KernelFn kernel, SpinsT initial,
-                RandomGenerator& generator)
+    MarkovChain(ForwardFn const& forward, KernelFn const& kernel,
+                SpinsT initial, RandomGenerator& generator)
         : _forward{forward}
         , _kernel{kernel}
         , _current_x{std::move(initial)}
         , _proposed_x{}
         , _proposed_x_unpacked{}
         , _current_y{}
+        , _ratios{}
         , _generator{generator}
         , _accepted{0}
         , _count{0}
@@ -186,6 +317,7 @@ class MarkovChain {
         _proposed_x.resize(_current_x.size());
         _proposed_x_unpacked = detail::make_tensor<float>(_current_x.size(), n);
         _current_y.resize(_current_x.size());
+        _ratios.resize(_current_x.size());
 
         // Forward propagation on the initial state
         unpack_to_tensor(begin(_current_x), end(_current_x),
@@ -219,15 +351,17 @@ class MarkovChain {
         using std::begin;
         using std::end;
 
-        _kernel(_current_x, _proposed_x);
+        _kernel(_current_x, _proposed_x, _ratios);
         unpack_to_tensor(begin(_proposed_x), end(_proposed_x),
                          _proposed_x_unpacked);
         auto const output     = _forward(_proposed_x_unpacked);
         auto const proposed_y = output.template accessor<float, 1>();
 
         for (auto i = size_t{0}; i < _current_x.size(); ++i) {
-            auto const p = transition_probability(
-                _current_y[i], proposed_y[static_cast<int64_t>(i)]);
+            auto const p =
+                transition_probability(_current_y[i],
+                                       proposed_y[static_cast<int64_t>(i)],
+                                       _ratios[i]);
             if (random() <= p) {
                 ++_accepted;
                 _current_x[i] = _proposed_x[i];
@@ -255,25 +389,20 @@ auto make_markov_chain(ForwardFn const& forward, KernelFn const& kernel,
                        RandomGenerator& generator)
     -> MarkovChain<ForwardFn, KernelFn>
 {
-    typename MarkovChain<ForwardFn, KernelFn>::SpinsT initial;
-    initial.reserve(number_chains);
-    for (auto i = 0u; i < number_chains; ++i) {
-        initial.push_back(
-            SpinVector::random(number_spins, magnetisation, generator));
-    }
+    auto initial =
+        random_spins(number_spins, magnetisation, number_chains, generator);
     return MarkovChain<ForwardFn, KernelFn>{forward, kernel, std::move(initial),
                                             generator};
 }
 
 
-template <class ForwardFn>
-auto _sample_some(ForwardFn const& psi, _Options const& options,
-                  RandomGenerator* gen = nullptr)
+template <class ForwardFn, class KernelFn>
+auto _sample_some(ForwardFn const& psi, KernelFn const& kernel,
+                  _Options const& options, RandomGenerator& generator)
 {
-    auto&      generator = (gen != nullptr) ? *gen : global_random_generator();
-    auto       chain     = make_markov_chain(psi, Kernel{generator},
-                                   options.number_chains, options.number_spins,
-                                   options.magnetisation, generator);
+    auto       chain = make_markov_chain(psi, kernel, options.number_chains,
+                                   options.number_spins, options.magnetisation,
+                                   generator);
     auto const count = (options.number_samples + options.number_chains - 1)
                        / options.number_chains;
 
@@ -309,6 +438,19 @@ auto _sample_some(ForwardFn const& psi, _Options const& options,
     return std::make_tuple(std::move(spins), std::move(values), acceptance);
 }
 
+template <class ForwardFn>
+auto _sample_some(ForwardFn const& psi, _Options const& options,
+                  RandomGenerator* gen = nullptr)
+{
+    auto& generator = (gen != nullptr) ? *gen : global_random_generator();
+    if (options.hamiltonian != nullptr) {
+        auto const kernel = BondKernel{*options.hamiltonian, generator};
+        return _sample_some(psi, kernel, options, generator);
+    }
+    auto const kernel = Kernel{generator};
+    return _sample_some(psi, kernel, options, generator);
+}
+
 } // namespace
 
 namespace v2 {
@@ -337,33 +479,25 @@ auto sample_some(std::function<auto(torch::Tensor const&)->torch::Tensor> state,
 }
 } // namespace v2
 
-template <class T, class Allocator>
-inline auto to_numpy_array(std::vector<T, Allocator>&& xs) -> pybind11::array
-{
-    using V         = std::vector<T, Allocator>;
-    auto const size = xs.size();
-    auto const data = xs.data();
-    auto       base = pybind11::capsule{new V{std::move(xs)},
-                                  [](void* p) { delete static_cast<V*>(p); }};
-    return py::array_t<T>{size, data, std::move(base)};
-}
-
 auto bind_monte_carlo(PyObject* module) -> void
 {
     namespace py = pybind11;
     auto m       = py::module{py::reinterpret_borrow<py::object>(module)};
 
     py::class_<_Options>(m, "_Options")
-        .def(py::init<unsigned, int, unsigned, unsigned, unsigned, unsigned>(),
+        .def(py::init<unsigned, int, unsigned, unsigned, unsigned, unsigned,
+                      std::shared_ptr<SpinHamiltonian const>>(),
              py::arg{"number_spins"}, py::arg{"magnetisation"},
              py::arg{"number_chains"}, py::arg{"number_samples"},
-             py::arg{"sweep_size"}, py::arg{"number_discarded"})
+             py::arg{"sweep_size"}, py::arg{"number_discarded"},
+             py::arg{"hamiltonian"} = py::none())
         .def_readonly("number_spins", &_Options::number_spins)
         .def_readonly("magnetisation", &_Options::magnetisation)
         .def_readonly("number_chains", &_Options::number_chains)
         .def_readonly("number_samples", &_Options::number_samples)
         .def_readonly("sweep_size", &_Options::sweep_size)
-        .def_readonly("number_discarded", &_Options::number_discarded);
+        .def_readonly("number_discarded", &_Options::number_discarded)
+        .def_readonly("hamiltonian", &_Options::hamiltonian);
 
     m.def("_sample_some",
           [](std::string const& filename, _Options const& options) {
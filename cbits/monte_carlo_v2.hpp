@@ -28,9 +28,12 @@
 
 #pragma once
 
+#include "polynomial.hpp"
 #include "random.hpp"
 #include "spin.hpp"
 
+#include <memory>
+
 TCM_NAMESPACE_BEGIN
 
 struct _Options {
@@ -40,15 +43,19 @@ struct _Options {
     unsigned number_samples;
     unsigned sweep_size;
     unsigned number_discarded;
+    /// If not `nullptr`, spins are only exchanged along edges of this
+    /// Hamiltonian. Otherwise, any spin up can be exchanged with any spin down.
+    std::shared_ptr<SpinHamiltonian const> hamiltonian;
 
     _Options(unsigned number_spins, int magnetisation, unsigned number_chains,
              unsigned number_samples, unsigned sweep_size,
-             unsigned number_discarded);
+             unsigned                               number_discarded,
+             std::shared_ptr<SpinHamiltonian const> hamiltonian = nullptr);
 
-    constexpr _Options(_Options const&) noexcept = default;
-    constexpr _Options(_Options&&) noexcept      = default;
-    constexpr _Options& operator=(_Options const&) noexcept = default;
-    constexpr _Options& operator=(_Options&&) noexcept = default;
+    _Options(_Options const&)     = default;
+    _Options(_Options&&) noexcept = default;
+    _Options& operator=(_Options const&) = default;
+    _Options& operator=(_Options&&) noexcept = default;
 };
 
 namespace v2 {
@@ -44,9 +44,23 @@ auto bind_polynomial_state(py::module m) -> void
             return std::make_unique<PolynomialStateV2>(
                 std::move(polynomial), load_forward_fn(state), input_shape);
         }))
-        .def("__call__", [](PolynomialStateV2&                          self,
-                            py::array_t<SpinVector, py::array::c_style> spins) {
-            return self({spins.data(0), static_cast<size_t>(spins.shape(0))});
+        .def(py::init([](std::shared_ptr<ChebyshevFilter> filter,
+                         std::string const&               state,
+                         std::pair<size_t, size_t>        input_shape) {
+            return std::make_unique<PolynomialStateV2>(
+                std::move(filter), load_forward_fn(state), input_shape);
+        }))
+        .def("__call__",
+             [](PolynomialStateV2&                          self,
+                py::array_t<SpinVector, py::array::c_style> spins,
+                bool const                                  shared_support) {
+                 return self(
+                     {spins.data(0), static_cast<size_t>(spins.shape(0))},
+                     shared_support);
+             },
+             py::arg{"spins"}, py::arg{"shared_support"} = false)
+        .def("__call__", [](PolynomialStateV2& self, SectorBasis const& basis) {
+            return self(basis);
         });
 }
 } // namespace
@@ -66,9 +80,18 @@ PYBIND11_MODULE(_C_nqs, m)
     using namespace tcm;
 
     bind_spin(m.ptr());
+    bind_lattice(m.ptr());
+    bind_sort(m.ptr());
     bind_heisenberg(m);
     bind_explicit_state(m);
     bind_polynomial(m);
+    bind_symmetry(m.ptr());
+    bind_sector(m.ptr());
+    bind_lanczos(m.ptr());
+    bind_hamiltonian_io(m.ptr());
+    bind_observable(m.ptr());
+    bind_sr(m.ptr());
+    bind_jacobian(m.ptr());
     // bind_options(m);
     // bind_chain_result(m);
     // bind_sampling(m);
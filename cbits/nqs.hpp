@@ -32,11 +32,20 @@
 #include "config.hpp"
 // #include "data.hpp"
 #include "errors.hpp"
+#include "hamiltonian_io.hpp"
+#include "jacobian.hpp"
+#include "lanczos.hpp"
+#include "lattice.hpp"
 #include "monte_carlo_v2.hpp"
 // #include "monte_carlo.hpp"
 // #include "nn.hpp"
+#include "observable.hpp"
 // #include "parallel.hpp"
 #include "polynomial.hpp"
 #include "polynomial_state.hpp"
 #include "random.hpp"
+#include "sector.hpp"
+#include "sort.hpp"
+#include "sr.hpp"
+#include "symmetry.hpp"
 #include "spin.hpp"
@@ -0,0 +1,320 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "observable.hpp"
+#include "parallel.hpp"
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+#include <algorithm>
+#include <limits>
+#include <numeric>
+
+TCM_NAMESPACE_BEGIN
+
+ObservableEstimator::ObservableEstimator(
+    std::vector<std::shared_ptr<SpinHamiltonian const>> observables)
+    : _observables{std::move(observables)}
+    , _pairs{}
+    , _terms{}
+    , _offsets{}
+    , _stats{}
+    , _number_spins{0}
+{
+    auto const mask = [](unsigned const i) {
+        return static_cast<uint16_t>(1u << (15u - i % 16u));
+    };
+    // Maps (i, j) with i < j to its index in _pairs
+    auto index = ska::bytell_hash_map<uint32_t, uint32_t>{};
+    _offsets.reserve(_observables.size() + 1);
+    _offsets.push_back(0);
+    for (auto const& observable : _observables) {
+        TCM_CHECK(observable != nullptr, std::invalid_argument,
+                  "observable must not be None");
+        TCM_CHECK(!observable->has_fields(), std::invalid_argument,
+                  "observables with fields are not supported");
+        for (auto const& edge : observable->edges()) {
+            auto const i   = std::min(edge.first, edge.second);
+            auto const j   = std::max(edge.first, edge.second);
+            auto const key = (static_cast<uint32_t>(i) << 16) | j;
+            auto [where, inserted] =
+                index.emplace(key, static_cast<uint32_t>(_pairs.size()));
+            if (inserted) {
+                _pairs.push_back({static_cast<uint16_t>(i / 16),
+                                  static_cast<uint16_t>(j / 16), mask(i),
+                                  mask(j), false});
+            }
+            auto& pair = _pairs[where->second];
+            pair.off_diagonal =
+                pair.off_diagonal || edge.xy != real_type{0};
+            _terms.push_back({edge.zz, edge.xy, where->second});
+            _number_spins = std::max(_number_spins, j + 1u);
+        }
+        TCM_CHECK(_terms.size() <= std::numeric_limits<uint32_t>::max(),
+                  std::invalid_argument, "too many terms");
+        _offsets.push_back(static_cast<uint32_t>(_terms.size()));
+    }
+    _stats.resize(_observables.size());
+}
+
+auto ObservableEstimator::reset() noexcept -> void
+{
+    std::fill(std::begin(_stats), std::end(_stats), RunningStats{});
+}
+
+auto ObservableEstimator::check_spins(gsl::span<SpinVector const> spins) const
+    -> void
+{
+    for (auto const& spin : spins) {
+        TCM_CHECK(spin.size() >= _number_spins, std::invalid_argument,
+                  fmt::format("spin configuration is too short: {}; "
+                              "expected >={}",
+                              spin.size(), _number_spins));
+    }
+}
+
+auto ObservableEstimator::number_neighbours(SpinVector const spin) const
+    noexcept -> unsigned
+{
+    auto count = 0u;
+    for (auto const& pair : _pairs) {
+        count += pair.off_diagonal && is_flipped(pair, spin);
+    }
+    return count;
+}
+
+auto ObservableEstimator::neighbours(gsl::span<SpinVector const> spins) const
+    -> std::tuple<aligned_vector<int64_t>, aligned_vector<SpinVector>>
+{
+    check_spins(spins);
+    auto const n       = static_cast<int64_t>(spins.size());
+    auto       offsets = aligned_vector<int64_t>(spins.size() + 1);
+    parallel_for(
+        0, n,
+        [this, spins, counts = offsets.data() + 1](auto const i) {
+            counts[i] = number_neighbours(spins[static_cast<size_t>(i)]);
+        },
+        /*cutoff=*/64);
+    std::partial_sum(std::begin(offsets), std::end(offsets),
+                     std::begin(offsets));
+
+    auto neighbours =
+        aligned_vector<SpinVector>(static_cast<size_t>(offsets.back()));
+    parallel_for(
+        0, n,
+        [this, spins, offsets = offsets.data(),
+         neighbours = neighbours.data()](auto const i) {
+            auto const spin = spins[static_cast<size_t>(i)];
+            auto*      out  = neighbours + offsets[i];
+            for (auto const& pair : _pairs) {
+                if (pair.off_diagonal && is_flipped(pair, spin)) {
+                    auto neighbour = spin;
+                    neighbour.flip_word(pair.first_word, pair.first_mask);
+                    neighbour.flip_word(pair.second_word, pair.second_mask);
+                    *(out++) = neighbour;
+                }
+            }
+            TCM_ASSERT(out == neighbours + offsets[i + 1],
+                       "Bug! number_neighbours is broken");
+        },
+        /*cutoff=*/64);
+    return {std::move(offsets), std::move(neighbours)};
+}
+
+auto ObservableEstimator::update(
+    gsl::span<SpinVector const>   spins,
+    gsl::span<complex_type const> log_psi,
+    gsl::span<complex_type const> neighbour_log_psi) -> void
+{
+    check_spins(spins);
+    TCM_CHECK(log_psi.size() == spins.size(), std::invalid_argument,
+              fmt::format("log_psi has wrong length: {}; expected {}",
+                          log_psi.size(), spins.size()));
+    // Offsets are cheap to recompute and this way we don't have to trust the
+    // caller to pass the right ones
+    auto offsets = aligned_vector<int64_t>(spins.size() + 1);
+    for (auto i = size_t{0}; i < spins.size(); ++i) {
+        offsets[i + 1] = offsets[i] + number_neighbours(spins[i]);
+    }
+    TCM_CHECK(static_cast<size_t>(offsets.back()) == neighbour_log_psi.size(),
+              std::invalid_argument,
+              fmt::format("neighbour_log_psi has wrong length: {}; expected {}",
+                          neighbour_log_psi.size(), offsets.back()));
+
+    auto const n              = spins.size();
+    auto const number_threads = n < 1024 ? 1 : omp_get_max_threads();
+    // Every thread accumulates into its own row, and rows are merged in
+    // order afterwards such that the result doesn't depend on scheduling.
+    auto partial = std::vector<RunningStats>(
+        static_cast<size_t>(number_threads) * _stats.size());
+    // For every pair: ⟨σ|σᶻᵢσᶻⱼ|σ⟩ and ψ(σ')/ψ(σ) (or 0 if (i, j) can't be
+    // exchanged). Buffers are allocated here, because exceptions must not
+    // escape the parallel region.
+    auto signs = std::vector<real_type>(static_cast<size_t>(number_threads)
+                                        * _pairs.size());
+    auto ratios = std::vector<complex_type>(
+        static_cast<size_t>(number_threads) * _pairs.size());
+#pragma omp parallel num_threads(number_threads) default(none)                 \
+    firstprivate(n, spins, log_psi, neighbour_log_psi)                         \
+        shared(offsets, partial, signs, ratios)
+    {
+        auto const num_threads = static_cast<size_t>(omp_get_num_threads());
+        auto const thread_id   = static_cast<size_t>(omp_get_thread_num());
+        auto const rest        = n % num_threads;
+        auto const chunk_size  = n / num_threads + (thread_id < rest);
+        auto const begin =
+            thread_id * chunk_size + (thread_id >= rest) * rest;
+        auto const end   = std::min(begin + chunk_size, n);
+        auto*      stats = partial.data() + thread_id * _stats.size();
+        auto*      sign  = signs.data() + thread_id * _pairs.size();
+        auto*      ratio = ratios.data() + thread_id * _pairs.size();
+        for (auto s = begin; s < end; ++s) {
+            auto const spin = spins[s];
+            auto const* log_neighbour =
+                neighbour_log_psi.data() + offsets[s];
+            for (auto p = size_t{0}; p < _pairs.size(); ++p) {
+                auto const& pair    = _pairs[p];
+                auto const  flipped = is_flipped(pair, spin);
+                sign[p]  = flipped ? real_type{-1} : real_type{1};
+                ratio[p] = flipped && pair.off_diagonal
+                                ? std::exp(*(log_neighbour++) - log_psi[s])
+                                : complex_type{0};
+            }
+            for (auto k = size_t{0}; k < _stats.size(); ++k) {
+                auto value = complex_type{0};
+                for (auto t = _offsets[k]; t < _offsets[k + 1]; ++t) {
+                    auto const& term = _terms[t];
+                    value += term.zz * sign[term.pair]
+                             + real_type{2} * term.xy * ratio[term.pair];
+                }
+                stats[k].push(value);
+            }
+        }
+    }
+    for (auto t = size_t{0}; t < static_cast<size_t>(number_threads); ++t) {
+        for (auto k = size_t{0}; k < _stats.size(); ++k) {
+            _stats[k].merge(partial[t * _stats.size() + k]);
+        }
+    }
+}
+
+auto bind_observable(PyObject* module) -> void
+{
+    namespace py = pybind11;
+    auto m       = py::module{py::reinterpret_borrow<py::object>(module)};
+
+    using SpinArray    = py::array_t<SpinVector, py::array::c_style>;
+    using ComplexArray = py::array_t<complex_type, py::array::c_style
+                                                       | py::array::forcecast>;
+    auto const to_span = [](auto const& xs) {
+        TCM_CHECK(xs.ndim() == 1, std::domain_error,
+                  fmt::format("expected a 1-dimensional array, but got an "
+                              "array of dimension {}",
+                              xs.ndim()));
+        return gsl::span<std::remove_const_t<
+            std::remove_pointer_t<decltype(xs.data())>> const>{
+            xs.data(), static_cast<size_t>(xs.shape(0))};
+    };
+
+    py::class_<ObservableEstimator>(m, "ObservableEstimator")
+        .def(py::init<std::vector<std::shared_ptr<SpinHamiltonian const>>>(),
+             py::arg{"observables"},
+             R"EOF(
+                 Creates an estimator for a list of two-site observables.
+
+                 :param observables: a list of :py:class:`SpinHamiltonian`
+                     (without fields), e.g. ``SpinHamiltonian([(0.25, 0.25,
+                     i, j)])`` for ``Sᵢ·Sⱼ``.
+             )EOF")
+        .def("__len__", &ObservableEstimator::size)
+        .def("reset", &ObservableEstimator::reset,
+             R"EOF(Forgets all the samples seen so far.)EOF")
+        .def(
+            "neighbours",
+            [to_span](ObservableEstimator const& self, SpinArray spins) {
+                auto [offsets, neighbours] = self.neighbours(to_span(spins));
+                return py::make_tuple(to_numpy_array(std::move(offsets)),
+                                      to_numpy_array(std::move(neighbours)));
+            },
+            py::arg{"spins"},
+            R"EOF(
+                 Lists configurations for which ``log(ψ)`` has to be computed
+                 before calling :py:meth:`update`.
+
+                 :return: a tuple ``(offsets, neighbours)``.
+            )EOF")
+        .def(
+            "update",
+            [to_span](ObservableEstimator& self, SpinArray spins,
+                      ComplexArray log_values,
+                      ComplexArray neighbour_log_values) {
+                self.update(to_span(spins), to_span(log_values),
+                            to_span(neighbour_log_values));
+            },
+            py::arg{"spins"}, py::arg{"log_values"},
+            py::arg{"neighbour_log_values"},
+            R"EOF(
+                 Evaluates all observables on ``spins`` and updates the
+                 running means and variances.
+
+                 :param spins: Monte Carlo samples.
+                 :param log_values: ``log(ψ(σ))`` for every sample.
+                 :param neighbour_log_values: ``log(ψ(σ'))`` for every ``σ'``
+                     returned by :py:meth:`neighbours`.
+            )EOF")
+        .def_property_readonly(
+            "count",
+            [](ObservableEstimator const& self) {
+                return self.stats().empty() ? uint64_t{0}
+                                            : self.stats()[0].count;
+            },
+            R"EOF(Number of samples seen so far.)EOF")
+        .def_property_readonly(
+            "means",
+            [](ObservableEstimator const& self) {
+                auto means = aligned_vector<complex_type>{};
+                means.reserve(self.size());
+                for (auto const& x : self.stats()) {
+                    means.push_back(x.mean);
+                }
+                return to_numpy_array(std::move(means));
+            },
+            R"EOF(Running means of local estimators.)EOF")
+        .def_property_readonly(
+            "variances",
+            [](ObservableEstimator const& self) {
+                auto variances = aligned_vector<real_type>{};
+                variances.reserve(self.size());
+                for (auto const& x : self.stats()) {
+                    variances.push_back(x.variance());
+                }
+                return to_numpy_array(std::move(variances));
+            },
+            R"EOF(Running (unbiased) variances of local estimators.)EOF");
+}
+
+TCM_NAMESPACE_END
@@ -0,0 +1,184 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+
+#include "config.hpp"
+#include "errors.hpp"
+#include "polynomial.hpp"
+
+#include <gsl/gsl-lite.hpp>
+
+#include <memory>
+#include <tuple>
+#include <vector>
+
+TCM_NAMESPACE_BEGIN
+
+/// Running mean and variance of a stream of complex numbers.
+///
+/// Values are added one by one using Welford's algorithm, and accumulators
+/// for disjoint parts of the stream are combined using the pairwise formula
+/// of Chan, Golub & LeVeque. Both are numerically stable.
+struct RunningStats {
+    uint64_t     count = 0;
+    complex_type mean  = 0;
+    real_type    m2    = 0; ///< ∑|xᵢ - mean|²
+
+    auto push(complex_type const x) noexcept -> void
+    {
+        ++count;
+        auto const delta = x - mean;
+        mean += delta / static_cast<real_type>(count);
+        m2 += std::real(delta * std::conj(x - mean));
+    }
+
+    auto merge(RunningStats const& other) noexcept -> void
+    {
+        if (other.count == 0) { return; }
+        auto const total = count + other.count;
+        auto const delta = other.mean - mean;
+        auto const n_a   = static_cast<real_type>(count);
+        auto const n_b   = static_cast<real_type>(other.count);
+        mean += delta * (n_b / static_cast<real_type>(total));
+        m2 += other.m2 + std::norm(delta) * (n_a * n_b)
+                             / static_cast<real_type>(total);
+        count = total;
+    }
+
+    /// Returns the (unbiased) sample variance.
+    auto variance() const noexcept -> real_type
+    {
+        return count > 1 ? m2 / static_cast<real_type>(count - 1)
+                         : real_type{0};
+    }
+};
+
+/// \brief Estimates expectation values of many two-site observables on
+/// Monte Carlo samples in a single pass.
+///
+/// Every observable is given as a #SpinHamiltonian, e.g. `Sᵢ·Sⱼ` is a single
+/// edge with `Jᶻ = Jˣʸ = 1/4`. For a sample `σ`, the local estimator
+///
+///     O_loc(σ) = ∑_σ' ⟨σ|O|σ'⟩ ψ(σ')/ψ(σ)
+///
+/// needs `ψ` of configurations obtained by exchanging two anti-aligned spins
+/// of `σ`. Site pairs are shared between all observables, so such
+/// configurations are listed (see #neighbours) and evaluated only once per
+/// sample. Diagonal parts are computed with bit tests on the words of
+/// #SpinVector, the same way as in the #SpinHamiltonian kernel.
+class ObservableEstimator {
+  private:
+    /// A pair of sites `(i, j)` in the format of the #SpinHamiltonian kernel
+    struct Pair {
+        uint16_t first_word;
+        uint16_t second_word;
+        uint16_t first_mask;
+        uint16_t second_mask;
+        bool     off_diagonal; ///< Whether some term has `Jˣʸ != 0`
+    };
+
+    struct Term {
+        real_type zz;
+        real_type xy;
+        uint32_t  pair; ///< Index in `_pairs`
+    };
+
+    std::vector<std::shared_ptr<SpinHamiltonian const>> _observables;
+    std::vector<Pair>     _pairs; ///< Union of sites pairs of all observables
+    std::vector<Term>     _terms; ///< Terms of all observables
+    std::vector<uint32_t> _offsets; ///< Terms of the `k`'th observable are
+                                    ///< `_terms[_offsets[k]:_offsets[k + 1]]`
+    std::vector<RunningStats> _stats; ///< One accumulator per observable
+    unsigned                  _number_spins; ///< Minimal length of samples
+
+  public:
+    explicit ObservableEstimator(
+        std::vector<std::shared_ptr<SpinHamiltonian const>> observables);
+
+    ObservableEstimator(ObservableEstimator const&) = default;
+    ObservableEstimator(ObservableEstimator&&)      = default;
+    ObservableEstimator& operator=(ObservableEstimator const&) = default;
+    ObservableEstimator& operator=(ObservableEstimator&&) = default;
+
+    /// Returns the number of observables.
+    auto size() const noexcept -> size_t { return _observables.size(); }
+
+    auto observables() const noexcept
+        -> gsl::span<std::shared_ptr<SpinHamiltonian const> const>
+    {
+        return _observables;
+    }
+
+    /// Returns the accumulated statistics (one per observable).
+    auto stats() const noexcept -> gsl::span<RunningStats const>
+    {
+        return _stats;
+    }
+
+    /// Forgets all the samples seen so far.
+    auto reset() noexcept -> void;
+
+    /// Lists configurations `σ'` for which `ψ(σ')` is needed to evaluate all
+    /// observables on `spins`.
+    ///
+    /// \return A tuple `(offsets, neighbours)` where the configurations
+    ///         needed for `spins[i]` are
+    ///         `neighbours[offsets[i]:offsets[i + 1]]`.
+    auto neighbours(gsl::span<SpinVector const> spins) const
+        -> std::tuple<aligned_vector<int64_t>, aligned_vector<SpinVector>>;
+
+    /// Evaluates local estimators of all observables on `spins` and adds
+    /// them to the running statistics.
+    ///
+    /// \param spins            Monte Carlo samples `σ`.
+    /// \param log_psi          `log(ψ(σ))` for every sample.
+    /// \param neighbour_log_psi `log(ψ(σ'))` for every `σ'` returned by
+    ///                         `neighbours(spins)` (in the same order).
+    auto update(gsl::span<SpinVector const>   spins,
+                gsl::span<complex_type const> log_psi,
+                gsl::span<complex_type const> neighbour_log_psi) -> void;
+
+  private:
+    auto check_spins(gsl::span<SpinVector const> spins) const -> void;
+
+    /// Returns whether spins of `pair` are anti-aligned in `spin`.
+    static TCM_FORCEINLINE auto is_flipped(Pair const&      pair,
+                                           SpinVector const spin) noexcept
+        -> bool
+    {
+        return ((spin.word(pair.first_word) & pair.first_mask) == 0)
+               != ((spin.word(pair.second_word) & pair.second_mask) == 0);
+    }
+
+    /// Returns the number of `σ'` needed for `spin`.
+    auto number_neighbours(SpinVector spin) const noexcept -> unsigned;
+};
+
+auto bind_observable(PyObject*) -> void;
+
+TCM_NAMESPACE_END
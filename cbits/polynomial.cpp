@@ -80,61 +80,371 @@ auto values(QuantumState const& psi, bool only_real) -> torch::Tensor
 auto items(QuantumState const& psi, bool only_real)
     -> std::pair<aligned_vector<SpinVector>, torch::Tensor>
 {
-    return std::make_pair(keys(psi), values(psi, only_real));
+    // Calling keys and values would traverse the table twice
+    aligned_vector<SpinVector> spins(psi.size());
+    auto coeffs = only_real ? detail::make_tensor<float>(psi.size())
+                            : detail::make_tensor<float>(psi.size(), 2);
+    auto i      = size_t{0};
+    if (only_real) {
+        auto* data = reinterpret_cast<float*>(coeffs.data_ptr());
+        for (auto const& item : psi) {
+            spins[i]  = item.first;
+            data[i++] = static_cast<float>(item.second.real());
+        }
+    }
+    else {
+        auto* data = reinterpret_cast<std::complex<float>*>(coeffs.data_ptr());
+        for (auto const& item : psi) {
+            spins[i]  = item.first;
+            data[i++] = static_cast<std::complex<float>>(item.second);
+        }
+    }
+    return std::make_pair(std::move(spins), std::move(coeffs));
+}
+
+auto compact(QuantumState& psi)
+    -> std::pair<aligned_vector<SpinVector>, aligned_vector<complex_type>>
+{
+    aligned_vector<SpinVector>   spins(psi.size());
+    aligned_vector<complex_type> coeffs(psi.size());
+    auto                         i = size_t{0};
+    for (auto const& item : psi) {
+        spins[i]  = item.first;
+        coeffs[i] = item.second;
+        ++i;
+    }
+    psi.clear();
+    return std::make_pair(std::move(spins), std::move(coeffs));
+}
+
+auto lookup(QuantumState const& psi, gsl::span<SpinVector const> spins,
+            gsl::span<complex_type> out) -> void
+{
+    TCM_CHECK(spins.size() == out.size(), std::invalid_argument,
+              fmt::format("spins and out have different lengths: {} != {}",
+                          spins.size(), out.size()));
+    // Lookups don't modify the table, so it's safe to do them in parallel
+    parallel_for(
+        0, static_cast<int64_t>(spins.size()),
+        [&psi, spins, out](auto const i) {
+            auto const j = static_cast<size_t>(i);
+            auto const x = psi.find(spins[j]);
+            out[j]       = x != psi.end() ? x->second : complex_type{0};
+        },
+        /*cutoff=*/1024);
 }
 
-Heisenberg::Heisenberg(spec_type edges)
+auto update(QuantumState& psi, gsl::span<SpinVector const> spins,
+            gsl::span<complex_type const> values) -> void
+{
+    TCM_CHECK(spins.size() == values.size(), std::invalid_argument,
+              fmt::format("spins and values have different lengths: {} != {}",
+                          spins.size(), values.size()));
+    // Everything is validated upfront, so that `psi` is left untouched if
+    // any of the inputs is invalid
+    for (auto i = size_t{0}; i < spins.size(); ++i) {
+        TCM_CHECK(spins[i].size() <= SpinVector::max_size()
+                      && spins[i].is_valid(),
+                  std::invalid_argument,
+                  fmt::format("invalid spin configuration at index {}; "
+                              "expected at most {} spins with unused bits set "
+                              "to zero",
+                              i, SpinVector::max_size()));
+        TCM_CHECK(detail::is_finite(values[i]), std::invalid_argument,
+                  fmt::format("invalid value ({}, {}) at index {}; expected a "
+                              "finite (i.e. either normal, subnormal or zero) "
+                              "complex float",
+                              values[i].real(), values[i].imag(), i));
+    }
+    for (auto i = size_t{0}; i < spins.size(); ++i) {
+        psi[spins[i]] = values[i];
+    }
+}
+
+SpinHamiltonian::SpinHamiltonian(edge_list edges, std::vector<real_type> fields)
     : _edges{std::move(edges)}
+    , _fields{std::move(fields)}
+    , _groups{}
+    , _first_masks{}
+    , _second_masks{}
     , _max_index{std::numeric_limits<unsigned>::max()}
+    , _isotropic{true}
+    , _has_fields{false}
 {
+    auto max_index = -1;
     for (auto const& edge : _edges) {
-        auto const coupling = std::get<0>(edge);
+        TCM_CHECK(std::isfinite(edge.zz) && std::isfinite(edge.xy),
+                  std::invalid_argument,
+                  fmt::format("invalid coupling: ({}, {}); expected finite "
+                              "(i.e. either normal, subnormal or zero) floats",
+                              edge.zz, edge.xy));
+        TCM_CHECK(edge.first != edge.second, std::invalid_argument,
+                  fmt::format("invalid edge: ({}, {}); self-loops are not "
+                              "supported",
+                              edge.first, edge.second));
+        _isotropic = _isotropic && edge.zz == edge.xy;
+        max_index  = std::max({max_index, static_cast<int>(edge.first),
+                              static_cast<int>(edge.second)});
+    }
+    for (auto const h : _fields) {
+        TCM_CHECK(std::isfinite(h), std::invalid_argument,
+                  fmt::format("invalid field: {}; expected a finite (i.e. "
+                              "either normal, subnormal or zero) float",
+                              h));
+        _has_fields = _has_fields || h != real_type{0};
+    }
+    // Trailing zero fields don't act on any site
+    while (!_fields.empty() && _fields.back() == real_type{0}) {
+        _fields.pop_back();
+    }
+    TCM_CHECK(_fields.empty() || !_edges.empty(), std::invalid_argument,
+              "hamiltonians with fields, but without edges are not supported");
+    max_index = std::max(max_index, static_cast<int>(_fields.size()) - 1);
+    if (max_index >= 0) { _max_index = static_cast<unsigned>(max_index); }
+    build_groups();
+}
+
+auto SpinHamiltonian::build_groups() -> void
+{
+    TCM_CHECK(_edges.size() <= std::numeric_limits<uint32_t>::max(),
+              std::invalid_argument,
+              fmt::format("too many edges: {}; expected <={}", _edges.size(),
+                          std::numeric_limits<uint32_t>::max()));
+    // (i, j) and (j, i) are the same edge, so we use (min, max) as the key
+    auto order = std::vector<Edge>{std::begin(_edges), std::end(_edges)};
+    for (auto& edge : order) {
+        if (edge.first > edge.second) { std::swap(edge.first, edge.second); }
+    }
+    std::sort(std::begin(order), std::end(order),
+              [](Edge const& a, Edge const& b) {
+                  return std::make_tuple(a.first / 16, a.second / 16, a.zz,
+                                         a.xy, a.first, a.second)
+                         < std::make_tuple(b.first / 16, b.second / 16, b.zz,
+                                           b.xy, b.first, b.second);
+              });
+
+    _groups.clear();
+    _first_masks.clear();
+    _second_masks.clear();
+    _first_masks.reserve(order.size());
+    _second_masks.reserve(order.size());
+    auto const mask = [](unsigned const i) {
+        return static_cast<uint16_t>(1u << (15u - i % 16u));
+    };
+    for (auto const& edge : order) {
+        auto const first_word  = static_cast<uint16_t>(edge.first / 16);
+        auto const second_word = static_cast<uint16_t>(edge.second / 16);
+        if (_groups.empty() || _groups.back().first_word != first_word
+            || _groups.back().second_word != second_word
+            || _groups.back().zz != edge.zz || _groups.back().xy != edge.xy) {
+            auto const offset = static_cast<uint32_t>(_first_masks.size());
+            _groups.push_back(
+                {edge.zz, edge.xy, offset, offset, first_word, second_word});
+        }
+        _first_masks.push_back(mask(edge.first));
+        _second_masks.push_back(mask(edge.second));
+        ++_groups.back().end;
+    }
+}
+
+auto SpinHamiltonian::apply_batch(gsl::span<SpinVector const> spins) const
+    -> std::tuple<aligned_vector<int64_t>, aligned_vector<SpinVector>,
+                  aligned_vector<real_type>, aligned_vector<real_type>>
+{
+    if (!_edges.empty()) {
+        for (auto const& spin : spins) {
+            TCM_CHECK(max_index() < spin.size(), std::invalid_argument,
+                      fmt::format("spin configuration is too short: {}; "
+                                  "expected >{}",
+                                  spin.size(), max_index()));
+        }
+    }
+    auto const n       = static_cast<int64_t>(spins.size());
+    auto       offsets = aligned_vector<int64_t>(spins.size() + 1);
+    parallel_for(
+        0, n,
+        [this, spins, counts = offsets.data() + 1](auto const i) {
+            counts[i] = number_off_diagonal(spins[static_cast<size_t>(i)]);
+        },
+        /*cutoff=*/64);
+    std::partial_sum(std::begin(offsets), std::end(offsets),
+                     std::begin(offsets));
+
+    auto const size       = static_cast<size_t>(offsets.back());
+    auto       neighbours = aligned_vector<SpinVector>(size);
+    auto       elements   = aligned_vector<real_type>(size);
+    auto       diagonal   = aligned_vector<real_type>(spins.size());
+    parallel_for(
+        0, n,
+        [this, spins, offsets = offsets.data(), neighbours = neighbours.data(),
+         elements = elements.data(), diagonal = diagonal.data()](auto const i) {
+            auto*       spin    = neighbours + offsets[i];
+            auto*       element = elements + offsets[i];
+            auto* const last    = neighbours + offsets[i + 1];
+            // The diagonal term comes last, i.e. after exactly
+            // number_off_diagonal(σ) off-diagonal ones
+            for_each(spins[static_cast<size_t>(i)],
+                     [&spin, &element, last, &d = diagonal[i]](
+                         real_type const c, SpinVector const s) {
+                         if (spin != last) {
+                             *(spin++)    = s;
+                             *(element++) = c;
+                         }
+                         else {
+                             d = c;
+                         }
+                     });
+            TCM_ASSERT(spin == last, "Bug! number_off_diagonal is broken");
+        },
+        /*cutoff=*/64);
+    return {std::move(offsets), std::move(neighbours), std::move(elements),
+            std::move(diagonal)};
+}
+
+namespace {
+auto to_edge_list(Heisenberg::spec_type const& specs)
+    -> SpinHamiltonian::edge_list
+{
+    SpinHamiltonian::edge_list edges;
+    edges.reserve(specs.size());
+    for (auto const& spec : specs) {
+        real_type coupling;
+        uint16_t  first, second;
+        std::tie(coupling, first, second) = spec;
         TCM_CHECK(std::isnormal(coupling), std::invalid_argument,
                   fmt::format("invalid coupling: {}; expected a normal (i.e. "
                               "neither zero, subnormal, infinite or NaN) float",
                               coupling));
+        edges.push_back({coupling, coupling, first, second});
     }
-    if (!_edges.empty()) {
-        _max_index = find_max_index(std::begin(_edges), std::end(_edges));
+    return edges;
+}
+} // namespace
+
+Heisenberg::Heisenberg(spec_type const& edges)
+    : SpinHamiltonian{to_edge_list(edges)}
+{}
+
+auto Heisenberg::specs() const -> spec_type
+{
+    spec_type specs;
+    specs.reserve(size());
+    for (auto const& edge : edges()) {
+        specs.emplace_back(edge.zz, edge.first, edge.second);
+    }
+    return specs;
+}
+
+NeighbourCache::NeighbourCache(size_t const capacity)
+    : _index{}
+    , _neighbours{}
+    , _elements{}
+    , _capacity{capacity}
+    , _hits{0}
+    , _misses{0}
+{
+    TCM_CHECK(capacity <= std::numeric_limits<uint32_t>::max(),
+              std::invalid_argument,
+              fmt::format("cache capacity too big: {}; expected <={}",
+                          capacity, std::numeric_limits<uint32_t>::max()));
+    _neighbours.reserve(capacity);
+    _elements.reserve(capacity);
+}
+
+auto NeighbourCache::clear() noexcept -> void
+{
+    _index.clear();
+    _neighbours.clear();
+    _elements.clear();
+}
+
+namespace {
+/// Returns the maximal number of elements two QuantumStates can hold without
+/// exceeding `budget` bytes of memory.
+template <class State>
+auto max_terms_for(size_t const budget, float const max_load_factor) -> size_t
+{
+    if (budget == std::numeric_limits<size_t>::max()) { return budget; }
+    // Every slot in bytell_hash_map costs one value_type and one byte of
+    // metadata. The number of slots is always a power of two.
+    auto const slots =
+        budget / (2 * (sizeof(typename State::value_type) + 1));
+    if (slots == 0) { return 0; }
+    auto capacity = size_t{1};
+    while (2 * capacity <= slots) {
+        capacity *= 2;
     }
+    return static_cast<size_t>(static_cast<float>(capacity) * max_load_factor);
 }
+} // namespace
 
-Polynomial::Polynomial(std::shared_ptr<Heisenberg const> hamiltonian,
-                       std::vector<complex_type> roots, bool const normalising)
+template <class T>
+BasicPolynomial<T>::BasicPolynomial(
+    std::shared_ptr<SpinHamiltonian const> hamiltonian, std::vector<T> roots,
+    bool const normalising, PruningOptions const& pruning,
+    size_t const cache_size)
     : _current{}
     , _old{}
     , _hamiltonian{std::move(hamiltonian)}
     , _roots{std::move(roots)}
     , _normalising{normalising}
+    , _pruning{pruning}
+    , _budget_terms{}
+    , _peak_terms{0}
+    , _discarded{0}
+    , _magnitudes{}
+    , _cache{cache_size}
 {
     TCM_CHECK(_hamiltonian != nullptr, std::invalid_argument,
               "hamiltonian must not be nullptr (or None)");
     TCM_CHECK(!_roots.empty(), std::invalid_argument,
               "zero-degree polynomials are not supported");
-    auto const estimated_size =
-        std::min(static_cast<size_t>(std::round(
-                     std::pow(_hamiltonian->size() / 2, _roots.size()))),
-                 size_t{16384});
-    _old.reserve(estimated_size);
-    _current.reserve(estimated_size);
+    TCM_CHECK(_pruning.absolute >= 0 && _pruning.relative >= 0
+                  && _pruning.relative <= 1,
+              std::invalid_argument,
+              fmt::format("invalid cutoffs: absolute={}, relative={}; expected "
+                          "absolute >= 0 and 0 <= relative <= 1",
+                          _pruning.absolute, _pruning.relative));
+    TCM_CHECK(_pruning.max_terms > 0, std::invalid_argument,
+              "max_terms must be positive");
+    _budget_terms =
+        max_terms_for<state_type>(_pruning.memory_budget,
+                                  _old.max_load_factor());
+    TCM_CHECK(_budget_terms > _hamiltonian->size(), std::invalid_argument,
+              fmt::format("memory_budget is too small: {} bytes",
+                          _pruning.memory_budget));
+    auto const estimated_size = std::min(
+        {static_cast<size_t>(std::round(
+             std::pow(_hamiltonian->size() / 2, _roots.size()))),
+         size_t{16384}, _pruning.max_terms, _budget_terms});
+    _peak_terms = estimated_size;
+    reserve_buffers();
 }
 
-auto Polynomial::operator()(complex_type coeff, SpinVector const spin)
-    -> QuantumState const&
+template <class T> auto BasicPolynomial<T>::reserve_buffers() -> void
 {
-    TCM_CHECK(std::isfinite(coeff.real()) && std::isfinite(coeff.imag()),
-              std::runtime_error,
+    _old.reserve(_peak_terms);
+    _current.reserve(_peak_terms);
+}
+
+template <class T>
+auto BasicPolynomial<T>::operator()(T coeff, SpinVector const spin)
+    -> state_type const&
+{
+    TCM_CHECK(detail::is_finite(coeff), std::runtime_error,
               fmt::format("invalid coefficient ({}, {}); expected a finite "
                           "(i.e. either normal, subnormal or zero)",
-                          coeff.real(), coeff.imag()));
+                          std::real(coeff), std::imag(coeff)));
     TCM_CHECK(_hamiltonian->max_index() < spin.size(), std::out_of_range,
               fmt::format("spin configuration too short {}; expected >{}",
                           spin.size(), _hamiltonian->max_index()));
+    _discarded = 0;
+    reserve_buffers();
     // `|_old⟩ := - coeff * root|spin⟩`
     _old.clear();
     _old.emplace(spin, -coeff * _roots[0]);
     // `|_old⟩ += coeff * H|spin⟩`
-    (*_hamiltonian)(coeff, spin, _old);
+    expand(coeff, spin, _old);
     return kernel<1>();
 #if 0
     using std::swap;
@@ -181,8 +491,9 @@ auto Polynomial::operator()(complex_type coeff, SpinVector const spin)
 #endif
 }
 
-auto Polynomial::iteration(complex_type root, QuantumState& current,
-                           QuantumState const& old) const -> void
+template <class T>
+auto BasicPolynomial<T>::iteration(T root, state_type& current,
+                                   state_type const& old) -> void
 {
     TCM_ASSERT(current.empty(), "Bug!");
     if (_normalising) {
@@ -200,7 +511,7 @@ auto Polynomial::iteration(complex_type root, QuantumState& current,
         }
         // 2) `|current⟩ += H |old⟩ / ‖old‖₂`
         for (auto const& item : old) {
-            (*_hamiltonian)(item.second * scale, item.first, current);
+            expand(item.second * scale, item.first, current);
         }
     }
     else {
@@ -211,32 +522,337 @@ auto Polynomial::iteration(complex_type root, QuantumState& current,
         }
         // 2) `|current⟩ += H |old⟩`
         for (auto const& item : old) {
-            (*_hamiltonian)(item.second, item.first, current);
+            expand(item.second, item.first, current);
         }
     }
 }
 
-template <size_t Offset> auto Polynomial::kernel() -> QuantumState const&
+template <class T>
+template <size_t Offset>
+auto BasicPolynomial<T>::kernel() -> state_type const&
 {
     using std::swap;
+    if (!_pruning.enabled()) {
+        for (auto i = Offset; i < _roots.size(); ++i) {
+            // `|_current⟩ := (H - root)|_old⟩`
+            iteration(_roots[i], _current, _old);
+            _peak_terms = std::max(_peak_terms, _current.size());
+            // |_old⟩ := |_current⟩, but to not waste allocated memory, we use
+            // `swap + clear` instead.
+            swap(_old, _current);
+            _current.clear();
+        }
+        return _old;
+    }
+
+    // Expected ratio ‖(H - root)|ψ⟩‖₀ / ‖|ψ⟩‖₀ where ‖·‖₀ is the number of
+    // non-zero terms.
+    auto growth = static_cast<real_type>(_hamiltonian->size() / 2 + 1);
+    // Prunes `|_old⟩` before the `i`'th iteration such that `|_current⟩` will
+    // (most likely) fit into the budget. After the last iteration, `|_old⟩`
+    // is pruned to the budget itself.
+    auto const prune_before = [this, &growth](size_t const i) {
+        if (i == _roots.size()) {
+            prune(std::min(_pruning.max_terms, _budget_terms));
+            return;
+        }
+        prune(std::min(
+            _pruning.max_terms,
+            std::max(size_t{1}, static_cast<size_t>(
+                                    static_cast<real_type>(_budget_terms)
+                                    / growth))));
+    };
+    // `|_old⟩` is either the initial state (`Offset == 0`) or the result of
+    // the first iteration (`Offset == 1`)
+    prune_before(Offset);
     for (auto i = Offset; i < _roots.size(); ++i) {
-        // `|_current⟩ := (H - root)|_old⟩`
+        auto const size = _old.size();
         iteration(_roots[i], _current, _old);
-        // |_old⟩ := |_current⟩, but to not waste allocated memory, we use
-        // `swap + clear` instead.
+        growth = std::max(real_type{1}, static_cast<real_type>(_current.size())
+                                            / static_cast<real_type>(size));
+        _peak_terms = std::max(_peak_terms,
+                               std::min(_current.size(), _budget_terms));
         swap(_old, _current);
         _current.clear();
+        prune_before(i + 1);
     }
     return _old;
 }
 
-auto Polynomial::operator()(QuantumState const& state) -> QuantumState const&
+template <class T> auto BasicPolynomial<T>::prune(size_t const max_terms) -> void
 {
+    using std::swap;
+    TCM_ASSERT(max_terms > 0, "invalid max_terms");
+    TCM_ASSERT(_current.empty(), "precondition violated");
+    auto total   = real_type{0};
+    auto largest = real_type{0};
+    for (auto const& item : _old) {
+        auto const n = std::norm(item.second);
+        total += n;
+        largest = std::max(largest, n);
+    }
+    // All comparisons are done using squared magnitudes
+    auto threshold =
+        std::max(_pruning.absolute * _pruning.absolute,
+                 _pruning.relative * _pruning.relative * largest);
+    // Number of terms with magnitude equal to `threshold` which we may keep.
+    // This is only relevant when we keep the top `max_terms` terms.
+    auto ties = std::numeric_limits<size_t>::max();
+    if (_old.size() > max_terms) {
+        _magnitudes.clear();
+        _magnitudes.reserve(_old.size());
+        for (auto const& item : _old) {
+            _magnitudes.push_back(std::norm(item.second));
+        }
+        auto const nth = std::begin(_magnitudes) + static_cast<int64_t>(max_terms - 1);
+        std::nth_element(std::begin(_magnitudes), nth, std::end(_magnitudes),
+                         std::greater<real_type>{});
+        if (*nth >= threshold) {
+            threshold = *nth;
+            ties      = max_terms
+                   - static_cast<size_t>(std::count_if(
+                       std::begin(_magnitudes), nth,
+                       [threshold](auto const x) { return x > threshold; }));
+        }
+    }
+    if (threshold == real_type{0} && ties == std::numeric_limits<size_t>::max()) {
+        return;
+    }
+
+    auto dropped = real_type{0};
+    for (auto const& item : _old) {
+        auto const n = std::norm(item.second);
+        if (n > threshold || (n == threshold && ties != 0)) {
+            if (n == threshold) { --ties; }
+            _current.emplace(item.first, item.second);
+        }
+        else {
+            dropped += n;
+        }
+    }
+    swap(_old, _current);
+    _current.clear();
+    if (total > real_type{0}) { _discarded += std::sqrt(dropped / total); }
+}
+
+template <class T>
+auto BasicPolynomial<T>::operator()(state_type const& state)
+    -> state_type const&
+{
+    _discarded = 0;
+    reserve_buffers();
     if (std::addressof(state) == std::addressof(_old)) { return kernel<0>(); }
+    _old.clear();
+    if (_pruning.enabled()) {
+        // `state` can't be pruned in place, so we copy it to make sure that
+        // the first iteration respects the budget as well
+        for (auto const& item : state) {
+            _old.emplace(item.first, item.second);
+        }
+        return kernel<0>();
+    }
     iteration(_roots[0], /*current=*/_old, /*old=*/state);
+    _peak_terms = std::max(_peak_terms, std::min(_old.size(), _budget_terms));
     return kernel<1>();
 }
 
+template class BasicPolynomial<real_type>;
+template class BasicPolynomial<complex_type>;
+
+namespace {
+auto make_polynomial(std::shared_ptr<SpinHamiltonian const> hamiltonian,
+                     std::vector<complex_type> const& roots,
+                     bool const normalising, PruningOptions const& pruning,
+                     size_t const cache_size)
+    -> Polynomial::variant_type
+{
+    using std::begin, std::end;
+    // Both normalisation and pruning make P(H) non-linear, i.e.
+    // P(H)(|ψ₁⟩ + i|ψ₂⟩) ≠ P(H)|ψ₁⟩ + iP(H)|ψ₂⟩, and real arithmetic can
+    // only be used for linear P(H).
+    auto const is_real =
+        !normalising && !pruning.enabled()
+        && std::all_of(begin(roots), end(roots), [](auto const r) {
+               return r.imag() == real_type{0};
+           });
+    if (is_real) {
+        std::vector<real_type> real_roots;
+        real_roots.reserve(roots.size());
+        std::transform(begin(roots), end(roots), std::back_inserter(real_roots),
+                       [](auto const r) { return r.real(); });
+        return Polynomial::variant_type{
+            std::in_place_type<Polynomial::real_polynomial_type>,
+            std::move(hamiltonian), std::move(real_roots), normalising,
+            pruning, cache_size};
+    }
+    return Polynomial::variant_type{
+        std::in_place_type<Polynomial::complex_polynomial_type>,
+        std::move(hamiltonian), roots, normalising, pruning, cache_size};
+}
+} // namespace
+
+Polynomial::Polynomial(std::shared_ptr<SpinHamiltonian const> hamiltonian,
+                       std::vector<complex_type> roots, bool const normalising,
+                       PruningOptions const& pruning, size_t const cache_size)
+    : _roots{std::move(roots)}
+    , _impl{make_polynomial(std::move(hamiltonian), _roots, normalising,
+                            pruning, cache_size)}
+    , _result{}
+    , _real_part{}
+    , _imag_part{}
+{}
+
+auto Polynomial::operator()(complex_type const coeff, SpinVector const spin)
+    -> QuantumState const&
+{
+    if (!is_real()) { return std::get<1>(_impl)(coeff, spin); }
+    // P(H) is real, so P(H) c|σ⟩ = c P(H)|σ⟩
+    TCM_CHECK(detail::is_finite(coeff), std::runtime_error,
+              fmt::format("invalid coefficient ({}, {}); expected a finite "
+                          "(i.e. either normal, subnormal or zero)",
+                          coeff.real(), coeff.imag()));
+    auto const& state = std::get<0>(_impl)(real_type{1}, spin);
+    _result.clear();
+    _result.reserve(state.size());
+    for (auto const& item : state) {
+        _result.emplace(item.first, coeff * item.second);
+    }
+    return _result;
+}
+
+auto Polynomial::operator()(QuantumState const& state) -> QuantumState const&
+{
+    if (!is_real()) { return std::get<1>(_impl)(state); }
+    // P(H) is real and linear, so we apply it to real and imaginary parts
+    // separately
+    _real_part.clear();
+    _imag_part.clear();
+    _real_part.reserve(state.size());
+    _imag_part.reserve(state.size());
+    auto has_imag = false;
+    for (auto const& item : state) {
+        _real_part.emplace(item.first, item.second.real());
+        _imag_part.emplace(item.first, item.second.imag());
+        has_imag = has_imag || item.second.imag() != real_type{0};
+    }
+    auto& polynomial = std::get<0>(_impl);
+    _result.clear();
+    for (auto const& item : polynomial(_real_part)) {
+        _result.emplace(item.first, item.second);
+    }
+    if (has_imag) {
+        for (auto const& item : polynomial(_imag_part)) {
+            _result += {complex_type{0, item.second}, item.first};
+        }
+    }
+    return _result;
+}
+
+ChebyshevFilter::ChebyshevFilter(
+    std::shared_ptr<SpinHamiltonian const> hamiltonian,
+    std::vector<real_type> coefficients, std::pair<real_type, real_type> bounds,
+    size_t const cache_size)
+    : _result{}
+    , _current{}
+    , _previous{}
+    , _hamiltonian{std::move(hamiltonian)}
+    , _coefficients{std::move(coefficients)}
+    , _lower{bounds.first}
+    , _upper{bounds.second}
+    , _cache{cache_size}
+{
+    TCM_CHECK(_hamiltonian != nullptr, std::invalid_argument,
+              "hamiltonian must not be nullptr (or None)");
+    TCM_CHECK(!_coefficients.empty(), std::invalid_argument,
+              "expected at least one coefficient");
+    for (auto const c : _coefficients) {
+        TCM_CHECK(std::isfinite(c), std::invalid_argument,
+                  fmt::format("invalid coefficient: {}; expected a finite "
+                              "(i.e. either normal, subnormal or zero) float",
+                              c));
+    }
+    TCM_CHECK(std::isfinite(_lower) && std::isfinite(_upper)
+                  && _lower < _upper,
+              std::invalid_argument,
+              fmt::format("invalid spectral bounds: [{}, {}]", _lower, _upper));
+    // NOTE: Chebyshev expansions can have high degrees, so we cap the
+    // estimate before converting it to an integer.
+    auto const estimated_size = static_cast<size_t>(std::round(std::min(
+        std::pow(_hamiltonian->size() / 2, _coefficients.size() - 1),
+        16384.0)));
+    _result.reserve(estimated_size);
+    _current.reserve(estimated_size);
+    _previous.reserve(estimated_size);
+}
+
+auto ChebyshevFilter::accumulate(real_type const coeff, state_type const& psi)
+    -> void
+{
+    if (coeff == real_type{0}) { return; }
+    for (auto const& item : psi) {
+        _result += {coeff * item.second, item.first};
+    }
+}
+
+auto ChebyshevFilter::kernel() -> state_type const&
+{
+    using std::swap;
+    accumulate(_coefficients[1], _current);
+    for (auto k = size_t{2}; k < _coefficients.size(); ++k) {
+        // `|_previous⟩ := 2H̃|_current⟩ + |_previous⟩ = Tₖ|ψ⟩`
+        for (auto const& item : _current) {
+            expand(real_type{2} * item.second, item.first, _previous);
+        }
+        accumulate(_coefficients[k], _previous);
+        swap(_current, _previous);
+        if (k + 1 == _coefficients.size()) { break; }
+        // `|_previous⟩ := -|_previous⟩` to prepare for the next iteration
+        for (auto& item : _previous) {
+            item.second = -item.second;
+        }
+    }
+    return _result;
+}
+
+auto ChebyshevFilter::operator()(real_type const coeff, SpinVector const spin)
+    -> state_type const&
+{
+    TCM_CHECK(std::isfinite(coeff), std::runtime_error,
+              fmt::format("invalid coefficient {}; expected a finite "
+                          "(i.e. either normal, subnormal or zero)",
+                          coeff));
+    TCM_CHECK(_hamiltonian->max_index() < spin.size(), std::out_of_range,
+              fmt::format("spin configuration too short {}; expected >{}",
+                          spin.size(), _hamiltonian->max_index()));
+    _result.clear();
+    _current.clear();
+    _previous.clear();
+    // `|_result⟩ := c₀T₀|ψ⟩`
+    _result.emplace(spin, _coefficients[0] * coeff);
+    if (degree() == 0) { return _result; }
+    // `|_current⟩ := T₁|ψ⟩ = H̃|ψ⟩`
+    expand(coeff, spin, _current);
+    _previous.emplace(spin, -coeff);
+    return kernel();
+}
+
+auto ChebyshevFilter::operator()(state_type const& state) -> state_type const&
+{
+    TCM_CHECK(std::addressof(state) != std::addressof(_result),
+              std::invalid_argument,
+              "ChebyshevFilter can't be applied to its own output");
+    _result.clear();
+    _current.clear();
+    _previous.clear();
+    accumulate(_coefficients[0], state);
+    if (degree() == 0) { return _result; }
+    for (auto const& item : state) {
+        expand(item.second, item.first, _current);
+        _previous.emplace(item.first, -item.second);
+    }
+    return kernel();
+}
+
 #if 0
 /// Sets all `xs` to `0`.
 template <size_t N>
@@ -465,20 +1081,109 @@ auto load_forward_fn(std::string const& filename, size_t count)
 auto bind_heisenberg(pybind11::module m) -> void
 {
     namespace py = pybind11;
-    py::class_<Heisenberg, std::shared_ptr<Heisenberg>>(m, "Heisenberg")
-        .def(py::init<Heisenberg::spec_type>(), py::arg{"edges"},
+    using EdgeSpec = std::tuple<real_type, real_type, uint16_t, uint16_t>;
+    py::class_<SpinHamiltonian, std::shared_ptr<SpinHamiltonian>>(
+        m, "SpinHamiltonian")
+        .def(py::init([](std::vector<EdgeSpec> const& specs,
+                         optional<std::vector<real_type>> fields) {
+                 SpinHamiltonian::edge_list edges;
+                 edges.reserve(specs.size());
+                 for (auto const& spec : specs) {
+                     edges.push_back({std::get<0>(spec), std::get<1>(spec),
+                                      std::get<2>(spec), std::get<3>(spec)});
+                 }
+                 return std::make_shared<SpinHamiltonian>(
+                     std::move(edges), fields.has_value()
+                                           ? std::move(*fields)
+                                           : std::vector<real_type>{});
+             }),
+             py::arg{"edges"}, py::arg{"fields"} = py::none(),
              R"EOF(
-                 Creates an isotropic Heisenberg Hamiltonian from a list of edges.
+                 Creates a Hamiltonian
 
-                 :param edges: A list of tuples ``(coupling, i, j)``.
+                     H = ∑₍ᵢⱼ₎ [Jᶻᵢⱼσᶻᵢσᶻⱼ + Jˣʸᵢⱼ(σˣᵢσˣⱼ + σʸᵢσʸⱼ)] + ∑ᵢ hᵢσᶻᵢ
+
+                 :param edges: A list of tuples ``(Jᶻ, Jˣʸ, i, j)``.
+                 :param fields: A list of fields ``hᵢ`` (one per site).
              )EOF")
         .def(
-            "__len__", [](Heisenberg const& self) { return self.size(); },
+            "__len__", [](SpinHamiltonian const& self) { return self.size(); },
             R"EOF(
                  Returns the number of edges in the graph.
             )EOF")
         .def_property_readonly(
-            "edges", [](Heisenberg const& self) { return self.edges(); },
+            "edges",
+            [](SpinHamiltonian const& self) {
+                std::vector<EdgeSpec> specs;
+                specs.reserve(self.size());
+                for (auto const& edge : self.edges()) {
+                    specs.emplace_back(edge.zz, edge.xy, edge.first,
+                                       edge.second);
+                }
+                return specs;
+            },
+            R"EOF(
+                 Returns graph edges as a list of tuples ``(Jᶻ, Jˣʸ, i, j)``.
+
+                 .. warning:: This function copies the edges
+            )EOF")
+        .def_property_readonly(
+            "max_index",
+            [](SpinHamiltonian const& self) {
+                TCM_CHECK(self.size() != 0, std::runtime_error,
+                          "max_index is not defined for empty Hamiltonians");
+                return self.max_index();
+            },
+            R"EOF(Returns the greatest site index.)EOF")
+        .def_property_readonly(
+            "fields",
+            [](SpinHamiltonian const& self) {
+                auto const fields = self.fields();
+                return std::vector<real_type>{fields.begin(), fields.end()};
+            },
+            R"EOF(Returns fields hᵢ.)EOF")
+        .def_property_readonly(
+            "is_isotropic",
+            [](SpinHamiltonian const& self) { return self.is_isotropic(); })
+        .def(
+            "apply_batch",
+            [](SpinHamiltonian const&                      self,
+               py::array_t<SpinVector, py::array::c_style> spins) {
+                TCM_CHECK(spins.ndim() == 1, std::domain_error,
+                          fmt::format("spins has wrong number of dimensions: "
+                                      "{}; expected 1",
+                                      spins.ndim()));
+                auto [offsets, neighbours, elements, diagonal] =
+                    self.apply_batch(
+                        {spins.data(), static_cast<size_t>(spins.shape(0))});
+                return py::make_tuple(to_numpy_array(std::move(offsets)),
+                                      to_numpy_array(std::move(neighbours)),
+                                      to_numpy_array(std::move(elements)),
+                                      to_numpy_array(std::move(diagonal)));
+            },
+            py::arg{"spins"},
+            R"EOF(
+                 Applies the Hamiltonian to every spin configuration in
+                 ``spins`` without any hashing.
+
+                 :param spins: a NumPy array of :py:class:`CompactSpin`.
+                 :return: a tuple ``(offsets, neighbours, elements, diagonal)``
+                     where off-diagonal terms of ``H|spins[i]⟩`` are
+                     ``neighbours[offsets[i]:offsets[i + 1]]`` with matrix
+                     elements ``elements[offsets[i]:offsets[i + 1]]`` and
+                     ``diagonal[i]`` is ``⟨spins[i]|H|spins[i]⟩``.
+            )EOF");
+
+    py::class_<Heisenberg, SpinHamiltonian, std::shared_ptr<Heisenberg>>(
+        m, "Heisenberg")
+        .def(py::init<Heisenberg::spec_type const&>(), py::arg{"edges"},
+             R"EOF(
+                 Creates an isotropic Heisenberg Hamiltonian from a list of edges.
+
+                 :param edges: A list of tuples ``(coupling, i, j)``.
+             )EOF")
+        .def_property_readonly(
+            "edges", [](Heisenberg const& self) { return self.specs(); },
             R"EOF(
                  Returns graph edges
 
@@ -488,6 +1193,18 @@ auto bind_heisenberg(pybind11::module m) -> void
 
 auto bind_explicit_state(pybind11::module m) -> void
 {
+    using SpinArray    = py::array_t<SpinVector, py::array::c_style>;
+    using ComplexArray = py::array_t<complex_type, py::array::c_style
+                                                       | py::array::forcecast>;
+    auto const to_span = [](SpinArray const& array) {
+        TCM_CHECK(array.ndim() == 1, std::domain_error,
+                  fmt::format("array has wrong number of dimensions: {}; "
+                              "expected 1",
+                              array.ndim()));
+        return gsl::span<SpinVector const>{
+            array.data(), static_cast<size_t>(array.shape(0))};
+    };
+
     py::class_<QuantumState>(m, "ExplicitState",
                              R"EOF(
             Quantum state |ψ⟩=∑cᵢ|σᵢ⟩ backed by a table {(σᵢ, cᵢ)}.
@@ -509,15 +1226,21 @@ auto bind_explicit_state(pybind11::module m) -> void
                          "either normal, subnormal or zero) complex float",
                          value.real(), value.imag()));
                  auto i = self.find(spin);
-                 if (i != self.end()) { i->second = value; }
-                 throw py::key_error{};
+                 if (i == self.end()) { throw py::key_error{}; }
+                 i->second = value;
              })
         .def(
             "__len__", [](QuantumState const& self) { return self.size(); },
             R"EOF(Returns number of elements in |ψ⟩.)EOF")
         .def(
-            "keys", [](QuantumState const& self) { return keys(self); },
-            R"EOF(Returns basis vectors {|σᵢ⟩} as a ``numpy.ndarray``.)EOF")
+            "keys",
+            [](QuantumState const& self) {
+                return to_numpy_array(keys(self));
+            },
+            R"EOF(
+                Returns basis vectors {|σᵢ⟩} as a ``numpy.ndarray``. A new
+                array is allocated on every call.
+            )EOF")
         .def(
             "values",
             [](QuantumState const& self, bool only_real) {
@@ -526,7 +1249,53 @@ auto bind_explicit_state(pybind11::module m) -> void
             pybind11::arg{"only_real"} = true,
             R"EOF(
                 Returns coefficients {cᵢ} or {Re[cᵢ]} (depending on the value
-                of ``only_real``) as a ``torch.Tensor``.
+                of ``only_real``) as a ``torch.Tensor``. A new tensor is
+                allocated on every call.
+            )EOF")
+        .def(
+            "compact",
+            [](QuantumState& self) {
+                auto [spins, coeffs] = compact(self);
+                return std::make_tuple(to_numpy_array(std::move(spins)),
+                                       to_numpy_array(std::move(coeffs)));
+            },
+            R"EOF(
+                Moves all terms into a tuple of ``numpy.ndarray``s
+                ``(spins, coeffs)`` in a single pass and clears |ψ⟩. Arrays
+                are handed over to NumPy without copying.
+            )EOF")
+        .def(
+            "lookup",
+            [to_span](QuantumState const& self, SpinArray const& spins) {
+                auto const src = to_span(spins);
+                auto       out = aligned_vector<complex_type>(src.size());
+                {
+                    py::gil_scoped_release release;
+                    lookup(self, src, out);
+                }
+                return to_numpy_array(std::move(out));
+            },
+            py::arg{"spins"}.noconvert(),
+            R"EOF(
+                Returns coefficients ⟨σ|ψ⟩ for every σ in ``spins`` (a
+                ``numpy.ndarray`` of :py:class:`CompactSpin`). Configurations
+                which are not in |ψ⟩ get zero coefficients.
+            )EOF")
+        .def(
+            "update",
+            [to_span](QuantumState& self, SpinArray const& spins,
+                      ComplexArray const& values) {
+                TCM_CHECK(values.ndim() == 1, std::domain_error,
+                          fmt::format("values has wrong number of dimensions: "
+                                      "{}; expected 1",
+                                      values.ndim()));
+                update(self, to_span(spins),
+                       {values.data(), static_cast<size_t>(values.shape(0))});
+            },
+            py::arg{"spins"}.noconvert(), py::arg{"values"},
+            R"EOF(
+                Sets ⟨σᵢ|ψ⟩ := ``values[i]`` for every σᵢ in ``spins``
+                inserting configurations which are not yet in |ψ⟩.
             )EOF");
 }
 
@@ -537,13 +1306,27 @@ auto bind_polynomial(pybind11::module m) -> void
                                                         R"EOF(
             Represents polynomials in H.
         )EOF")
-        .def(py::init([](std::shared_ptr<Heisenberg const> h,
-                         std::vector<complex_type> roots, bool normalising) {
-                 return std::make_shared<Polynomial>(
-                     std::move(h), std::move(roots), normalising);
+        .def(py::init([](std::shared_ptr<SpinHamiltonian const> h,
+                         std::vector<complex_type> roots, bool normalising,
+                         real_type absolute_cutoff, real_type relative_cutoff,
+                         optional<size_t> max_terms,
+                         optional<size_t> memory_budget, size_t cache_size) {
+                 PruningOptions pruning;
+                 pruning.absolute = absolute_cutoff;
+                 pruning.relative = relative_cutoff;
+                 if (max_terms.has_value()) { pruning.max_terms = *max_terms; }
+                 if (memory_budget.has_value()) {
+                     pruning.memory_budget = *memory_budget;
+                 }
+                 return std::make_shared<Polynomial>(std::move(h),
+                                                     std::move(roots),
+                                                     normalising, pruning,
+                                                     cache_size);
              }),
              py::arg{"hamiltonian"}, py::arg{"roots"},
-             py::arg{"normalising"} = false,
+             py::arg{"normalising"} = false, py::arg{"absolute_cutoff"} = 0.0,
+             py::arg{"relative_cutoff"} = 0.0, py::arg{"max_terms"} = py::none(),
+             py::arg{"memory_budget"} = py::none(), py::arg{"cache_size"} = 0,
              R"EOF(
                  Given a Hamiltonian H and roots {rᵢ} (i ∈ {0, 1, ..., n-1})
                  constructs the following polynomial
@@ -552,7 +1335,36 @@ auto bind_polynomial(pybind11::module m) -> void
 
                  Even though each rᵢ is complex, after expanding the brackets
                  __all coefficients should be real__.
+
+                 Intermediate states can optionally be truncated after every
+                 iteration: terms with magnitude below ``absolute_cutoff`` or
+                 below ``relative_cutoff`` times the largest magnitude are
+                 dropped, and then only ``max_terms`` largest terms are kept.
+                 ``memory_budget`` (in bytes) limits the size of intermediate
+                 states; it is enforced adaptively based on the observed
+                 growth rate.
+
+                 If ``cache_size`` is positive, H|σ⟩ is memoised for up to
+                 ``cache_size`` terms and reused across iterations and calls.
              )EOF")
+        .def_property_readonly(
+            "cache_stats",
+            [](Polynomial const& self) {
+                auto const stats = self.cache_stats();
+                return std::make_tuple(stats.hits, stats.misses, stats.size,
+                                       stats.hit_rate());
+            },
+            R"EOF(
+                Returns a tuple ``(hits, misses, size, hit_rate)`` describing
+                the neighbour cache.
+            )EOF")
+        .def_property_readonly(
+            "discarded_norm",
+            [](Polynomial const& self) { return self.discarded_norm(); },
+            R"EOF(
+                Estimate of the relative norm discarded by pruning during the
+                last application of the polynomial.
+            )EOF")
         // .def_property_readonly(
         //     "size", [](Polynomial const& self) { return self.size(); },
         //     R"EOF(
@@ -582,6 +1394,74 @@ auto bind_polynomial(pybind11::module m) -> void
             R"EOF(
 
             )EOF");
+
+    py::class_<ChebyshevFilter, std::shared_ptr<ChebyshevFilter>>(
+        m, "ChebyshevFilter",
+        R"EOF(
+            Represents Chebyshev expansions ∑ₖcₖTₖ(H̃) where H̃ maps the spectrum
+            of H onto [-1, 1].
+        )EOF")
+        .def(py::init<std::shared_ptr<SpinHamiltonian const>,
+                      std::vector<real_type>, std::pair<real_type, real_type>,
+                      size_t>(),
+             py::arg{"hamiltonian"}, py::arg{"coefficients"},
+             py::arg{"bounds"}, py::arg{"cache_size"} = 0,
+             R"EOF(
+                 :param hamiltonian: Hamiltonian H.
+                 :param coefficients: Expansion coefficients [c₀, c₁, ...].
+                 :param bounds: A tuple ``(lower, upper)`` of bounds on the
+                     spectrum of H. H̃ = (H - (upper + lower) / 2) /
+                     ((upper - lower) / 2).
+                 :param cache_size: same as for :py:class:`Polynomial`.
+             )EOF")
+        .def_property_readonly(
+            "degree", [](ChebyshevFilter const& self) { return self.degree(); })
+        .def_property_readonly("coefficients",
+                               [](ChebyshevFilter const& self) {
+                                   auto const cs = self.coefficients();
+                                   return std::vector<real_type>{cs.begin(),
+                                                                 cs.end()};
+                               })
+        .def_property_readonly(
+            "bounds", [](ChebyshevFilter const& self) { return self.bounds(); })
+        .def_property_readonly(
+            "cache_stats",
+            [](ChebyshevFilter const& self) {
+                auto const stats = self.cache_stats();
+                return std::make_tuple(stats.hits, stats.misses, stats.size,
+                                       stats.hit_rate());
+            },
+            R"EOF(Same as :py:attr:`Polynomial.cache_stats`.)EOF")
+        .def(
+            "__call__",
+            [](ChebyshevFilter& self, real_type coeff, SpinVector spin) {
+                auto const& state = self(coeff, spin);
+                QuantumState result;
+                result.reserve(state.size());
+                for (auto const& item : state) {
+                    result.emplace(item.first, item.second);
+                }
+                return result;
+            },
+            py::arg{"coeff"}, py::arg{"spin"},
+            R"EOF(
+                Returns p(H) coeff|σ⟩ as a new :py:class:`ExplicitState`.
+            )EOF");
+
+    m.def(
+        "memory_usage",
+        []() {
+            auto const usage = memory_usage();
+            return std::make_tuple(usage.current, usage.peak);
+        },
+        R"EOF(
+            Returns a tuple ``(current, peak)`` with memory (in bytes) used by
+            quantum states and scratch buffers. Peak usage is measured since
+            the last call to :py:func:`reset_peak_memory`.
+        )EOF");
+    m.def(
+        "reset_peak_memory", []() { reset_peak_memory(); },
+        R"EOF(Sets peak memory usage to the current one.)EOF");
     // .def(
     //     "vectors",
     //     [](Polynomial const& p) {
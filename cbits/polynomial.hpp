@@ -30,96 +30,180 @@
 
 #include "config.hpp"
 #include "errors.hpp"
+#include "scratch.hpp"
 #include "spin.hpp"
 
 #include <torch/script.h>
 #include <flat_hash_map/bytell_hash_map.hpp>
 
 #include <memory>
+#include <tuple>
+#include <variant>
 #include <vector>
 
 TCM_NAMESPACE_BEGIN
 
+namespace detail {
+inline auto is_finite(real_type const x) noexcept -> bool
+{
+    return std::isfinite(x);
+}
+
+inline auto is_finite(complex_type const x) noexcept -> bool
+{
+    return std::isfinite(x.real()) && std::isfinite(x.imag());
+}
+} // namespace detail
+
 /// \brief Explicit representation of a quantum state `|ψ⟩`.
-class QuantumState // {{{
-    : public ska::bytell_hash_map<SpinVector, complex_type> {
+///
+/// Memory used by quantum states is accounted for in #memory_usage.
+///
+/// \tparam T Type of coefficients: either #real_type or #complex_type.
+template <class T>
+class BasicQuantumState // {{{
+    : public ska::bytell_hash_map<
+          SpinVector, T, std::hash<SpinVector>, std::equal_to<SpinVector>,
+          detail::TrackingAllocator<std::pair<SpinVector, T>>> {
+    static_assert(std::is_same<T, real_type>::value
+                      || std::is_same<T, complex_type>::value,
+                  "T must be either real_type or complex_type");
+
   public:
-    using base = ska::bytell_hash_map<SpinVector, complex_type>;
-    using base::value_type;
+    using base             = ska::bytell_hash_map<
+        SpinVector, T, std::hash<SpinVector>, std::equal_to<SpinVector>,
+        detail::TrackingAllocator<std::pair<SpinVector, T>>>;
+    using coefficient_type = T;
+    using typename base::value_type;
 
-    static_assert(alignof(base::value_type) == 16, "");
-    static_assert(sizeof(base::value_type) == 32, "");
-    static_assert(std::is_trivially_destructible<base::value_type>::value,
+    // NOTE: SpinVector is 16-byte aligned, so entries take 32 bytes
+    // regardless of T.
+    static_assert(alignof(value_type) == 16, "");
+    static_assert(sizeof(value_type) == 32, "");
+    static_assert(std::is_trivially_destructible<value_type>::value,
                   "\n" TCM_BUG_MESSAGE);
     // NOTE: std::complex is not trivially copyable, which is a shame...
-    // static_assert(std::is_trivially_copyable<base::value_type>::value,
+    // static_assert(std::is_trivially_copyable<value_type>::value,
     //               "\n" TCM_BUG_MESSAGE);
 
     using base::base;
 
-    QuantumState(QuantumState const&) = default;
-    QuantumState(QuantumState&&)      = default;
-    QuantumState& operator=(QuantumState const&) = delete;
-    QuantumState& operator=(QuantumState&&) = delete;
+    BasicQuantumState(BasicQuantumState const&) = default;
+    BasicQuantumState(BasicQuantumState&&)      = default;
+    BasicQuantumState& operator=(BasicQuantumState const&) = delete;
+    BasicQuantumState& operator=(BasicQuantumState&&) = delete;
 
     /// Performs `|ψ⟩ := |ψ⟩ + c|σ⟩`.
     ///
     /// \param value A pair `(c, |σ⟩)`.
-    TCM_FORCEINLINE TCM_HOT auto
-                    operator+=(std::pair<complex_type, SpinVector> const& value)
-        -> QuantumState&
+    TCM_FORCEINLINE TCM_HOT auto operator+=(std::pair<T, SpinVector> const& value)
+        -> BasicQuantumState&
     {
-        TCM_ASSERT(std::isfinite(value.first.real())
-                       && std::isfinite(value.first.imag()),
+        TCM_ASSERT(detail::is_finite(value.first),
                    fmt::format("Invalid coefficient ({}, {})",
-                               value.first.real(), value.first.imag()));
+                               std::real(value.first), std::imag(value.first)));
         auto& c = static_cast<base&>(*this)[value.second];
         c += value.first;
         return *this;
     }
 
-    friend auto swap(QuantumState& x, QuantumState& y) -> void
+    friend auto swap(BasicQuantumState& x, BasicQuantumState& y) -> void
     {
         using std::swap;
         static_cast<base&>(x).swap(static_cast<base&>(y));
     }
 }; // }}}
 
+using QuantumState = BasicQuantumState<complex_type>;
+
+/// Returns basis vectors and/or coefficients of `psi`.
+///
+/// \note Unlike temporaries (see #ScratchBuffer), the results are allocated
+/// anew on every call. They are handed over to NumPy and PyTorch, and
+/// reusing storage would make arrays returned by earlier calls change.
 auto keys(QuantumState const&) -> aligned_vector<SpinVector>;
 auto values(QuantumState const&, bool only_real = true) -> torch::Tensor;
 auto items(QuantumState const&, bool only_real = true)
     -> std::pair<aligned_vector<SpinVector>, torch::Tensor>;
 
-/// \brief Represents the Heisenberg Hamiltonian.
-class Heisenberg // {{{
-    : public std::enable_shared_from_this<Heisenberg> {
+/// Moves all terms of `psi` into contiguous arrays of basis vectors and
+/// coefficients in a single pass over the table. `psi` is left empty, but
+/// keeps its capacity.
+auto compact(QuantumState& psi)
+    -> std::pair<aligned_vector<SpinVector>, aligned_vector<complex_type>>;
+
+/// Computes `out[i] := ⟨spins[i]|ψ⟩` for every `i`. Configurations which are
+/// not in `psi` get zero coefficients.
+auto lookup(QuantumState const& psi, gsl::span<SpinVector const> spins,
+            gsl::span<complex_type> out) -> void;
+
+/// Performs `⟨spins[i]|ψ⟩ := values[i]` for every `i` inserting missing
+/// configurations into `psi`. All inputs are validated before `psi` is
+/// modified.
+auto update(QuantumState& psi, gsl::span<SpinVector const> spins,
+            gsl::span<complex_type const> values) -> void;
+
+/// \brief Two-body spin Hamiltonian
+///
+///     H = ∑₍ᵢⱼ₎ [Jᶻᵢⱼσᶻᵢσᶻⱼ + Jˣʸᵢⱼ(σˣᵢσˣⱼ + σʸᵢσʸⱼ)] + ∑ᵢ hᵢσᶻᵢ
+///
+/// which covers XXZ models, longitudinal fields and arbitrary (e.g. J1-J2)
+/// coupling graphs. The kernel is specialised at compile time for whether
+/// the model is isotropic (Jᶻ = Jˣʸ on every edge) and whether fields are
+/// present, so that the isotropic Heisenberg case does no extra work.
+class SpinHamiltonian // {{{
+    : public std::enable_shared_from_this<SpinHamiltonian> {
   public:
-    using edge_type = std::tuple<real_type, uint16_t, uint16_t>;
-    using spec_type =
-        std::vector<edge_type,
-                    boost::alignment::aligned_allocator<edge_type, 64>>;
+    struct Edge {
+        real_type zz; ///< Jᶻ
+        real_type xy; ///< Jˣʸ
+        uint16_t  first;
+        uint16_t  second;
+    };
+    using edge_list =
+        std::vector<Edge, boost::alignment::aligned_allocator<Edge, 64>>;
 
   private:
-    spec_type _edges;     ///< Graph edges
-    unsigned  _max_index; ///< The greatest site index present in `_edges`.
-                          ///< It is used to detect errors when one tries to
-                          ///< apply the hamiltonian to a spin configuration
-                          ///< which is too short.
+    /// A run of edges which touch the same pair of 16-bit words of
+    /// #SpinVector and have equal couplings.
+    struct EdgeGroup {
+        real_type zz;
+        real_type xy;
+        uint32_t  begin; ///< Offset of the first edge in `_first_masks`
+        uint32_t  end;   ///< Offset past the last edge in `_first_masks`
+        uint16_t  first_word;
+        uint16_t  second_word;
+    };
+
+    edge_list              _edges;  ///< Graph edges in input order
+    std::vector<real_type> _fields; ///< hᵢ for every site (may be empty)
+    /// Structure-of-arrays representation of `_edges` used by the kernel.
+    /// Edge `k` flips bits `_first_masks[k]` and `_second_masks[k]` in words
+    /// `first_word` and `second_word` of its group respectively.
+    std::vector<EdgeGroup>   _groups;
+    aligned_vector<uint16_t> _first_masks;
+    aligned_vector<uint16_t> _second_masks;
+    unsigned  _max_index; ///< The greatest site index present in `_edges`
+                          ///< and `_fields`. It is used to detect errors
+                          ///< when one tries to apply the hamiltonian to a
+                          ///< spin configuration which is too short.
+    bool      _isotropic;  ///< Whether Jᶻ = Jˣʸ for all edges
+    bool      _has_fields; ///< Whether some hᵢ are non-zero
 
   public:
-    /// Constructs a hamiltonian given graph edges and couplings.
-    Heisenberg(spec_type edges);
+    /// Constructs a hamiltonian given graph edges and (optionally) fields.
+    SpinHamiltonian(edge_list edges, std::vector<real_type> fields = {});
 
     /// Copy and Move constructors/assignments
-    Heisenberg(Heisenberg const&)     = default;
-    Heisenberg(Heisenberg&&) noexcept = default;
-    Heisenberg& operator=(Heisenberg const&) = default;
-    Heisenberg& operator=(Heisenberg&&) noexcept = default;
+    SpinHamiltonian(SpinHamiltonian const&)     = default;
+    SpinHamiltonian(SpinHamiltonian&&) noexcept = default;
+    SpinHamiltonian& operator=(SpinHamiltonian const&) = default;
+    SpinHamiltonian& operator=(SpinHamiltonian&&) noexcept = default;
 
     /// Returns the number of edges in the graph
     /*constexpr*/ auto size() const noexcept -> size_t { return _edges.size(); }
 
-    /// Returns the greatest index encountered in `_edges`.
+    /// Returns the greatest index encountered in `_edges` and `_fields`.
     ///
     /// \precondition `size() != 0`
     /*constexpr*/ auto max_index() const noexcept -> size_t
@@ -129,11 +213,20 @@ class Heisenberg // {{{
     }
 
     /// Returns a *reference* to graph edges.
-    /*constexpr*/ auto edges() const noexcept -> gsl::span<edge_type const>
+    /*constexpr*/ auto edges() const noexcept -> gsl::span<Edge const>
     {
         return _edges;
     }
 
+    /// Returns a *reference* to fields hᵢ.
+    /*constexpr*/ auto fields() const noexcept -> gsl::span<real_type const>
+    {
+        return _fields;
+    }
+
+    auto is_isotropic() const noexcept -> bool { return _isotropic; }
+    auto has_fields() const noexcept -> bool { return _has_fields; }
+
     /// Performs `|ψ⟩ += c * H|σ⟩`.
     ///
     /// \param coeff Coefficient `c`
@@ -143,105 +236,382 @@ class Heisenberg // {{{
     /// \precondition `coeff` is finite, i.e.
     ///               `isfinite(coeff.real()) && isfinite(coeff.imag())`.
     /// \preconfition When `size() != 0`, `max_index() < spin.size()`.
-    TCM_FORCEINLINE TCM_HOT auto operator()(complex_type const coeff,
-                                            SpinVector const   spin,
-                                            QuantumState& psi) const -> void
+    template <class T>
+    TCM_FORCEINLINE TCM_HOT auto
+    operator()(typename BasicQuantumState<T>::coefficient_type const coeff,
+               SpinVector const spin, BasicQuantumState<T>& psi) const -> void
     {
-        TCM_ASSERT(std::isfinite(coeff.real()) && std::isfinite(coeff.imag()),
+        TCM_ASSERT(detail::is_finite(coeff),
                    fmt::format("invalid coefficient ({}, {}); expected a "
-                               "finite complex number",
-                               coeff.real(), coeff.imag()));
+                               "finite number",
+                               std::real(coeff), std::imag(coeff)));
+        for_each(spin, [coeff, &psi](real_type const c, SpinVector const s) {
+            psi += {coeff * c, s};
+        });
+    }
+
+    /// Computes `H|σ⟩` for every `σ` in `spins` without going through a
+    /// hash table.
+    ///
+    /// Off-diagonal terms `c|σ'⟩` of `H|spins[i]⟩` are written to
+    /// `elements[offsets[i]:offsets[i + 1]]` and
+    /// `neighbours[offsets[i]:offsets[i + 1]]`, and `⟨σ|H|σ⟩` is written to
+    /// `diagonal[i]`. All arrays are preallocated: the first (parallel) pass
+    /// counts the terms, and the second (also parallel) one fills them in.
+    ///
+    /// \return A tuple `(offsets, neighbours, elements, diagonal)`.
+    auto apply_batch(gsl::span<SpinVector const> spins) const
+        -> std::tuple<aligned_vector<int64_t>, aligned_vector<SpinVector>,
+                      aligned_vector<real_type>, aligned_vector<real_type>>;
+
+    /// Returns the number of off-diagonal terms in `H|σ⟩`, i.e. how many
+    /// times #for_each calls `f` before the diagonal term.
+    ///
+    /// \preconfition When `size() != 0`, `max_index() < spin.size()`.
+    TCM_FORCEINLINE auto number_off_diagonal(SpinVector const spin) const
+        noexcept -> unsigned
+    {
+        auto count = 0u;
+        for (auto const& group : _groups) {
+            auto const coupling = _isotropic ? group.zz : group.xy;
+            if (coupling == real_type{0}) { continue; }
+            auto const first  = spin.word(group.first_word);
+            auto const second = spin.word(group.second_word);
+            for (auto k = group.begin; k < group.end; ++k) {
+                count += ((first & _first_masks[k]) == 0)
+                         != ((second & _second_masks[k]) == 0);
+            }
+        }
+        return count;
+    }
+
+    /// Calls `f(c, |σ'⟩)` for every term `c|σ'⟩` in `H|σ⟩`. The diagonal
+    /// term comes last. Since all couplings are real, `c` is a #real_type.
+    ///
+    /// \preconfition When `size() != 0`, `max_index() < spin.size()`.
+    template <class Function>
+    TCM_FORCEINLINE TCM_HOT auto for_each(SpinVector const spin,
+                                          Function&&       f) const -> void
+    {
         TCM_ASSERT(_edges.empty() || max_index() < spin.size(),
                    fmt::format("`spin` is too short {}; expected >{}",
                                spin.size(), max_index()));
-        auto c = complex_type{0, 0};
-        for (auto const& edge : edges()) {
-            real_type coupling;
-            uint16_t  first, second;
-            std::tie(coupling, first, second) = edge;
-            // Heisenberg hamiltonian works more or less like this:
-            //
-            //     K|↑↑⟩ = J|↑↑⟩
-            //     K|↓↓⟩ = J|↓↓⟩
-            //     K|↑↓⟩ = -J|↑↓⟩ + 2J|↓↑⟩
-            //     K|↓↑⟩ = -J|↓↑⟩ + 2J|↑↓⟩
-            //
-            // where K is the "kernel". We want to perform
-            // |ψ⟩ += c * K|σᵢσⱼ⟩ for each edge (i, j).
-            //
-            auto const aligned = spin[first] == spin[second];
-            // sign == 1.0 when aligned == true and sign == -1.0
-            // when aligned == false
-            auto const sign = static_cast<real_type>(-1 + 2 * aligned);
-            c += sign * coeff * coupling;
-            if (!aligned) {
-                psi += {real_type{2} * coeff * coupling,
-                        spin.flipped({first, second})};
+        if (_has_fields) {
+            if (_isotropic) { for_each_impl<true, true>(spin, f); }
+            else {
+                for_each_impl<false, true>(spin, f);
+            }
+        }
+        else {
+            if (_isotropic) { for_each_impl<true, false>(spin, f); }
+            else {
+                for_each_impl<false, false>(spin, f);
             }
         }
-        psi += {c, spin};
     }
 
   private:
-    /// Finds the largest index used in `_edges`.
+    /// Builds `_groups`, `_first_masks` and `_second_masks` from `_edges`.
     ///
-    /// \precondition Range must not be empty.
-    template <class Iter, class = std::enable_if_t<std::is_same<
-                              typename std::iterator_traits<Iter>::value_type,
-                              edge_type>::value> /**/>
-    static auto find_max_index(Iter begin, Iter end) -> unsigned
-    {
-        TCM_ASSERT(begin != end, "Range is empty");
-        // This implementation is quite inefficient, but it's not on the hot
-        // bath, so who cares ;)
-        auto max_index = std::max(std::get<1>(*begin), std::get<2>(*begin));
-        ++begin;
-        for (; begin != end; ++begin) {
-            max_index = std::max(
-                max_index, std::max(std::get<1>(*begin), std::get<2>(*begin)));
+    /// Edges are grouped by the pair of words they touch and by couplings.
+    /// Within a group, edges are sorted by site indices so that neighbours
+    /// `σ'` are emitted in order of the flipped bits which is friendlier to
+    /// the downstream hash table (or sort) inserts than the input order.
+    auto build_groups() -> void;
+
+    template <bool Isotropic, bool HasFields, class Function>
+    TCM_FORCEINLINE TCM_HOT auto for_each_impl(SpinVector const spin,
+                                               Function&        f) const
+        -> void
+    {
+        // Heisenberg hamiltonian works more or less like this:
+        //
+        //     K|↑↑⟩ = J|↑↑⟩
+        //     K|↓↓⟩ = J|↓↓⟩
+        //     K|↑↓⟩ = -J|↑↓⟩ + 2J|↓↑⟩
+        //     K|↓↑⟩ = -J|↓↑⟩ + 2J|↑↓⟩
+        //
+        // where K is the "kernel". We want to compute K|σᵢσⱼ⟩ for each
+        // edge (i, j). In the anisotropic case, diagonal elements use Jᶻ
+        // and off-diagonal ones Jˣʸ.
+        //
+        auto        c            = real_type{0};
+        auto const* first_masks  = _first_masks.data();
+        auto const* second_masks = _second_masks.data();
+        for (auto const& group : _groups) {
+            auto const first  = spin.word(group.first_word);
+            auto const second = spin.word(group.second_word);
+            // All edges in the group share the coupling, so the diagonal
+            // contribution only depends on the number of aligned pairs. This
+            // loop has no branches and is easily vectorised.
+            auto aligned = 0;
+            for (auto k = group.begin; k < group.end; ++k) {
+                aligned += ((first & first_masks[k]) == 0)
+                           == ((second & second_masks[k]) == 0);
+            }
+            auto const size = static_cast<int>(group.end - group.begin);
+            c += static_cast<real_type>(2 * aligned - size) * group.zz;
+
+            auto const coupling = Isotropic ? group.zz : group.xy;
+            // Ising-like and zero-coupling edges have no off-diagonal
+            // elements at all
+            if (coupling == real_type{0}) { continue; }
+            for (auto k = group.begin; k < group.end; ++k) {
+                if (((first & first_masks[k]) == 0)
+                    != ((second & second_masks[k]) == 0)) {
+                    auto neighbour = spin;
+                    neighbour.flip_word(group.first_word, first_masks[k]);
+                    neighbour.flip_word(group.second_word, second_masks[k]);
+                    f(real_type{2} * coupling, neighbour);
+                }
+            }
+        }
+        if constexpr (HasFields) {
+            for (auto i = 0u; i < _fields.size(); ++i) {
+                c += spin[i] == Spin::up ? _fields[i] : -_fields[i];
+            }
         }
-        return max_index;
+        f(c, spin);
     }
 }; // }}}
 
+/// \brief Represents the isotropic Heisenberg Hamiltonian.
+class Heisenberg : public SpinHamiltonian { // {{{
+  public:
+    using edge_type = std::tuple<real_type, uint16_t, uint16_t>;
+    using spec_type =
+        std::vector<edge_type,
+                    boost::alignment::aligned_allocator<edge_type, 64>>;
+
+    /// Constructs a hamiltonian given graph edges and couplings.
+    Heisenberg(spec_type const& edges);
+
+    Heisenberg(Heisenberg const&)     = default;
+    Heisenberg(Heisenberg&&) noexcept = default;
+    Heisenberg& operator=(Heisenberg const&) = default;
+    Heisenberg& operator=(Heisenberg&&) noexcept = default;
+
+    /// Returns graph edges in the format accepted by the constructor.
+    auto specs() const -> spec_type;
+}; // }}}
+
+// [NeighbourCache] {{{
+/// \brief Memoises `H|σ⟩` for recently expanded spin configurations.
+///
+/// For every cached `σ`, all terms `c|σ'⟩` of `H|σ⟩` are stored contiguously
+/// in two flat arrays. When the total number of stored terms would exceed
+/// `capacity()`, the cache is cleared, i.e. it effectively keeps the most
+/// recent configurations which is what both successive polynomial iterations
+/// and Monte Carlo chains need. Configurations whose `H|σ⟩` might not fit even
+/// into an empty cache are never cached.
+class NeighbourCache {
+  public:
+    struct Stats {
+        size_t hits;
+        size_t misses;
+        size_t size; ///< Number of cached configurations
+
+        constexpr auto hit_rate() const noexcept -> real_type
+        {
+            return hits + misses == 0
+                       ? real_type{0}
+                       : static_cast<real_type>(hits)
+                             / static_cast<real_type>(hits + misses);
+        }
+    };
+
+  private:
+    /// Maps `σ` to `[offset, offset + count)` in `_neighbours` and `_elements`
+    ska::bytell_hash_map<SpinVector, std::pair<uint32_t, uint32_t>> _index;
+    aligned_vector<SpinVector> _neighbours;
+    std::vector<real_type>     _elements;
+    size_t                     _capacity; ///< Maximal number of stored terms
+    size_t                     _hits;
+    size_t                     _misses;
+
+  public:
+    /// Creates a cache which stores at most `capacity` terms. `capacity == 0`
+    /// disables caching altogether.
+    explicit NeighbourCache(size_t capacity = 0);
+
+    NeighbourCache(NeighbourCache const&) = delete;
+    NeighbourCache(NeighbourCache&&)      = default;
+    NeighbourCache& operator=(NeighbourCache const&) = delete;
+    NeighbourCache& operator=(NeighbourCache&&) = default;
+
+    auto enabled() const noexcept -> bool { return _capacity != 0; }
+    auto capacity() const noexcept -> size_t { return _capacity; }
+    auto stats() const noexcept -> Stats
+    {
+        return {_hits, _misses, _index.size()};
+    }
+
+    auto clear() noexcept -> void;
+
+    /// Same as `hamiltonian.for_each(spin, f)`, but uses the cached terms
+    /// if possible.
+    template <class Function>
+    TCM_FORCEINLINE TCM_HOT auto for_each(SpinHamiltonian const& hamiltonian,
+                                          SpinVector const  spin,
+                                          Function&&        f) -> void
+    {
+        if (!enabled()) {
+            hamiltonian.for_each(spin, std::forward<Function>(f));
+            return;
+        }
+        auto const where = _index.find(spin);
+        if (where != _index.end()) {
+            ++_hits;
+            auto const first = where->second.first;
+            auto const last  = first + where->second.second;
+            for (auto i = first; i < last; ++i) {
+                f(_elements[i], _neighbours[i]);
+            }
+            return;
+        }
+        ++_misses;
+        // H|σ⟩ contains at most one term per edge plus the diagonal one
+        auto const max_terms = hamiltonian.size() + 1;
+        if (max_terms > _capacity) {
+            // The entry might not fit even into an empty cache, so we don't
+            // cache it at all rather than throwing away everything else.
+            hamiltonian.for_each(spin, std::forward<Function>(f));
+            return;
+        }
+        if (_neighbours.size() + max_terms > _capacity) { clear(); }
+        auto const offset = _neighbours.size();
+        hamiltonian.for_each(
+            spin, [this, &f](real_type const c, SpinVector const s) {
+                _neighbours.push_back(s);
+                _elements.push_back(c);
+                f(c, s);
+            });
+        _index.emplace(spin, std::make_pair(
+                                 static_cast<uint32_t>(offset),
+                                 static_cast<uint32_t>(_neighbours.size()
+                                                       - offset)));
+    }
+};
+// [NeighbourCache] }}}
+
 // [Polynomial] {{{
+/// \brief Controls truncation of intermediate states in #Polynomial.
 ///
+/// After every iteration terms `cᵢ|σᵢ⟩` with `|cᵢ| < absolute` or
+/// `|cᵢ| < relative * maxⱼ|cⱼ|` are dropped. Afterwards, only `max_terms`
+/// largest (by magnitude) terms are kept.
 ///
+/// `memory_budget` is a hard limit (in bytes) on the memory used by the two
+/// hash tables in #Polynomial. It is enforced adaptively: before applying
+/// the next factor `H - r`, the state is truncated such that the *expected*
+/// size of the result fits into the budget. The growth factor is measured
+/// on the previous iteration.
 ///
-class Polynomial {
+/// By default, nothing is pruned.
+struct PruningOptions {
+    real_type absolute      = 0;
+    real_type relative      = 0;
+    size_t    max_terms     = std::numeric_limits<size_t>::max();
+    size_t    memory_budget = std::numeric_limits<size_t>::max();
+
+    constexpr auto enabled() const noexcept -> bool
+    {
+        return absolute > 0 || relative > 0
+               || max_terms != std::numeric_limits<size_t>::max()
+               || memory_budget != std::numeric_limits<size_t>::max();
+    }
+};
+
+/// \brief Polynomial in H with coefficients of type `T`.
+///
+/// \tparam T Either #real_type or #complex_type. The former can only be used
+///           when all roots are real, but does half the work.
+template <class T> class BasicPolynomial {
+  public:
+    using state_type = BasicQuantumState<T>;
+
   private:
-    QuantumState _current;
-    QuantumState _old;
+    state_type _current;
+    state_type _old;
     /// Hamiltonian which knows how to perform `|ψ⟩ += c * H|σ⟩`.
-    std::shared_ptr<Heisenberg const> _hamiltonian;
+    std::shared_ptr<SpinHamiltonian const> _hamiltonian;
     /// List of roots A.
-    std::vector<complex_type> _roots;
+    std::vector<T> _roots;
     bool _normalising;
+    PruningOptions _pruning;
+    /// Maximal number of terms in `_old` allowed by `_pruning.memory_budget`.
+    size_t _budget_terms;
+    /// Largest number of terms `_old` or `_current` had to hold so far. Both
+    /// are reserved to it at the beginning of every application, so once
+    /// warmed up, iterations never rehash. `clear()` keeps the capacity, so
+    /// this is a no-op unless the bound grew.
+    size_t _peak_terms;
+    /// Estimate of the relative norm discarded by pruning during the last
+    /// application of the polynomial.
+    real_type _discarded;
+    /// Scratch space for pruning
+    std::vector<real_type> _magnitudes;
+    /// Memoised `H|σ⟩` (disabled by default)
+    NeighbourCache _cache;
 
   public:
     /// Constructs the polynomial given the hamiltonian and a list or terms.
-    Polynomial(std::shared_ptr<Heisenberg const> hamiltonian,
-               std::vector<complex_type> roots, bool normalising);
+    ///
+    /// \param cache_size Capacity (in terms) of the #NeighbourCache. `0`
+    ///                   disables caching.
+    BasicPolynomial(std::shared_ptr<SpinHamiltonian const> hamiltonian,
+                    std::vector<T> roots, bool normalising,
+                    PruningOptions const& pruning    = {},
+                    size_t                cache_size = 0);
 
-    Polynomial(Polynomial const&)           = delete;
-    Polynomial(Polynomial&& other) noexcept = default;
-    Polynomial& operator=(Polynomial const&) = delete;
-    Polynomial& operator=(Polynomial&&) = delete;
+    BasicPolynomial(BasicPolynomial const&)           = delete;
+    BasicPolynomial(BasicPolynomial&& other) noexcept = default;
+    BasicPolynomial& operator=(BasicPolynomial const&) = delete;
+    BasicPolynomial& operator=(BasicPolynomial&&) = delete;
+
+    auto degree() const noexcept -> size_t { return _roots.size(); }
+    auto hamiltonian() const noexcept -> SpinHamiltonian const&
+    {
+        return *_hamiltonian;
+    }
+    auto normalising() const noexcept -> bool { return _normalising; }
+    auto pruning() const noexcept -> PruningOptions const& { return _pruning; }
+
+    /// Returns a first-order estimate of `‖P|ψ⟩ - P̃|ψ⟩‖ / ‖P̃|ψ⟩‖` where
+    /// `P̃` is the pruned polynomial and `|ψ⟩` is the state to which the
+    /// polynomial was last applied. It is computed as the sum of relative
+    /// norms of terms discarded in every iteration.
+    auto discarded_norm() const noexcept -> real_type { return _discarded; }
 
-    inline auto degree() const noexcept -> size_t;
+    auto cache_stats() const noexcept -> NeighbourCache::Stats
+    {
+        return _cache.stats();
+    }
 
     /// Applies the polynomial to state `|ψ⟩ = coeff * |spin⟩`.
-    TCM_HOT auto operator()(complex_type coeff, SpinVector spin)
-        -> QuantumState const&;
+    TCM_HOT auto operator()(T coeff, SpinVector spin) -> state_type const&;
 
     /// Applies the polynomial to state.
-    TCM_HOT auto operator()(QuantumState const& state) -> QuantumState const&;
+    TCM_HOT auto operator()(state_type const& state) -> state_type const&;
 
   private:
-    auto iteration(complex_type root, QuantumState& current,
-                   QuantumState const& old) const -> void;
+    auto iteration(T root, state_type& current, state_type const& old) -> void;
+
+    /// Performs `|ψ⟩ += c * H|σ⟩` going through `_cache`.
+    auto expand(T coeff, SpinVector spin, state_type& psi) -> void
+    {
+        _cache.for_each(*_hamiltonian, spin,
+                        [coeff, &psi](real_type const c, SpinVector const s) {
+                            psi += {coeff * c, s};
+                        });
+    }
+
+    template <size_t Offset> auto kernel() -> state_type const&;
+    auto reserve_buffers() -> void;
 
-    template <size_t Offset> auto kernel() -> QuantumState const&;
+    /// Truncates `_old` according to `_pruning` keeping at most `max_terms`
+    /// terms.
+    auto prune(size_t max_terms) -> void;
 
 #if 0
     template <class Map>
@@ -271,10 +641,184 @@ class Polynomial {
 #endif
 };
 
-inline auto Polynomial::degree() const noexcept -> size_t
-{
-    return _roots.size();
-}
+/// \brief Polynomial in H which picks the coefficient type automatically.
+///
+/// If all roots are real and P(H) is linear (i.e. neither normalisation nor
+/// pruning is used), #BasicPolynomial<real_type> is used under the hood,
+/// otherwise -- #BasicPolynomial<complex_type>. Hot loops should use #visit
+/// to get hold of the underlying polynomial.
+class Polynomial {
+  public:
+    using real_polynomial_type    = BasicPolynomial<real_type>;
+    using complex_polynomial_type = BasicPolynomial<complex_type>;
+    using variant_type =
+        std::variant<real_polynomial_type, complex_polynomial_type>;
+
+  private:
+    std::vector<complex_type> _roots;
+    variant_type              _impl;
+    /// Output buffer used by operator() when `is_real()`.
+    QuantumState _result;
+    /// Real and imaginary parts of the input used by operator() when
+    /// `is_real()`. They are kept around to avoid reallocations.
+    real_polynomial_type::state_type _real_part;
+    real_polynomial_type::state_type _imag_part;
+
+  public:
+    Polynomial(std::shared_ptr<SpinHamiltonian const> hamiltonian,
+               std::vector<complex_type> roots, bool normalising,
+               PruningOptions const& pruning = {}, size_t cache_size = 0);
+
+    Polynomial(Polynomial const&)           = delete;
+    Polynomial(Polynomial&& other) noexcept = default;
+    Polynomial& operator=(Polynomial const&) = delete;
+    Polynomial& operator=(Polynomial&&) = delete;
+
+    /// Calls `f` with the underlying #BasicPolynomial.
+    template <class Function> decltype(auto) visit(Function&& f)
+    {
+        return std::visit(std::forward<Function>(f), _impl);
+    }
+    template <class Function> decltype(auto) visit(Function&& f) const
+    {
+        return std::visit(std::forward<Function>(f), _impl);
+    }
+
+    /// Returns whether real arithmetic is used.
+    auto is_real() const noexcept -> bool { return _impl.index() == 0; }
+    auto degree() const noexcept -> size_t { return _roots.size(); }
+    auto roots() const noexcept -> gsl::span<complex_type const>
+    {
+        return _roots;
+    }
+    auto hamiltonian() const noexcept -> SpinHamiltonian const&
+    {
+        return visit([](auto const& p) -> SpinHamiltonian const& {
+            return p.hamiltonian();
+        });
+    }
+    auto normalising() const noexcept -> bool
+    {
+        return visit([](auto const& p) { return p.normalising(); });
+    }
+    auto pruning() const noexcept -> PruningOptions const&
+    {
+        return visit([](auto const& p) -> PruningOptions const& {
+            return p.pruning();
+        });
+    }
+    auto discarded_norm() const noexcept -> real_type
+    {
+        return visit([](auto const& p) { return p.discarded_norm(); });
+    }
+    auto cache_stats() const noexcept -> NeighbourCache::Stats
+    {
+        return visit([](auto const& p) { return p.cache_stats(); });
+    }
+
+    /// Applies the polynomial to state `|ψ⟩ = coeff * |spin⟩`.
+    auto operator()(complex_type coeff, SpinVector spin) -> QuantumState const&;
+
+    /// Applies the polynomial to state.
+    auto operator()(QuantumState const& state) -> QuantumState const&;
+};
+
+/// \brief Chebyshev expansion `p(H) = ∑ₖ cₖTₖ(H̃)` where `H̃ = (H - a) / b`.
+///
+/// Spectral bounds `[lower, upper]` of H are mapped onto `[-1, 1]`, i.e.
+/// `a = (upper + lower) / 2` and `b = (upper - lower) / 2`. Unlike products
+/// of `(H - rᵢ)`, the expansion stays well-conditioned for high degrees.
+///
+/// `Tₖ(H̃)|ψ⟩` are computed using the three-term recurrence
+/// `Tₖ₊₁ = 2H̃Tₖ - Tₖ₋₁`. `Tₖ₊₁` is accumulated in-place on top of `-Tₖ₋₁`,
+/// so apart from the result only two intermediate states are kept and
+/// nothing is ever copied.
+class ChebyshevFilter {
+  public:
+    using state_type = BasicQuantumState<real_type>;
+
+  private:
+    state_type _result;
+    state_type _current;  ///< `Tₖ|ψ⟩`
+    state_type _previous; ///< `-Tₖ₋₁|ψ⟩` which becomes `Tₖ₊₁|ψ⟩`
+    /// Hamiltonian which knows how to perform `|ψ⟩ += c * H|σ⟩`.
+    std::shared_ptr<SpinHamiltonian const> _hamiltonian;
+    /// Expansion coefficients cₖ.
+    std::vector<real_type> _coefficients;
+    real_type              _lower;
+    real_type              _upper;
+    /// Memoised `H|σ⟩` (disabled by default)
+    NeighbourCache _cache;
+
+  public:
+    /// Constructs the filter given the hamiltonian, expansion coefficients
+    /// `cₖ` and spectral bounds `[lower, upper]` of the hamiltonian.
+    ///
+    /// \param cache_size Capacity (in terms) of the #NeighbourCache. `0`
+    ///                   disables caching.
+    ChebyshevFilter(std::shared_ptr<SpinHamiltonian const> hamiltonian,
+                    std::vector<real_type>            coefficients,
+                    std::pair<real_type, real_type> bounds,
+                    size_t                          cache_size = 0);
+
+    ChebyshevFilter(ChebyshevFilter const&)           = delete;
+    ChebyshevFilter(ChebyshevFilter&& other) noexcept = default;
+    ChebyshevFilter& operator=(ChebyshevFilter const&) = delete;
+    ChebyshevFilter& operator=(ChebyshevFilter&&) = delete;
+
+    auto degree() const noexcept -> size_t { return _coefficients.size() - 1; }
+    auto hamiltonian() const noexcept -> SpinHamiltonian const&
+    {
+        return *_hamiltonian;
+    }
+    auto coefficients() const noexcept -> gsl::span<real_type const>
+    {
+        return _coefficients;
+    }
+    auto bounds() const noexcept -> std::pair<real_type, real_type>
+    {
+        return {_lower, _upper};
+    }
+    auto center() const noexcept -> real_type
+    {
+        return (_upper + _lower) / 2;
+    }
+    auto radius() const noexcept -> real_type
+    {
+        return (_upper - _lower) / 2;
+    }
+
+    auto cache_stats() const noexcept -> NeighbourCache::Stats
+    {
+        return _cache.stats();
+    }
+
+    /// Applies the filter to state `|ψ⟩ = coeff * |spin⟩`.
+    TCM_HOT auto operator()(real_type coeff, SpinVector spin)
+        -> state_type const&;
+
+    /// Applies the filter to state.
+    TCM_HOT auto operator()(state_type const& state) -> state_type const&;
+
+  private:
+    /// Performs `|ψ⟩ += coeff * H̃|σ⟩` going through `_cache`.
+    auto expand(real_type coeff, SpinVector spin, state_type& psi) -> void
+    {
+        auto const scale = coeff / radius();
+        _cache.for_each(*_hamiltonian, spin,
+                        [scale, &psi](real_type const c, SpinVector const s) {
+                            psi += {scale * c, s};
+                        });
+        psi += {-scale * center(), spin};
+    }
+
+    /// Performs `|_result⟩ += coeff * |psi⟩`.
+    auto accumulate(real_type coeff, state_type const& psi) -> void;
+
+    /// Runs the recurrence given `|_current⟩ = T₁|ψ⟩` and
+    /// `|_previous⟩ = -T₀|ψ⟩`.
+    auto kernel() -> state_type const&;
+};
 
 #if 0
 template <class Map>
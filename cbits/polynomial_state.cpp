@@ -27,6 +27,7 @@
 // OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "polynomial_state.hpp"
+#include "parallel.hpp"
 
 #include <boost/align/is_aligned.hpp>
 #include <mkl_cblas.h>
@@ -55,7 +56,20 @@ TCM_NAMESPACE_BEGIN
 
 namespace detail {
 
-ForwardPropagator::ForwardPropagator(std::pair<size_t, size_t> input_shape)
+namespace {
+/// Value used to fill unused coefficients, so that bugs show up as NaNs.
+template <class C> constexpr auto poison() noexcept -> C
+{
+    constexpr auto NaN = std::numeric_limits<float>::quiet_NaN();
+    if constexpr (std::is_same<C, float>::value) { return NaN; }
+    else {
+        return C{NaN, NaN};
+    }
+}
+} // namespace
+
+template <class C>
+ForwardPropagator<C>::ForwardPropagator(std::pair<size_t, size_t> input_shape)
     : _spins{}, _coeffs{}, _count{0}, _batch_size{input_shape.first}
 {
     TCM_CHECK(
@@ -68,46 +82,52 @@ ForwardPropagator::ForwardPropagator(std::pair<size_t, size_t> input_shape)
                           "positive system size",
                           input_shape.first, input_shape.second));
     _spins.resize(input_shape.first, SpinVector{});
-    constexpr auto NaN = std::numeric_limits<float>::quiet_NaN();
-    _coeffs.resize(input_shape.first, std::complex<float>{NaN, NaN});
+    _coeffs.resize(input_shape.first, poison<C>());
 }
 
-auto ForwardPropagator::coeffs() const noexcept
-    -> gsl::span<std::complex<float> const>
+template <class C>
+auto ForwardPropagator<C>::coeffs() const noexcept -> gsl::span<C const>
 {
     TCM_ASSERT(_coeffs.size() == batch_size(),
                "ForwardPropagator is in an invalid state");
     return _coeffs;
 }
 
-auto ForwardPropagator::clear() noexcept -> void
+template <class C> auto ForwardPropagator<C>::clear() noexcept -> void
 {
+    // Elements past `_count` are never read: they are overwritten either by
+    // `push` or by `fill` before a batch is run. Poisoning them is thus only
+    // useful for debugging.
+#if defined(TCM_DEBUG)
     using std::begin, std::end;
-    std::fill(begin(_spins), end(_spins), SpinVector{});
-    constexpr auto NaN = std::numeric_limits<float>::quiet_NaN();
-    std::fill(begin(_coeffs), end(_coeffs), std::complex<float>{NaN, NaN});
+    std::fill(begin(_coeffs), end(_coeffs), poison<C>());
+#endif
     _count = 0;
 }
 
-constexpr auto ForwardPropagator::batch_size() const noexcept -> size_t
+template <class C>
+constexpr auto ForwardPropagator<C>::batch_size() const noexcept -> size_t
 {
     return _batch_size;
 }
 
-constexpr auto ForwardPropagator::full() const noexcept -> bool
+template <class C>
+constexpr auto ForwardPropagator<C>::full() const noexcept -> bool
 {
     TCM_ASSERT(_count <= _batch_size, "precondition violated");
     return _count == _batch_size;
 }
 
-constexpr auto ForwardPropagator::empty() const noexcept -> bool
+template <class C>
+constexpr auto ForwardPropagator<C>::empty() const noexcept -> bool
 {
     TCM_ASSERT(_count <= _batch_size, "precondition violated");
     return _count == 0;
 }
 
-auto ForwardPropagator::push(SpinVector const&   spin,
-                             std::complex<float> coeff) TCM_NOEXCEPT -> void
+template <class C>
+auto ForwardPropagator<C>::push(SpinVector const& spin, C coeff) TCM_NOEXCEPT
+    -> void
 {
     TCM_ASSERT(!full(), "buffer is full");
     _spins[_count]  = spin;
@@ -115,7 +135,7 @@ auto ForwardPropagator::push(SpinVector const&   spin,
     ++_count;
 }
 
-auto ForwardPropagator::fill() TCM_NOEXCEPT -> void
+template <class C> auto ForwardPropagator<C>::fill() TCM_NOEXCEPT -> void
 {
     TCM_ASSERT(!empty(), "precondition violated");
     auto spin = _spins[_count - 1];
@@ -126,9 +146,10 @@ auto ForwardPropagator::fill() TCM_NOEXCEPT -> void
     TCM_ASSERT(full(), "postcondition violated");
 }
 
+template <class C>
 template <class ForwardFn>
-auto ForwardPropagator::run(ForwardFn&& fn)
-    -> std::pair<gsl::span<std::complex<float> const>, torch::Tensor>
+auto ForwardPropagator<C>::run(ForwardFn&& fn)
+    -> std::pair<gsl::span<C const>, torch::Tensor>
 {
     TCM_ASSERT(full(), "batch is not yet filled");
     TCM_ASSERT(_spins.size() == _batch_size, "precondition violated");
@@ -187,6 +208,19 @@ auto dotu(gsl::span<std::complex<float> const> xs,
     return r;
 }
 
+/// Same as above except that `xs` are real, so we do two real dot products
+/// instead of a complex one.
+auto dotu(gsl::span<float const>               xs,
+          gsl::span<std::complex<float> const> ys) TCM_NOEXCEPT
+    -> std::complex<float>
+{
+    TCM_ASSERT(xs.size() == ys.size(), "dimensions don't match");
+    auto const  n = static_cast<MKL_INT>(xs.size());
+    auto const* y = reinterpret_cast<float const*>(ys.data());
+    return {cblas_sdot(n, xs.data(), 1, y, 2),
+            cblas_sdot(n, xs.data(), 1, y + 1, 2)};
+}
+
 /// Computes xs <- exp(xs - k)
 auto exp_min_const(gsl::span<std::complex<float>> xs, float const k) -> void
 {
@@ -211,14 +245,17 @@ auto exp_min_const(gsl::span<std::complex<float>> xs, float const k) -> void
 }
 } // namespace
 
-Accumulator::Accumulator(std::pair<size_t, size_t> const input_shape,
-                         gsl::span<std::complex<float>>  out)
+template <class C>
+Accumulator<C>::Accumulator(std::pair<size_t, size_t> const input_shape,
+                            gsl::span<std::complex<float>>  out)
     : _forward{input_shape}, _store{out}, _state{}, _counts{}
 {
     _counts.reserve(_forward.batch_size());
 }
 
-auto Accumulator::reset(gsl::span<std::complex<float>> out) TCM_NOEXCEPT -> void
+template <class C>
+auto Accumulator<C>::reset(gsl::span<std::complex<float>> out) TCM_NOEXCEPT
+    -> void
 {
     _forward.clear();
     _store = output_type{out};
@@ -226,15 +263,15 @@ auto Accumulator::reset(gsl::span<std::complex<float>> out) TCM_NOEXCEPT -> void
     _counts.clear();
 }
 
+template <class C>
 template <class ForwardFn, class Iterator>
-auto Accumulator::operator()(ForwardFn fn, Iterator first, Iterator last)
+auto Accumulator<C>::operator()(ForwardFn fn, Iterator first, Iterator last)
     -> void
 {
     TCM_ASSERT(!_forward.full(), "precondition violated");
     _counts.push_back(0);
     for (; first != last; ++first) {
-        _forward.push(first->first,
-                      static_cast<std::complex<float>>(first->second));
+        _forward.push(first->first, static_cast<C>(first->second));
         ++_counts.back();
         if (_forward.full()) {
             process_batch(fn);
@@ -244,7 +281,9 @@ auto Accumulator::operator()(ForwardFn fn, Iterator first, Iterator last)
     TCM_ASSERT(!_forward.full(), "postcondition violated");
 }
 
-template <class ForwardFn> auto Accumulator::finalize(ForwardFn fn) -> void
+template <class C>
+template <class ForwardFn>
+auto Accumulator<C>::finalize(ForwardFn fn) -> void
 {
     TCM_ASSERT(!_forward.full(), "precondition violated");
     if (_forward.empty()) {
@@ -257,7 +296,9 @@ template <class ForwardFn> auto Accumulator::finalize(ForwardFn fn) -> void
     TCM_ASSERT(_forward.empty(), "");
 }
 
-template <class ForwardFn> auto Accumulator::process_batch(ForwardFn fn) -> void
+template <class C>
+template <class ForwardFn>
+auto Accumulator<C>::process_batch(ForwardFn fn) -> void
 {
     using std::swap;
     TCM_ASSERT(!_counts.empty(), "precondition violated");
@@ -294,20 +335,240 @@ template <class ForwardFn> auto Accumulator::process_batch(ForwardFn fn) -> void
 PolynomialStateV2::PolynomialStateV2(std::shared_ptr<Polynomial> polynomial,
                                      ForwardT                    fn,
                                      std::pair<size_t, size_t>   input_shape)
-    : _poly{std::move(polynomial)}, _fn{std::move(fn)}, _accum{input_shape, {}}
-{}
+    : _poly{std::move(polynomial)}
+    , _fn{std::move(fn)}
+    , _accum{detail::Accumulator<float>{input_shape, {}}}
+    , _batch_size{input_shape.first}
+    , _batch{}
+    , _x{}
+    , _workspace{}
+    , _shared{}
+{
+    auto const& poly = std::get<0>(_poly);
+    TCM_CHECK(poly != nullptr, std::invalid_argument,
+              "polynomial must not be None");
+    if (!poly->is_real()) {
+        _accum.emplace<detail::Accumulator<std::complex<float>>>(
+            input_shape, gsl::span<std::complex<float>>{});
+    }
+}
+
+PolynomialStateV2::PolynomialStateV2(std::shared_ptr<ChebyshevFilter> filter,
+                                     ForwardT                         fn,
+                                     std::pair<size_t, size_t> input_shape)
+    : _poly{std::move(filter)}
+    , _fn{std::move(fn)}
+    , _accum{detail::Accumulator<float>{input_shape, {}}}
+    , _batch_size{input_shape.first}
+    , _batch{}
+    , _x{}
+    , _workspace{}
+    , _shared{}
+{
+    TCM_CHECK(std::get<1>(_poly) != nullptr, std::invalid_argument,
+              "filter must not be None");
+}
+
+template <class Function>
+decltype(auto) PolynomialStateV2::visit(Function&& f)
+{
+    if (_poly.index() == 0) {
+        return std::get<0>(_poly)->visit(std::forward<Function>(f));
+    }
+    return std::forward<Function>(f)(*std::get<1>(_poly));
+}
+
+template <class P, class C>
+auto PolynomialStateV2::evaluate(P& polynomial, detail::Accumulator<C>& accum,
+                                 gsl::span<SpinVector const>    spins,
+                                 gsl::span<std::complex<float>> out) -> void
+{
+    using T = typename P::state_type::coefficient_type;
+    accum.reset(out);
+    for (auto const& s : spins) {
+        auto const& state = polynomial(T{1}, s);
+        accum(std::cref(_fn), state.begin(), state.end());
+    }
+    accum.finalize(std::cref(_fn));
+}
 
 auto PolynomialStateV2::operator()(gsl::span<SpinVector const> spins)
     -> torch::Tensor
 {
-    auto out = detail::make_tensor<float>(spins.size(), 2);
-    _accum.reset(gsl::span<std::complex<float>>{
-        reinterpret_cast<std::complex<float>*>(out.data_ptr()), spins.size()});
-    for (auto const& s : spins) {
-        auto const& state = (*_poly)(1.0f, s);
-        _accum(std::cref(_fn), state.begin(), state.end());
+    auto       out    = detail::make_tensor<float>(spins.size(), 2);
+    auto const buffer = gsl::span<std::complex<float>>{
+        reinterpret_cast<std::complex<float>*>(out.data_ptr()), spins.size()};
+    visit([this, spins, buffer](auto& polynomial) {
+        using T = typename std::remove_reference_t<
+            decltype(polynomial)>::state_type::coefficient_type;
+        using C = std::conditional_t<std::is_same<T, real_type>::value, float,
+                                     std::complex<float>>;
+        evaluate(polynomial, std::get<detail::Accumulator<C>>(_accum), spins,
+                 buffer);
+    });
+    return out;
+}
+
+auto PolynomialStateV2::forward_all(gsl::span<SpinVector const>    spins,
+                                    gsl::span<std::complex<float>> out) -> void
+{
+    TCM_ASSERT(spins.size() == out.size(), "sizes don't match");
+    auto const size = spins.size();
+    // The last batch is padded with copies of the last state just like in
+    // ForwardPropagator::fill.
+    auto const batch = _batch.get(_batch_size);
+    for (auto i = size_t{0}; i < size; i += _batch_size) {
+        auto const count = std::min(_batch_size, size - i);
+        std::copy_n(spins.data() + i, count, batch.data());
+        std::fill(batch.data() + count, batch.data() + _batch_size,
+                  spins[i + count - 1]);
+        auto const output = _fn(batch);
+        TCM_CHECK_SHAPE("output tensor", output,
+                        {static_cast<int64_t>(_batch_size), 2});
+        TCM_CHECK_CONTIGUOUS("output tensor", output);
+        std::copy_n(
+            reinterpret_cast<std::complex<float> const*>(output.data_ptr()),
+            count, out.data() + i);
     }
-    _accum.finalize(std::cref(_fn));
+}
+
+template <class P>
+auto PolynomialStateV2::evaluate_shared(P&                             polynomial,
+                                        gsl::span<SpinVector const>    spins,
+                                        gsl::span<std::complex<float>> out)
+    -> void
+{
+    using T = typename P::state_type::coefficient_type;
+    // Sparse [support, batch] matrix C with Cⱼᵢ = ⟨σ'ⱼ|P(H)|σᵢ⟩ stored
+    // column by column: column i occupies [offsets[i], offsets[i + 1]).
+    auto& scratch = _shared;
+    auto& index   = scratch.index;
+    index.clear();
+    auto const offsets = scratch.offsets.get(spins.size() + 1);
+    auto       support = gsl::span<SpinVector>{};
+    auto       rows    = gsl::span<int64_t>{};
+    auto       coeffs  = gsl::span<T>{};
+    auto       size    = size_t{0}; // Number of unique configurations
+    auto       nnz     = size_t{0}; // Number of non-zero elements of C
+    offsets[0]         = 0;
+    for (auto i = size_t{0}; i < spins.size(); ++i) {
+        auto const& state = polynomial(T{1}, spins[i]);
+        // Buffers are grown once per expansion rather than once per term.
+        support = scratch.support.get(size + state.size(), size);
+        rows    = scratch.rows.get(nnz + state.size(), nnz);
+        coeffs  = scratch.template coeffs<T>().get(nnz + state.size(), nnz);
+        for (auto const& item : state) {
+            auto const r =
+                index.emplace(item.first, static_cast<int64_t>(size));
+            if (r.second) { support[size++] = item.first; }
+            rows[nnz]   = r.first->second;
+            coeffs[nnz] = item.second;
+            ++nnz;
+        }
+        offsets[i + 1] = nnz;
+    }
+    support = support.subspan(0, size);
+
+    // Every unique configuration goes through the network exactly once
+    auto const log_psi = scratch.log_psi.get(size);
+    forward_all(support, log_psi);
+
+    // out := log(Cᵀψ) where every column is computed using log-sum-exp with
+    // its own scale, since amplitudes of different columns may differ by
+    // more than the range of floats.
+    parallel_for(
+        0, static_cast<int64_t>(spins.size()),
+        [out, offsets, rows, coeffs, log_psi](auto const i) {
+            auto const b     = static_cast<size_t>(i);
+            auto       scale = -std::numeric_limits<float>::infinity();
+            for (auto k = offsets[b]; k < offsets[b + 1]; ++k) {
+                scale = std::max(
+                    scale, log_psi[static_cast<size_t>(rows[k])].real());
+            }
+            if (scale == -std::numeric_limits<float>::infinity()) {
+                // All amplitudes are zero
+                out[b] = std::complex<float>{scale, 0.0f};
+                return;
+            }
+            auto sum = complex_type{0};
+            for (auto k = offsets[b]; k < offsets[b + 1]; ++k) {
+                sum += coeffs[k]
+                       * std::exp(static_cast<complex_type>(
+                                      log_psi[static_cast<size_t>(rows[k])])
+                                  - static_cast<real_type>(scale));
+            }
+            out[b] = static_cast<std::complex<float>>(
+                static_cast<real_type>(scale) + std::log(sum));
+        },
+        /*cutoff=*/64);
+    for (auto const& x : out) {
+        TCM_CHECK(!std::isnan(x.real()) && !std::isnan(x.imag()),
+                  std::runtime_error,
+                  "NaN encountered in neural network output");
+    }
+}
+
+auto PolynomialStateV2::operator()(gsl::span<SpinVector const> spins,
+                                   bool const shared_support) -> torch::Tensor
+{
+    if (!shared_support) { return (*this)(spins); }
+    auto       out    = detail::make_tensor<float>(spins.size(), 2);
+    auto const buffer = gsl::span<std::complex<float>>{
+        reinterpret_cast<std::complex<float>*>(out.data_ptr()), spins.size()};
+    if (!spins.empty()) {
+        visit([this, spins, buffer](auto& polynomial) {
+            evaluate_shared(polynomial, spins, buffer);
+        });
+    }
+    return out;
+}
+
+auto PolynomialStateV2::operator()(SectorBasis const& basis) -> torch::Tensor
+{
+    auto const states = basis.states();
+    auto const norms  = basis.norms();
+    auto const size   = states.size();
+    TCM_CHECK(size > 0, std::invalid_argument, "basis is empty");
+    auto  out = detail::make_tensor<float>(size, 2);
+    auto* log_values =
+        reinterpret_cast<std::complex<float>*>(out.data_ptr());
+    forward_all(states, {log_values, size});
+
+    auto scale = -std::numeric_limits<float>::infinity();
+    for (auto i = size_t{0}; i < size; ++i) {
+        TCM_CHECK(!std::isnan(log_values[i].real()), std::runtime_error,
+                  "NaN encountered in neural network output");
+        scale = std::max(scale, log_values[i].real());
+    }
+
+    // Coefficients of |ψ⟩ in `basis` (see SectorBasis for the relation
+    // between amplitudes and coefficients).
+    auto const x = _x.get(size);
+    parallel_for(
+        0, static_cast<int64_t>(size),
+        [log_values, norms, scale, p = x.data()](auto const i) {
+            p[i] = std::exp(static_cast<complex_type>(log_values[i])
+                            - static_cast<real_type>(scale))
+                   / std::sqrt(norms[static_cast<size_t>(i)]);
+        },
+        /*cutoff=*/1024);
+    std::visit(
+        [this, &basis, x](auto const& polynomial) {
+            using P = typename std::decay_t<decltype(polynomial)>::element_type;
+            // Chebyshev recurrence needs two vectors in addition to x
+            auto const factor =
+                std::is_same<P, ChebyshevFilter>::value ? size_t{2} : size_t{1};
+            apply(*polynomial, basis, x, _workspace.get(factor * x.size()));
+        },
+        _poly);
+    parallel_for(
+        0, static_cast<int64_t>(size),
+        [log_values, norms, scale, p = x.data()](auto const i) {
+            log_values[i] = static_cast<std::complex<float>>(
+                static_cast<real_type>(scale)
+                + std::log(p[i] * std::sqrt(norms[static_cast<size_t>(i)])));
+        },
+        /*cutoff=*/1024);
     return out;
 }
 
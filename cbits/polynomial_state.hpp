@@ -29,18 +29,20 @@
 #pragma once
 
 #include "polynomial.hpp"
+#include "sector.hpp"
 
 TCM_NAMESPACE_BEGIN
 
 namespace detail {
-struct ForwardPropagator {
+/// \tparam C Type of coefficients: either `float` or `std::complex<float>`.
+template <class C> struct ForwardPropagator {
   private:
-    aligned_vector<SpinVector>          _spins;
-    aligned_vector<std::complex<float>> _coeffs;
-    size_t                              _count;
-    size_t                              _batch_size;
+    aligned_vector<SpinVector> _spins;
+    aligned_vector<C>          _coeffs;
+    size_t                     _count;
+    size_t                     _batch_size;
 
-    inline auto coeffs() const noexcept -> gsl::span<std::complex<float> const>;
+    inline auto coeffs() const noexcept -> gsl::span<C const>;
 
   public:
     explicit ForwardPropagator(std::pair<size_t, size_t> input_shape);
@@ -49,16 +51,16 @@ struct ForwardPropagator {
     constexpr auto batch_size() const noexcept -> size_t;
     constexpr auto full() const noexcept -> bool;
     constexpr auto empty() const noexcept -> bool;
-    inline auto    push(SpinVector const&   spin,
-                        std::complex<float> coeff) TCM_NOEXCEPT -> void;
+    inline auto    push(SpinVector const& spin, C coeff) TCM_NOEXCEPT -> void;
     inline auto    fill() TCM_NOEXCEPT -> void;
 
     template <class ForwardFn>
     inline auto run(ForwardFn&& fn)
-        -> std::pair<gsl::span<std::complex<float> const>, torch::Tensor>;
+        -> std::pair<gsl::span<C const>, torch::Tensor>;
 };
 
-struct Accumulator {
+/// \tparam C Type of coefficients: either `float` or `std::complex<float>`.
+template <class C> struct Accumulator {
   private:
     struct state_type {
       public:
@@ -108,8 +110,8 @@ struct Accumulator {
         }
     };
 
-    ForwardPropagator   _forward;
-    output_type         _store;
+    ForwardPropagator<C> _forward;
+    output_type          _store;
     state_type          _state;
     std::vector<size_t> _counts;
 
@@ -127,16 +129,48 @@ struct Accumulator {
   private:
     template <class ForwardFn> auto process_batch(ForwardFn fn) -> void;
 };
+/// Buffers used by PolynomialStateV2 when evaluating with shared support.
+/// They are kept between calls so that evaluation does not allocate once
+/// sizes stabilise.
+struct SharedSupportScratch {
+    ska::bytell_hash_map<SpinVector, int64_t> index;
+    ScratchBuffer<SpinVector>                 support;
+    ScratchBuffer<size_t>                     offsets;
+    ScratchBuffer<int64_t>                    rows;
+    ScratchBuffer<real_type>                  real_coeffs;
+    ScratchBuffer<complex_type>               complex_coeffs;
+    ScratchBuffer<std::complex<float>>        log_psi;
+
+    template <class T> auto coeffs() noexcept -> ScratchBuffer<T>&
+    {
+        if constexpr (std::is_same<T, real_type>::value) { return real_coeffs; }
+        else {
+            return complex_coeffs;
+        }
+    }
+};
 } // namespace detail
 
 class PolynomialStateV2 {
-    std::shared_ptr<Polynomial> _poly;
-    ForwardT                    _fn;
-    detail::Accumulator         _accum;
+    std::variant<std::shared_ptr<Polynomial>, std::shared_ptr<ChebyshevFilter>>
+             _poly;
+    ForwardT _fn;
+    /// Real polynomials use real coefficients in the accumulator as well.
+    std::variant<detail::Accumulator<float>,
+                 detail::Accumulator<std::complex<float>>>
+           _accum;
+    size_t _batch_size;
+    /// Scratch space reused across calls
+    ScratchBuffer<SpinVector>    _batch;
+    ScratchBuffer<complex_type>  _x;
+    ScratchBuffer<complex_type>  _workspace;
+    detail::SharedSupportScratch _shared;
 
   public:
     PolynomialStateV2(std::shared_ptr<Polynomial> polynomial, ForwardT fn,
                       std::pair<size_t, size_t> input_shape);
+    PolynomialStateV2(std::shared_ptr<ChebyshevFilter> filter, ForwardT fn,
+                      std::pair<size_t, size_t> input_shape);
 
     PolynomialStateV2(PolynomialStateV2 const&)     = default;
     PolynomialStateV2(PolynomialStateV2&&) noexcept = default;
@@ -145,6 +179,41 @@ class PolynomialStateV2 {
         -> PolynomialStateV2& = default;
 
     auto operator()(gsl::span<SpinVector const> spins) -> torch::Tensor;
+
+    /// Same as above, but if `shared_support` is `true`, P(H)|σ⟩ for all σ
+    /// in `spins` are first merged into one sparse `[support, batch]` matrix.
+    /// The network is then run once per unique configuration in the support
+    /// and all outputs are obtained from a single sparse-dense product. This
+    /// pays off when expansions of different σ overlap, e.g. for consecutive
+    /// Monte Carlo samples.
+    auto operator()(gsl::span<SpinVector const> spins, bool shared_support)
+        -> torch::Tensor;
+
+    /// Computes log⟨σ|P(H)|ψ⟩ for every state `σ` in `basis` at once.
+    ///
+    /// Rather than expanding P(H)|σ⟩ for every σ, ψ is evaluated on the
+    /// whole basis and P(H) is applied to the resulting dense vector (see
+    /// #apply). Memory usage is thus O(dim) and no hash tables are involved.
+    /// For non-trivial groups ψ is assumed to belong to the sector.
+    auto operator()(SectorBasis const& basis) -> torch::Tensor;
+
+  private:
+    /// Calls `f` with the underlying #BasicPolynomial or #ChebyshevFilter.
+    template <class Function> decltype(auto) visit(Function&& f);
+
+    /// Computes log(ψ(σ)) for all `spins` in batches of `_batch_size`.
+    auto forward_all(gsl::span<SpinVector const>    spins,
+                     gsl::span<std::complex<float>> out) -> void;
+
+    /// \tparam P Either #BasicPolynomial or #ChebyshevFilter.
+    template <class P>
+    auto evaluate_shared(P& polynomial, gsl::span<SpinVector const> spins,
+                         gsl::span<std::complex<float>> out) -> void;
+
+    template <class P, class C>
+    auto evaluate(P& polynomial, detail::Accumulator<C>& accum,
+                  gsl::span<SpinVector const>    spins,
+                  gsl::span<std::complex<float>> out) -> void;
 };
 
 TCM_NAMESPACE_END
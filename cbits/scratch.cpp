@@ -0,0 +1,69 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "scratch.hpp"
+
+#include <atomic>
+
+TCM_NAMESPACE_BEGIN
+
+namespace {
+std::atomic<size_t> current_memory{0};
+std::atomic<size_t> peak_memory{0};
+} // namespace
+
+namespace detail {
+auto record_allocation(size_t const bytes) noexcept -> void
+{
+    auto const current =
+        current_memory.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    auto peak = peak_memory.load(std::memory_order_relaxed);
+    while (current > peak
+           && !peak_memory.compare_exchange_weak(peak, current,
+                                                 std::memory_order_relaxed)) {}
+}
+
+auto record_deallocation(size_t const bytes) noexcept -> void
+{
+    TCM_ASSERT(current_memory.load() >= bytes, "double free?");
+    current_memory.fetch_sub(bytes, std::memory_order_relaxed);
+}
+} // namespace detail
+
+auto memory_usage() noexcept -> MemoryUsage
+{
+    return {current_memory.load(std::memory_order_relaxed),
+            peak_memory.load(std::memory_order_relaxed)};
+}
+
+auto reset_peak_memory() noexcept -> void
+{
+    peak_memory.store(current_memory.load(std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+}
+
+TCM_NAMESPACE_END
@@ -0,0 +1,188 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+
+#include "config.hpp"
+#include "errors.hpp"
+
+#include <boost/align/aligned_alloc.hpp>
+#include <gsl/gsl-lite.hpp>
+
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+TCM_NAMESPACE_BEGIN
+
+/// Memory (in bytes) held by scratch buffers and quantum states.
+struct MemoryUsage {
+    size_t current;
+    size_t peak;
+};
+
+/// Returns memory currently allocated through #ScratchBuffer and
+/// #detail::TrackingAllocator and the highest value it has reached since the
+/// last call to #reset_peak_memory.
+auto memory_usage() noexcept -> MemoryUsage;
+
+/// Sets peak memory usage to the current one.
+auto reset_peak_memory() noexcept -> void;
+
+namespace detail {
+auto record_allocation(size_t bytes) noexcept -> void;
+auto record_deallocation(size_t bytes) noexcept -> void;
+
+/// Same as `std::allocator<T>`, but keeps track of allocated memory (see
+/// #memory_usage).
+template <class T> struct TrackingAllocator {
+    using value_type = T;
+
+    constexpr TrackingAllocator() noexcept = default;
+    template <class U>
+    constexpr TrackingAllocator(TrackingAllocator<U> const& /*unused*/) noexcept
+    {}
+
+    auto allocate(size_t const n) -> T*
+    {
+        auto* p = std::allocator<T>{}.allocate(n);
+        record_allocation(n * sizeof(T));
+        return p;
+    }
+
+    auto deallocate(T* const p, size_t const n) noexcept -> void
+    {
+        record_deallocation(n * sizeof(T));
+        std::allocator<T>{}.deallocate(p, n);
+    }
+
+    template <class U>
+    constexpr auto operator==(TrackingAllocator<U> const& /*unused*/) const
+        noexcept -> bool
+    {
+        return true;
+    }
+
+    template <class U>
+    constexpr auto operator!=(TrackingAllocator<U> const& /*unused*/) const
+        noexcept -> bool
+    {
+        return false;
+    }
+};
+} // namespace detail
+
+// [ScratchBuffer] {{{
+/// \brief Grow-only buffer for temporaries which are reused across calls.
+///
+/// Unlike `std::vector`, #get never initialises memory and never shrinks the
+/// buffer, so in a steady state (i.e. when sizes stop growing) there are no
+/// allocations at all. Copying a ScratchBuffer produces an empty buffer:
+/// the contents are scratch anyway.
+///
+/// \tparam T Element type. Must be trivially destructible.
+template <class T> class ScratchBuffer {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "T must be trivially destructible");
+
+    struct Deleter {
+        auto operator()(T* p) const noexcept -> void
+        {
+            boost::alignment::aligned_free(p);
+        }
+    };
+
+    std::unique_ptr<T, Deleter> _data;
+    size_t                      _capacity;
+
+  public:
+    /// All buffers are aligned to cache line boundary which also makes them
+    /// suitable for aligned AVX loads.
+    static constexpr size_t alignment = 64;
+
+    constexpr ScratchBuffer() noexcept : _data{nullptr}, _capacity{0} {}
+
+    ScratchBuffer(ScratchBuffer const& /*unused*/) noexcept : ScratchBuffer{}
+    {}
+
+    ScratchBuffer(ScratchBuffer&& other) noexcept
+        : _data{std::move(other._data)}
+        , _capacity{std::exchange(other._capacity, 0)}
+    {}
+
+    auto operator=(ScratchBuffer const& /*unused*/) noexcept
+        -> ScratchBuffer& { return *this; }
+
+    auto operator=(ScratchBuffer&& other) noexcept -> ScratchBuffer&
+    {
+        if (this != &other) {
+            detail::record_deallocation(_capacity * sizeof(T));
+            _data     = std::move(other._data);
+            _capacity = std::exchange(other._capacity, 0);
+        }
+        return *this;
+    }
+
+    ~ScratchBuffer() noexcept
+    {
+        detail::record_deallocation(_capacity * sizeof(T));
+    }
+
+    constexpr auto capacity() const noexcept -> size_t { return _capacity; }
+
+    /// Returns a span of `n` elements.
+    ///
+    /// The first `preserve` elements keep their values from the previous
+    /// call; all others are uninitialised.
+    auto get(size_t const n, size_t const preserve = 0) -> gsl::span<T>
+    {
+        TCM_ASSERT(preserve <= n, "cannot preserve more than n elements");
+        if (n > _capacity) { grow(n, std::min(preserve, _capacity)); }
+        return {_data.get(), n};
+    }
+
+  private:
+    auto grow(size_t const n, size_t const preserve) -> void
+    {
+        // Geometric growth amortises the cost of copying in `get(n, preserve)`
+        // when n increases one expansion at a time.
+        auto const capacity = std::max(n, _capacity + _capacity / 2);
+        auto*      p        = static_cast<T*>(
+            boost::alignment::aligned_alloc(alignment, capacity * sizeof(T)));
+        if (TCM_UNLIKELY(p == nullptr)) { throw std::bad_alloc{}; }
+        std::uninitialized_copy_n(_data.get(), preserve, p);
+        detail::record_allocation(capacity * sizeof(T));
+        detail::record_deallocation(_capacity * sizeof(T));
+        _data.reset(p);
+        _capacity = capacity;
+    }
+};
+// [ScratchBuffer] }}}
+
+TCM_NAMESPACE_END
@@ -0,0 +1,275 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "sector.hpp"
+#include "parallel.hpp"
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+TCM_NAMESPACE_BEGIN
+
+SectorBasis::SectorBasis(std::shared_ptr<SymmetryGroup const> group,
+                         optional<int> const                  magnetisation)
+    : _group{std::move(group)}, _states{}, _norms{}, _trivial{}, _real{}
+{
+    TCM_CHECK(_group != nullptr, std::invalid_argument,
+              "group must not be None");
+    TCM_CHECK(!magnetisation.has_value() || *magnetisation == 0
+                  || !_group->has_spin_inversion(),
+              std::invalid_argument,
+              fmt::format("invalid magnetisation: {}; spin inversion only "
+                          "preserves the zero magnetisation sector",
+                          *magnetisation));
+    _trivial = _group->size() == 1;
+    _real    = true;
+    for (auto i = size_t{0}; i < _group->size(); ++i) {
+        if (_group->character(i).imag() != real_type{0}) { _real = false; }
+    }
+    _states = _group->representatives(magnetisation);
+    _norms.resize(_states.size());
+    parallel_for(
+        0, static_cast<int64_t>(_states.size()),
+        [this](auto const i) {
+            _norms[static_cast<size_t>(i)] =
+                _group->canonicalise(_states[static_cast<size_t>(i)]).norm;
+        },
+        /*cutoff=*/1024);
+}
+
+namespace {
+/// Calls `store(i, (Hx)ᵢ)` for every row `i`.
+template <class T, class Store>
+auto matvec_impl(SpinHamiltonian const& hamiltonian, SectorBasis const& basis,
+                 gsl::span<T const> x, Store store) -> void
+{
+    TCM_CHECK(x.size() == basis.size(), std::invalid_argument,
+              fmt::format("vector has wrong size: {}; expected {}", x.size(),
+                          basis.size()));
+    TCM_CHECK(hamiltonian.size() == 0
+                  || hamiltonian.max_index() < basis.number_spins(),
+              std::invalid_argument,
+              fmt::format("Hamiltonian acts on site {}, but the basis has "
+                          "only {} spins",
+                          hamiltonian.max_index(), basis.number_spins()));
+    parallel_for(
+        0, static_cast<int64_t>(basis.size()),
+        [&hamiltonian, &basis, x, store](auto const i) {
+            auto sum = T{0};
+            basis.for_each_in_column(
+                hamiltonian, static_cast<size_t>(i),
+                [x, &sum](size_t const j, complex_type const c) {
+                    if constexpr (std::is_same<T, complex_type>::value) {
+                        sum += std::conj(c) * x[j];
+                    }
+                    else {
+                        TCM_ASSERT(c.imag() == real_type{0},
+                                   "matrix element is not real");
+                        sum += c.real() * x[j];
+                    }
+                });
+            store(static_cast<size_t>(i), sum);
+        },
+        /*cutoff=*/256);
+}
+
+template <class T>
+auto matvec_impl(SpinHamiltonian const& hamiltonian, SectorBasis const& basis,
+                 gsl::span<T const> x, gsl::span<T> y) -> void
+{
+    TCM_CHECK(y.size() == basis.size(), std::invalid_argument,
+              fmt::format("vector has wrong size: {}; expected {}", y.size(),
+                          basis.size()));
+    matvec_impl(hamiltonian, basis, x,
+                [y](size_t const i, T const sum) noexcept { y[i] = sum; });
+}
+} // namespace
+
+auto matvec(SpinHamiltonian const& hamiltonian, SectorBasis const& basis,
+            gsl::span<real_type const> x, gsl::span<real_type> y) -> void
+{
+    TCM_CHECK(basis.is_real(), std::invalid_argument,
+              "Hamiltonian is complex in this sector; use complex vectors");
+    matvec_impl(hamiltonian, basis, x, y);
+}
+
+auto matvec(SpinHamiltonian const& hamiltonian, SectorBasis const& basis,
+            gsl::span<complex_type const> x, gsl::span<complex_type> y)
+    -> void
+{
+    matvec_impl(hamiltonian, basis, x, y);
+}
+
+namespace {
+/// Performs `y += a * x`.
+auto axpy(complex_type const a, gsl::span<complex_type const> x,
+          gsl::span<complex_type> y) noexcept -> void
+{
+    TCM_ASSERT(x.size() == y.size(), "sizes don't match");
+    auto const  n   = static_cast<int64_t>(x.size());
+    auto const* src = x.data();
+    auto*       dst = y.data();
+#pragma omp parallel for default(none) firstprivate(n, a, src, dst)           \
+    schedule(static)
+    for (auto i = int64_t{0}; i < n; ++i) {
+        dst[i] += a * src[i];
+    }
+}
+} // namespace
+
+auto apply(Polynomial const& polynomial, SectorBasis const& basis,
+           gsl::span<complex_type> x, gsl::span<complex_type> workspace)
+    -> void
+{
+    TCM_CHECK(!polynomial.normalising(), std::invalid_argument,
+              "normalising polynomials can't be applied to dense vectors");
+    TCM_CHECK(workspace.size() == x.size(), std::invalid_argument,
+              fmt::format("workspace has wrong size: {}; expected {}",
+                          workspace.size(), x.size()));
+    auto current = x;
+    auto next    = workspace;
+    for (auto const root : polynomial.roots()) {
+        // `|next⟩ := (H - root)|current⟩`
+        matvec(polynomial.hamiltonian(), basis,
+               gsl::span<complex_type const>{current}, next);
+        axpy(-root, current, next);
+        std::swap(current, next);
+    }
+    if (current.data() != x.data()) {
+        std::copy(std::begin(current), std::end(current), std::begin(x));
+    }
+}
+
+auto apply(ChebyshevFilter const& filter, SectorBasis const& basis,
+           gsl::span<complex_type> x, gsl::span<complex_type> workspace)
+    -> void
+{
+    TCM_CHECK(workspace.size() == 2 * x.size(), std::invalid_argument,
+              fmt::format("workspace has wrong size: {}; expected {}",
+                          workspace.size(), 2 * x.size()));
+    auto const& hamiltonian = filter.hamiltonian();
+    auto const  cs          = filter.coefficients();
+    auto const  scale       = real_type{1} / filter.radius();
+    auto const  shift       = -filter.center() * scale;
+    if (filter.degree() == 0) {
+        for (auto& value : x) {
+            value *= cs[0];
+        }
+        return;
+    }
+
+    auto const n        = x.size();
+    auto       current  = workspace.subspan(0, n);
+    auto       previous = workspace.subspan(n, n);
+    // `|current⟩ := T₁|x⟩ = H̃|x⟩`
+    matvec_impl(hamiltonian, basis, gsl::span<complex_type const>{x},
+                [x, current, scale, shift](size_t const i,
+                                           complex_type const sum) noexcept {
+                    current[i] = scale * sum + shift * x[i];
+                });
+    if (filter.degree() == 1) {
+        for (auto i = size_t{0}; i < n; ++i) {
+            x[i] = cs[0] * x[i] + cs[1] * current[i];
+        }
+        return;
+    }
+    // `|previous⟩ := T₂|x⟩ = 2H̃|current⟩ - |x⟩`. After this step |x⟩ is no
+    // longer needed, so we turn it into the result.
+    matvec_impl(
+        hamiltonian, basis, gsl::span<complex_type const>{current},
+        [x, current, previous, scale, shift, c0 = cs[0], c1 = cs[1],
+         c2 = cs[2]](size_t const i, complex_type const sum) noexcept {
+            previous[i] =
+                real_type{2} * (scale * sum + shift * current[i]) - x[i];
+            x[i] = c0 * x[i] + c1 * current[i] + c2 * previous[i];
+        });
+    std::swap(current, previous);
+    // `|previous⟩ := Tₖ|x⟩ = 2H̃|current⟩ - |previous⟩`. Each row only reads
+    // and writes its own element of `previous`, so it can be overwritten in
+    // place.
+    for (auto k = size_t{3}; k < cs.size(); ++k) {
+        matvec_impl(hamiltonian, basis, gsl::span<complex_type const>{current},
+                    [x, current, previous, scale, shift, c = cs[k]](
+                        size_t const i, complex_type const sum) noexcept {
+                        previous[i] = real_type{2}
+                                          * (scale * sum + shift * current[i])
+                                      - previous[i];
+                        x[i] += c * previous[i];
+                    });
+        std::swap(current, previous);
+    }
+}
+
+auto bind_sector(PyObject* module) -> void
+{
+    namespace py = pybind11;
+    auto m       = py::module{py::reinterpret_borrow<py::object>(module)};
+
+    py::class_<SectorBasis, std::shared_ptr<SectorBasis>>(m, "SectorBasis",
+                                                          R"EOF(
+            Ranked basis of a symmetry sector. Basis states are sorted, so the
+            rank of a state is its position in :py:attr:`states`.
+        )EOF")
+        .def(py::init([](std::shared_ptr<SymmetryGroup const> group,
+                         optional<int> magnetisation) {
+                 return std::make_shared<SectorBasis>(
+                     std::move(group), std::move(magnetisation));
+             }),
+             py::arg{"group"}, py::arg{"magnetisation"} = py::none(),
+             R"EOF(
+                 Constructs the basis of a sector.
+
+                 :param group: symmetry group (see :py:class:`SymmetryGroup`).
+                 :param magnetisation: magnetisation sector. If ``None``, all
+                                       magnetisations are included. Must be
+                                       ``None`` or ``0`` if ``group``
+                                       contains spin inversion.
+             )EOF")
+        .def("__len__", [](SectorBasis const& self) { return self.size(); })
+        .def_property_readonly(
+            "number_spins",
+            [](SectorBasis const& self) { return self.number_spins(); })
+        .def_property_readonly(
+            "states",
+            [](SectorBasis const& self) {
+                return to_numpy_array(aligned_vector<SpinVector>{
+                    std::begin(self.states()), std::end(self.states())});
+            },
+            R"EOF(
+                 Returns basis states as a ``numpy.ndarray``.
+
+                 .. warning:: This function copies the states
+            )EOF")
+        .def(
+            "index",
+            [](SectorBasis const& self, SpinVector const& spin) {
+                return self.index(spin);
+            },
+            py::arg{"spin"},
+            R"EOF(Returns the rank of ``spin`` or ``-1``.)EOF");
+}
+
+TCM_NAMESPACE_END
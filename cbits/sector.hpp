@@ -0,0 +1,177 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+
+#include "common.hpp"
+#include "config.hpp"
+#include "errors.hpp"
+#include "polynomial.hpp"
+#include "spin.hpp"
+#include "symmetry.hpp"
+
+#include <gsl/gsl-lite.hpp>
+
+#include <memory>
+
+TCM_NAMESPACE_BEGIN
+
+// [SectorBasis] {{{
+/// \brief Ranked basis of a symmetry sector.
+///
+/// Basis states are representatives (see #SymmetryGroup) sorted
+/// lexicographically, so the rank of a state is simply its position in
+/// `states()`. A group with no generators gives the plain magnetisation
+/// sector.
+///
+/// Coefficients `cᵣ` in this basis are related to amplitudes of spin
+/// configurations by `ψ(σ) = cᵣ λ* √n` where `(r, λ, n)` is the canonical
+/// form of `σ` (see #SymmetryGroup::canonicalise).
+class SectorBasis {
+  private:
+    std::shared_ptr<SymmetryGroup const> _group;
+    aligned_vector<SpinVector>           _states;
+    aligned_vector<real_type>            _norms; ///< `‖P|r⟩‖²` for every state
+    bool _trivial; ///< Whether the group consists of the identity only.
+    bool _real;    ///< Whether all characters are real.
+
+  public:
+    SectorBasis(std::shared_ptr<SymmetryGroup const> group,
+                optional<int>                        magnetisation);
+
+    SectorBasis(SectorBasis const&) = delete;
+    SectorBasis(SectorBasis&&)      = default;
+    SectorBasis& operator=(SectorBasis const&) = delete;
+    SectorBasis& operator=(SectorBasis&&) = default;
+
+    auto size() const noexcept -> size_t { return _states.size(); }
+    auto number_spins() const noexcept -> unsigned
+    {
+        return _group->number_spins();
+    }
+    auto group() const noexcept -> SymmetryGroup const& { return *_group; }
+    auto states() const noexcept -> gsl::span<SpinVector const>
+    {
+        return _states;
+    }
+    auto norms() const noexcept -> gsl::span<real_type const>
+    {
+        return _norms;
+    }
+
+    /// Returns whether the Hamiltonian in this basis is real, i.e. all
+    /// characters are real.
+    auto is_real() const noexcept -> bool { return _real; }
+
+    /// Returns the rank of `spin` or `-1` if it is not a basis state.
+    auto index(SpinVector const& spin) const TCM_NOEXCEPT -> int64_t
+    {
+        auto const first = std::begin(_states);
+        auto const last  = std::end(_states);
+        auto const i = std::lower_bound(first, last, spin, LexicographicLess{});
+        return (i != last && *i == spin) ? (i - first) : int64_t{-1};
+    }
+
+    /// Calls `f(j, Hⱼᵢ)` for every non-zero element in the `i`'th column of
+    /// the Hamiltonian.
+    ///
+    /// Throws `std::runtime_error` if `H` maps a basis state outside of the
+    /// sector.
+    template <class Function>
+    TCM_FORCEINLINE auto for_each_in_column(SpinHamiltonian const& hamiltonian,
+                                            size_t const      i,
+                                            Function&&        f) const -> void
+    {
+        TCM_ASSERT(i < size(), "index out of bounds");
+        if (_trivial) {
+            hamiltonian.for_each(
+                _states[i], [this, &f](complex_type const c,
+                                       SpinVector const   s) {
+                    auto const j = index(s);
+                    TCM_CHECK(j >= 0, std::runtime_error,
+                              "Hamiltonian does not conserve magnetisation");
+                    f(static_cast<size_t>(j), c);
+                });
+        }
+        else {
+            auto const norm = _norms[i];
+            hamiltonian.for_each(
+                _states[i], [this, &f, norm](complex_type const c,
+                                             SpinVector const   s) {
+                    auto const canonical = _group->canonicalise(s);
+                    if (canonical.norm > real_type{0}) {
+                        auto const j = index(canonical.representative);
+                        TCM_CHECK(j >= 0, std::runtime_error,
+                                  "Hamiltonian does not commute with the "
+                                  "symmetry group");
+                        f(static_cast<size_t>(j),
+                          c * canonical.phase
+                              * std::sqrt(canonical.norm / norm));
+                    }
+                });
+        }
+    }
+};
+// [SectorBasis] }}}
+
+/// Computes `y := Hx` where `x` and `y` are expressed in `basis`.
+///
+/// Rows are processed in parallel. Since `H` is Hermitian, row `i` is
+/// obtained by conjugating column `i`, i.e. no synchronisation is needed.
+///
+/// \precondition `basis.is_real()` for the real version.
+auto matvec(SpinHamiltonian const& hamiltonian, SectorBasis const& basis,
+            gsl::span<real_type const> x, gsl::span<real_type> y) -> void;
+auto matvec(SpinHamiltonian const& hamiltonian, SectorBasis const& basis,
+            gsl::span<complex_type const> x, gsl::span<complex_type> y)
+    -> void;
+
+/// Computes `x := P(H)x` where `P(H) = (H - rₙ₋₁)...(H - r₁)(H - r₀)` and
+/// `x` is expressed in `basis`.
+///
+/// This is the dense counterpart of `Polynomial::operator()`: each factor
+/// costs one #matvec and one axpy, and apart from `workspace` (which must
+/// have the same size as `x`) no memory is allocated.
+///
+/// \precondition `!polynomial.normalising()`: normalisation depends on the
+///               input spin configuration and has no dense analogue.
+auto apply(Polynomial const& polynomial, SectorBasis const& basis,
+           gsl::span<complex_type> x, gsl::span<complex_type> workspace)
+    -> void;
+
+/// Computes `x := p(H)x` where `p` is a Chebyshev expansion (see
+/// #ChebyshevFilter) and `x` is expressed in `basis`.
+///
+/// Every term costs one #matvec with the recurrence and accumulation fused
+/// into it. `workspace` must be twice as long as `x`.
+auto apply(ChebyshevFilter const& filter, SectorBasis const& basis,
+           gsl::span<complex_type> x, gsl::span<complex_type> workspace)
+    -> void;
+
+auto bind_sector(PyObject*) -> void;
+
+TCM_NAMESPACE_END
@@ -0,0 +1,339 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "sort.hpp"
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+#include <omp.h>
+
+#include <array>
+#include <numeric>
+
+TCM_NAMESPACE_BEGIN
+
+namespace {
+/// Arrays shorter than this are sorted by a single thread.
+constexpr auto radix_sort_parallel_cutoff = size_t{1} << 16;
+
+template <bool WithIndices>
+auto radix_sort_impl(SpinVector* const keys, int64_t* const indices,
+                     size_t const n) -> void
+{
+    TCM_ASSERT(n > 0, "nothing to sort");
+    auto const number_bytes   = (keys[0].size() + 7u) / 8u;
+    auto const number_threads = n < radix_sort_parallel_cutoff
+                                    ? 1
+                                    : omp_get_max_threads();
+
+    aligned_vector<SpinVector>         keys_buffer(n);
+    aligned_vector<int64_t>            indices_buffer(WithIndices ? n : 0);
+    std::vector<std::array<size_t, 256>> histograms(
+        static_cast<size_t>(number_threads));
+    auto* src_keys    = keys;
+    auto* dst_keys    = keys_buffer.data();
+    auto* src_indices = indices;
+    auto* dst_indices = indices_buffer.data();
+    auto  skip        = false;
+
+    // This is a textbook LSD radix sort with one byte (i.e. 8 spins) per
+    // pass. Every thread builds a histogram of its own chunk, after which
+    // the histograms are turned into per-thread output offsets. Since the
+    // chunks are processed in order, the sort is stable. Passes where all keys
+    // have the same digit (e.g. spins which never change) are skipped.
+#pragma omp parallel num_threads(number_threads) default(none)                 \
+    firstprivate(n, number_bytes) shared(histograms, src_keys, dst_keys,       \
+                                         src_indices, dst_indices, skip)
+    {
+        auto const num_threads = static_cast<size_t>(omp_get_num_threads());
+        auto const thread_id   = static_cast<size_t>(omp_get_thread_num());
+        auto const rest        = n % num_threads;
+        auto const chunk_size  = n / num_threads + (thread_id < rest);
+        auto const begin =
+            thread_id * chunk_size + (thread_id >= rest) * rest;
+        auto const end       = std::min(begin + chunk_size, n);
+        auto&      histogram = histograms[thread_id];
+
+        for (auto b = number_bytes; b-- > 0;) {
+            histogram.fill(0);
+            for (auto i = begin; i < end; ++i) {
+                ++histogram[src_keys[i].byte(b)];
+            }
+#pragma omp barrier
+#pragma omp single
+            {
+                auto offset = size_t{0};
+                skip        = false;
+                for (auto k = 0u; k < 256u && !skip; ++k) {
+                    auto const before = offset;
+                    for (auto& h : histograms) {
+                        auto const count = h[k];
+                        h[k]             = offset;
+                        offset += count;
+                    }
+                    skip = (offset - before == n);
+                }
+            }
+            if (!skip) {
+                for (auto i = begin; i < end; ++i) {
+                    auto const j = histogram[src_keys[i].byte(b)]++;
+                    dst_keys[j]  = src_keys[i];
+                    if constexpr (WithIndices) { dst_indices[j] = src_indices[i]; }
+                }
+#pragma omp barrier
+#pragma omp single
+                {
+                    std::swap(src_keys, dst_keys);
+                    std::swap(src_indices, dst_indices);
+                }
+            }
+        }
+    }
+
+    if (src_keys != keys) {
+        std::copy(src_keys, src_keys + n, keys);
+        if constexpr (WithIndices) {
+            std::copy(src_indices, src_indices + n, indices);
+        }
+    }
+}
+} // namespace
+
+auto radix_sort(gsl::span<SpinVector> spins, gsl::span<int64_t> indices)
+    -> void
+{
+    if (spins.empty()) { return; }
+    auto const number_spins = spins[0].size();
+    TCM_CHECK(std::all_of(std::begin(spins), std::end(spins),
+                          [number_spins](auto const& x) {
+                              return x.size() == number_spins;
+                          }),
+              std::invalid_argument,
+              "all spin configurations must have the same size");
+    if (indices.empty()) {
+        radix_sort_impl<false>(spins.data(), nullptr, spins.size());
+    }
+    else {
+        TCM_CHECK(indices.size() == spins.size(), std::invalid_argument,
+                  fmt::format("indices has wrong size: {}; expected {}",
+                              indices.size(), spins.size()));
+        radix_sort_impl<true>(spins.data(), indices.data(), spins.size());
+    }
+}
+
+auto unique(gsl::span<SpinVector const> spins, bool const return_counts,
+            bool const return_inverse)
+    -> std::tuple<aligned_vector<SpinVector>, aligned_vector<int64_t>,
+                  aligned_vector<int64_t>>
+{
+    aligned_vector<SpinVector> values{std::begin(spins), std::end(spins)};
+    aligned_vector<int64_t>    order;
+    if (return_inverse) {
+        order.resize(values.size());
+        std::iota(std::begin(order), std::end(order), int64_t{0});
+    }
+    radix_sort(values, order);
+
+    aligned_vector<int64_t> counts;
+    aligned_vector<int64_t> inverse(return_inverse ? values.size() : 0);
+    // Compacts `values` in-place: `size` is the number of unique elements
+    // found so far.
+    auto size = size_t{0};
+    for (auto i = size_t{0}; i < values.size(); ++i) {
+        if (size == 0 || values[i] != values[size - 1]) {
+            values[size++] = values[i];
+            if (return_counts) { counts.push_back(0); }
+        }
+        if (return_counts) { ++counts.back(); }
+        if (return_inverse) {
+            inverse[static_cast<size_t>(order[i])] =
+                static_cast<int64_t>(size - 1);
+        }
+    }
+    values.resize(size);
+    return {std::move(values), std::move(counts), std::move(inverse)};
+}
+
+auto merge(gsl::span<gsl::span<SpinVector const> const> arrays,
+           gsl::span<gsl::span<int64_t const> const>    counts)
+    -> std::tuple<aligned_vector<SpinVector>, aligned_vector<int64_t>>
+{
+    auto const with_counts = !counts.empty();
+    TCM_CHECK(!with_counts || counts.size() == arrays.size(),
+              std::invalid_argument,
+              fmt::format("counts has wrong length: {}; expected {}",
+                          counts.size(), arrays.size()));
+
+    struct Cursor {
+        SpinVector const* current;
+        SpinVector const* last;
+        int64_t const*    count;
+    };
+    std::vector<Cursor> heap;
+    heap.reserve(arrays.size());
+    auto total = size_t{0};
+    for (auto i = size_t{0}; i < arrays.size(); ++i) {
+        TCM_CHECK(!with_counts || counts[i].size() == arrays[i].size(),
+                  std::invalid_argument,
+                  fmt::format("counts[{}] has wrong length: {}; expected {}",
+                              i, counts[i].size(), arrays[i].size()));
+        if (arrays[i].empty()) { continue; }
+        heap.push_back({arrays[i].data(), arrays[i].data() + arrays[i].size(),
+                        with_counts ? counts[i].data() : nullptr});
+        total += arrays[i].size();
+    }
+    TCM_CHECK(std::all_of(std::begin(heap), std::end(heap),
+                          [n = heap.empty() ? 0u : heap[0].current->size()](
+                              auto const& c) { return c.current->size() == n; }),
+              std::invalid_argument,
+              "all spin configurations must have the same size");
+
+    // `std::*_heap` build a max-heap, so we reverse the comparison
+    auto const greater = [less = LexicographicLess{}](Cursor const& a,
+                                                      Cursor const& b) {
+        return less(*b.current, *a.current);
+    };
+    std::make_heap(std::begin(heap), std::end(heap), greater);
+
+    aligned_vector<SpinVector> out;
+    aligned_vector<int64_t>    out_counts;
+    out.reserve(total);
+    if (with_counts) { out_counts.reserve(total); }
+    while (!heap.empty()) {
+        std::pop_heap(std::begin(heap), std::end(heap), greater);
+        auto& cursor = heap.back();
+        if (!with_counts) { out.push_back(*cursor.current); }
+        else if (!out.empty() && out.back() == *cursor.current) {
+            out_counts.back() += *cursor.count;
+        }
+        else {
+            out.push_back(*cursor.current);
+            out_counts.push_back(*cursor.count);
+        }
+        ++cursor.current;
+        if (with_counts) { ++cursor.count; }
+        if (cursor.current == cursor.last) { heap.pop_back(); }
+        else {
+            std::push_heap(std::begin(heap), std::end(heap), greater);
+        }
+    }
+    return {std::move(out), std::move(out_counts)};
+}
+
+auto bind_sort(PyObject* module) -> void
+{
+    namespace py = pybind11;
+    auto m       = py::module{py::reinterpret_borrow<py::object>(module)};
+
+    using SpinArray  = py::array_t<SpinVector, py::array::c_style>;
+    using CountArray = py::array_t<int64_t, py::array::c_style>;
+    auto const to_span = [](SpinArray const& array) {
+        TCM_CHECK(array.ndim() == 1, std::domain_error,
+                  fmt::format("array has wrong number of dimensions: {}; "
+                              "expected 1",
+                              array.ndim()));
+        return gsl::span<SpinVector const>{
+            array.data(), static_cast<size_t>(array.shape(0))};
+    };
+
+    m.def(
+        "sort",
+        [to_span](SpinArray const& array) {
+            auto const              src = to_span(array);
+            aligned_vector<SpinVector> spins{std::begin(src), std::end(src)};
+            radix_sort(spins);
+            return to_numpy_array(std::move(spins));
+        },
+        py::arg{"array"}.noconvert(),
+        R"EOF(
+            Returns a copy of ``array`` of :py:class:`CompactSpin` sorted in
+            lexicographic order (the first spin is the most significant).
+        )EOF");
+
+    m.def(
+        "unique",
+        [to_span](SpinArray const& array, bool const return_counts,
+                  bool const return_inverse) -> py::object {
+            auto [values, counts, inverse] =
+                unique(to_span(array), return_counts, return_inverse);
+            auto out = to_numpy_array(std::move(values));
+            if (!return_counts && !return_inverse) { return std::move(out); }
+            auto result = py::list{};
+            result.append(std::move(out));
+            if (return_counts) {
+                result.append(to_numpy_array(std::move(counts)));
+            }
+            if (return_inverse) {
+                result.append(to_numpy_array(std::move(inverse)));
+            }
+            return py::tuple{std::move(result)};
+        },
+        py::arg{"array"}.noconvert(), py::arg{"return_counts"} = false,
+        py::arg{"return_inverse"} = false,
+        R"EOF(
+            Same as ``numpy.unique``, but for arrays of :py:class:`CompactSpin`.
+            Unique elements are returned in lexicographic order.
+        )EOF");
+
+    m.def(
+        "merge",
+        [to_span](std::vector<SpinArray> const&         arrays,
+                  optional<std::vector<CountArray>> const& counts)
+            -> py::object {
+            std::vector<gsl::span<SpinVector const>> spin_spans;
+            spin_spans.reserve(arrays.size());
+            for (auto const& array : arrays) {
+                spin_spans.push_back(to_span(array));
+            }
+            std::vector<gsl::span<int64_t const>> count_spans;
+            if (counts.has_value()) {
+                count_spans.reserve(counts->size());
+                for (auto const& c : *counts) {
+                    count_spans.emplace_back(c.data(),
+                                             static_cast<size_t>(c.size()));
+                }
+            }
+            auto [spins, merged_counts] = merge(spin_spans, count_spans);
+            if (!counts.has_value()) {
+                return to_numpy_array(std::move(spins));
+            }
+            return py::make_tuple(to_numpy_array(std::move(spins)),
+                                  to_numpy_array(std::move(merged_counts)));
+        },
+        py::arg{"arrays"}, py::arg{"counts"} = py::none(),
+        R"EOF(
+            Merges sorted (see :py:func:`sort`) arrays of :py:class:`CompactSpin`.
+
+            :param arrays: a list of sorted arrays.
+            :param counts: an optional list of arrays of counts (e.g. as
+                           returned by :py:func:`unique`). If given, equal
+                           spin configurations are combined and the tuple
+                           ``(spins, counts)`` is returned.
+        )EOF");
+}
+
+TCM_NAMESPACE_END
@@ -0,0 +1,97 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+
+#include "common.hpp"
+#include "config.hpp"
+#include "errors.hpp"
+#include "spin.hpp"
+
+#include <gsl/gsl-lite.hpp>
+
+#include <tuple>
+#include <vector>
+
+TCM_NAMESPACE_BEGIN
+
+/// Compares spin configurations lexicographically, i.e. the first spin is
+/// the most significant one. This is the order used by #radix_sort, #unique
+/// and #merge.
+///
+/// \note `SpinVector::operator<` only looks at the first 64 spins and is thus
+///       not suitable for sorting.
+struct LexicographicLess {
+    auto operator()(SpinVector const& x, SpinVector const& y) const
+        TCM_NOEXCEPT -> bool
+    {
+        TCM_ASSERT(x.size() == y.size(),
+                   "Only equally-sized SpinVectors can be compared");
+        auto const number_bytes = (x.size() + 7u) / 8u;
+        for (auto i = 0u; i < number_bytes; ++i) {
+            auto const a = x.byte(i);
+            auto const b = y.byte(i);
+            if (a != b) { return a < b; }
+        }
+        return false;
+    }
+};
+
+/// Sorts `spins` lexicographically using (parallel) LSD radix sort.
+///
+/// If `indices` is not empty, it must have the same length as `spins`, and
+/// it is permuted along with `spins`. The sort is stable.
+///
+/// \precondition All spin configurations have the same size.
+auto radix_sort(gsl::span<SpinVector> spins, gsl::span<int64_t> indices = {})
+    -> void;
+
+/// Returns unique elements of `spins` in lexicographic order.
+///
+/// If `return_counts` is `true`, the second element of the tuple contains the
+/// number of times each unique element occurs in `spins`. If
+/// `return_inverse` is `true`, the third element contains for every element
+/// of `spins` its index in the array of unique elements. Otherwise, these
+/// vectors are empty.
+auto unique(gsl::span<SpinVector const> spins, bool return_counts,
+            bool return_inverse)
+    -> std::tuple<aligned_vector<SpinVector>, aligned_vector<int64_t>,
+                  aligned_vector<int64_t>>;
+
+/// Merges sorted (see #LexicographicLess) arrays.
+///
+/// If `counts` is not empty, it must contain one array of counts (or weights)
+/// per array of spins. Equal spin configurations are then combined and their
+/// counts summed. Otherwise, duplicates are kept and the second element of
+/// the tuple is empty.
+auto merge(gsl::span<gsl::span<SpinVector const> const> arrays,
+           gsl::span<gsl::span<int64_t const> const>    counts = {})
+    -> std::tuple<aligned_vector<SpinVector>, aligned_vector<int64_t>>;
+
+auto bind_sort(PyObject*) -> void;
+
+TCM_NAMESPACE_END
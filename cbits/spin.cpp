@@ -507,6 +507,27 @@ inline auto trim(std::vector<std::string>& keep_alive, std::string_view raw)
     return keep_alive.back().c_str();
 }
 
+namespace detail {
+auto parse_spin_encoding(std::string const& name) -> SpinEncoding
+{
+    if (name == "sign") { return SpinEncoding::sign; }
+    if (name == "binary") { return SpinEncoding::binary; }
+    if (name == "one_hot") { return SpinEncoding::one_hot; }
+    TCM_ERROR(std::invalid_argument,
+              fmt::format("invalid encoding: '{}'; expected one of 'sign', "
+                          "'binary' or 'one_hot'",
+                          name));
+}
+} // namespace detail
+
+namespace {
+auto parse_dtype(pybind11::object dtype) -> torch::ScalarType
+{
+    if (dtype.is_none()) { return torch::kFloat32; }
+    return torch::python::detail::py_object_to_dtype(std::move(dtype));
+}
+} // namespace
+
 auto bind_spin(PyObject* module) -> void
 {
     namespace py = pybind11;
@@ -668,6 +689,24 @@ auto bind_spin(PyObject* module) -> void
         },
         py::arg{"n"}, py::arg{"magnetisation"});
 
+    m.def(
+        "random_spins",
+        [](unsigned n, int magnetisation, size_t count) {
+            auto vector = random_spins(n, magnetisation, count,
+                                       global_random_generator());
+            auto const data = vector.data();
+            auto const size = vector.size();
+            auto       base = py::capsule{
+                new decltype(vector){std::move(vector)},
+                [](void* p) { delete static_cast<decltype(vector)*>(p); }};
+            return py::array{SpinVector::numpy_dtype(), size, data, base};
+        },
+        py::arg{"n"}, py::arg{"magnetisation"}, py::arg{"count"},
+        R"EOF(
+            Returns an array of ``count`` uniformly random
+            :py:class:`CompactSpin` of length ``n`` and given magnetisation.
+            Useful for initialising Markov chains and random restarts.)EOF");
+
     m.def(
         "unsafe_get",
         [](py::array_t<SpinVector, py::array::c_style> xs, size_t const i) {
@@ -683,21 +722,39 @@ auto bind_spin(PyObject* module) -> void
 
     m.def(
         "unpack",
-        [](py::array_t<SpinVector, py::array::c_style> array) {
+        [](py::array_t<SpinVector, py::array::c_style> array,
+           std::string const& encoding, py::object dtype) {
             TCM_CHECK(
                 array.ndim() == 1, std::invalid_argument,
                 fmt::format("`array` has incorrect dimension: {}; expected 1",
                             array.ndim()));
             auto data = array.data();
             auto size = array.shape(0);
-            return unpack_to_tensor(data, data + size);
+            return unpack_to_tensor(data, data + size,
+                                    detail::parse_spin_encoding(encoding),
+                                    parse_dtype(std::move(dtype)));
         },
-        py::arg{"array"}.noconvert());
+        py::arg{"array"}.noconvert(), py::arg{"encoding"} = "sign",
+        py::arg{"dtype"} = py::none(), trim(keep_alive, R"EOF(
+            Unpacks an array of :py:class:`CompactSpin` into a tensor.
+
+            :param array: a one-dimensional array of :py:class:`CompactSpin`.
+            :param encoding: how to represent spins. Supported values are
+                             ``"sign"`` (spin down is ``-1`` and spin up is
+                             ``1``), ``"binary"`` (``0`` and ``1``) and
+                             ``"one_hot"``. For ``"one_hot"`` the output has
+                             shape ``(len(array), 2, number_spins)`` where the
+                             first channel is ``1`` for spins down and the
+                             second -- for spins up.
+            :param dtype: element type of the output tensor. One of
+                          ``torch.float32`` (default), ``torch.float16``,
+                          ``torch.bfloat16`` or ``torch.int8``.)EOF"));
 
     m.def(
         "unpack",
         [](py::array_t<SpinVector, py::array::c_style> array,
-           py::array_t<int64_t, py::array::c_style>    indices) {
+           py::array_t<int64_t, py::array::c_style>    indices,
+           std::string const& encoding, py::object dtype) {
             TCM_CHECK(
                 array.ndim() == 1, std::invalid_argument,
                 fmt::format("`array` has incorrect dimension: {}; expected 1",
@@ -715,10 +772,13 @@ auto bind_spin(PyObject* module) -> void
                       std::out_of_range,
                       "`indices` contains invalid incides for `array`");
             return unpack_to_tensor(
-                first, last,
+                first, last, detail::parse_spin_encoding(encoding),
+                parse_dtype(std::move(dtype)),
                 [data = array.data()](auto const i) { return data[i]; });
         },
-        py::arg{"array"}.noconvert(), py::arg{"indices"}.noconvert());
+        py::arg{"array"}.noconvert(), py::arg{"indices"}.noconvert(),
+        py::arg{"encoding"} = "sign", py::arg{"dtype"} = py::none(),
+        R"EOF(Same as ``unpack(array[indices], encoding, dtype)``.)EOF");
 
     m.def(
         "pack",
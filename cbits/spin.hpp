@@ -87,9 +87,21 @@ enum class Spin : unsigned char {
     up   = 0x01,
 };
 
+/// Specifies how spins are represented when unpacked into a tensor.
+enum class SpinEncoding : unsigned char {
+    sign    = 0x00, ///< `Spin::down ↦ -1`, `Spin::up ↦ 1`
+    binary  = 0x01, ///< `Spin::down ↦ 0`, `Spin::up ↦ 1`
+    one_hot = 0x02, ///< `Spin::down ↦ (1, 0)`, `Spin::up ↦ (0, 1)`. The two
+                    ///< components are stored as separate channels, i.e.
+                    ///< output has shape `[batch_size, 2, number_spins]`.
+};
+
 namespace detail {
 // TODO(twesterhout): Remove me!
 auto spin_configuration_to_string(gsl::span<float const> spin) -> std::string;
+
+/// Parses "sign", "binary" or "one_hot" into a #SpinEncoding.
+auto parse_spin_encoding(std::string const& name) -> SpinEncoding;
 } // namespace detail
 
 struct IdentityProjection {
@@ -104,6 +116,11 @@ TCM_NOINLINE auto unpack_to_tensor(RandomAccessIterator first,
                                    RandomAccessIterator last, torch::Tensor dst,
                                    Projection proj = Projection{}) -> void;
 
+template <class RandomAccessIterator, class Projection = IdentityProjection>
+auto unpack_to_tensor(RandomAccessIterator first, RandomAccessIterator last,
+                      torch::Tensor dst, SpinEncoding encoding,
+                      Projection proj = Projection{}) -> void;
+
 // [SpinVector] {{{
 class TCM_EXPORT SpinVector {
 
@@ -166,6 +183,14 @@ class TCM_EXPORT SpinVector {
     template <class Generator>
     static auto random(unsigned size, Generator& generator) -> SpinVector;
 
+    /// Returns a uniformly random spin configuration of length `size` with
+    /// exactly `number_ups` spins up.
+    ///
+    /// \precondition `size <= max_size()` and `number_ups <= size`.
+    template <class Generator>
+    static auto unsafe_random(unsigned size, unsigned number_ups,
+                              Generator& generator) TCM_NOEXCEPT -> SpinVector;
+
     constexpr auto        size() const noexcept -> unsigned;
     static constexpr auto max_size() noexcept -> unsigned;
 
@@ -194,6 +219,17 @@ class TCM_EXPORT SpinVector {
     flipped(std::initializer_list<unsigned> indices) const TCM_NOEXCEPT
         -> SpinVector;
 
+    /// Returns a new spin configuration with all spins flipped.
+    inline auto inverted() const TCM_NOEXCEPT -> SpinVector;
+
+    /// Returns a new spin configuration `σ'` such that
+    /// `σ'[permutation[i]] = σ[i]`, i.e. site `i` is moved to
+    /// `permutation[i]`.
+    ///
+    /// \precondition `permutation` is a permutation of `{0, ..., size() - 1}`.
+    inline auto permuted(gsl::span<uint16_t const> permutation) const
+        TCM_NOEXCEPT -> SpinVector;
+
     /// Compares spin configurations for equality.
     ///
     /// Only SpinVectors of the same length can be compared.
@@ -212,6 +248,35 @@ class TCM_EXPORT SpinVector {
     auto numpy() const -> pybind11::array_t<float, pybind11::array::c_style>;
     auto tensor() const -> torch::Tensor;
 
+    /// Returns the `i`'th byte of the packed representation, i.e. spins
+    /// `8 * i, ..., 8 * i + 7`. The first of them is the most significant bit.
+    constexpr auto byte(unsigned const i) const TCM_NOEXCEPT -> uint8_t
+    {
+        TCM_ASSERT(i < (max_size() + 7) / 8, "index out of bounds");
+        auto const word = _data.spin[i / 2];
+        return static_cast<uint8_t>((i % 2 == 0) ? (word >> 8) : (word & 0xFF));
+    }
+
+    /// Returns the `i`'th 16-bit word of the packed representation, i.e.
+    /// spins `16 * i, ..., 16 * i + 15`. The first of them is the most
+    /// significant bit.
+    constexpr auto word(unsigned const i) const TCM_NOEXCEPT -> uint16_t
+    {
+        TCM_ASSERT(i < (max_size() + 15) / 16, "index out of bounds");
+        return _data.spin[i];
+    }
+
+    /// Flips all spins in the `i`'th word for which `mask` has a one bit.
+    ///
+    /// \precondition `mask` does not touch spins beyond `size()`.
+    constexpr auto flip_word(unsigned const i, uint16_t const mask)
+        TCM_NOEXCEPT -> void
+    {
+        TCM_ASSERT(i < (max_size() + 15) / 16, "index out of bounds");
+        _data.spin[i] ^= mask;
+        TCM_ASSERT(is_valid(), "Bug! Post-condition violated.");
+    }
+
     constexpr auto key(UnsafeTag) const TCM_NOEXCEPT -> int64_t
     {
         TCM_ASSERT(size() <= 64, "Chain too long");
@@ -370,33 +435,15 @@ class TCM_EXPORT SpinVector {
     }
 
   public:
-    auto find_nth_up(unsigned n) const TCM_NOEXCEPT -> unsigned
-    {
-        ++n;
-        auto i = 0u;
-        while (true) {
-            if (unsafe_at(i) == Spin::up) {
-                if (--n == 0) { break; }
-            }
-            ++i;
-            TCM_ASSERT(i < size(), "");
-        }
-        return i;
-    }
+    /// Returns the index of the `n`'th (counting from zero) spin up.
+    ///
+    /// \precondition `n` is less than the number of spins up.
+    inline auto find_nth_up(unsigned n) const TCM_NOEXCEPT -> unsigned;
 
-    auto find_nth_down(unsigned n) const TCM_NOEXCEPT -> unsigned
-    {
-        ++n;
-        auto i = 0u;
-        while (true) {
-            if (unsafe_at(i) == Spin::down) {
-                if (--n == 0) { break; }
-            }
-            ++i;
-            TCM_ASSERT(i < size(), "");
-        }
-        return i;
-    }
+    /// Returns the index of the `n`'th (counting from zero) spin down.
+    ///
+    /// \precondition `n` is less than the number of spins down.
+    inline auto find_nth_down(unsigned n) const TCM_NOEXCEPT -> unsigned;
 
   private:
     class SpinReference {
@@ -555,6 +602,39 @@ SpinVector::flipped(std::initializer_list<unsigned> is) const TCM_NOEXCEPT
     return temp;
 }
 
+inline auto SpinVector::inverted() const TCM_NOEXCEPT -> SpinVector
+{
+    SpinVector temp{*this};
+    auto const chunks = size() / 16u;
+    auto const rest   = size() % 16u;
+    for (auto i = 0u; i < chunks; ++i) {
+        temp._data.spin[i] = static_cast<uint16_t>(~temp._data.spin[i]);
+    }
+    if (rest != 0) {
+        temp._data.spin[chunks] = static_cast<uint16_t>(
+            ~temp._data.spin[chunks] & (0xFFFFu << (16u - rest)));
+    }
+    TCM_ASSERT(temp.is_valid(), "Bug! Post-condition violated.");
+    return temp;
+}
+
+inline auto SpinVector::permuted(gsl::span<uint16_t const> permutation) const
+    TCM_NOEXCEPT -> SpinVector
+{
+    TCM_ASSERT(permutation.size() == size(), "permutation has wrong size");
+    SpinVector temp;
+    temp._data.size = _data.size;
+    for (auto i = 0u; i < size(); ++i) {
+        auto const bit = (_data.spin[i / 16u] >> (15u - i % 16u)) & 1u;
+        auto const j   = permutation[i];
+        TCM_ASSERT(j < size(), "index out of bounds");
+        temp._data.spin[j / 16u] |=
+            static_cast<uint16_t>(bit << (15u - j % 16u));
+    }
+    TCM_ASSERT(temp.is_valid(), "Bug! Post-condition violated.");
+    return temp;
+}
+
 inline auto SpinVector::magnetisation() const noexcept -> int
 {
     static_assert(sizeof(unsigned long) == sizeof(uint64_t),
@@ -618,6 +698,74 @@ inline auto SpinVector::hash() const noexcept -> size_t
                         hash_uint64(static_cast<uint64_t>(_data.as_ints[1])));
 }
 
+// [find_nth] {{{
+namespace detail {
+/// Returns the position of the `n`'th (counting from zero) set bit in `word`.
+/// Bits are numbered starting with the most significant one, i.e. the same
+/// way sites are stored in #SpinVector.
+///
+/// \precondition `n < popcount(word)`.
+TCM_FORCEINLINE auto select_in_word(uint16_t const word,
+                                    unsigned const n) TCM_NOEXCEPT -> unsigned
+{
+    auto const count = static_cast<unsigned>(__builtin_popcount(word));
+    TCM_ASSERT(n < count, "index out of bounds");
+    // `n`'th bit counting from the most significant end is the `r`'th one
+    // counting from the least significant end.
+    auto const r = count - 1 - n;
+#if defined(__BMI2__)
+    auto const bit = _tzcnt_u32(_pdep_u32(1u << r, word));
+#else
+    // PDEP is microcoded (i.e. really slow) on AMD CPUs before Zen 3, and
+    // is not available on older Intel ones. Clearing the `r` lowest set bits
+    // is branch-free enough for 16-bit words.
+    auto x = static_cast<unsigned>(word);
+    for (auto i = 0u; i < r; ++i) {
+        x &= x - 1;
+    }
+    auto const bit = static_cast<unsigned>(__builtin_ctz(x));
+#endif
+    return 15u - bit;
+}
+
+/// Returns the index of the `n`'th (counting from zero) site in state `Up`.
+///
+/// Words are skipped using popcount, and only the word which contains the
+/// answer is searched bit by bit (see #select_in_word). This makes the cost
+/// independent of the position of the site.
+template <bool Up>
+TCM_FORCEINLINE auto find_nth(uint16_t const* words,
+                              unsigned        n) TCM_NOEXCEPT -> unsigned
+{
+    for (auto i = 0u;; ++i, ++words) {
+        TCM_ASSERT(i < SpinVector::max_size() / 16u, "index out of bounds");
+        // NOTE: For `Up == false` sites past `size()` become ones. This is
+        // fine, because they come after all the valid sites.
+        auto const word  = Up ? *words : static_cast<uint16_t>(~*words);
+        auto const count = static_cast<unsigned>(__builtin_popcount(word));
+        if (n < count) { return 16u * i + select_in_word(word, n); }
+        n -= count;
+    }
+}
+} // namespace detail
+
+inline auto SpinVector::find_nth_up(unsigned const n) const TCM_NOEXCEPT
+    -> unsigned
+{
+    auto const i = detail::find_nth<true>(_data.spin, n);
+    TCM_ASSERT(i < size() && unsafe_at(i) == Spin::up, "");
+    return i;
+}
+
+inline auto SpinVector::find_nth_down(unsigned const n) const TCM_NOEXCEPT
+    -> unsigned
+{
+    auto const i = detail::find_nth<false>(_data.spin, n);
+    TCM_ASSERT(i < size() && unsafe_at(i) == Spin::down, "");
+    return i;
+}
+// [find_nth] }}}
+
 inline SpinVector::operator uint64_t() const
 {
     TCM_ASSERT(is_valid(), "SpinVector is in an invalid state");
@@ -734,6 +882,90 @@ inline auto get_store_mask_for(unsigned const rest) TCM_NOEXCEPT -> __m256i
     TCM_ASSERT(rest <= 8, "Invalid value for `rest`");
     return masks[rest];
 }
+
+/// Values to which `Spin::down` and `Spin::up` are mapped during unpacking.
+///
+/// `T` is the storage type rather than the element type of the tensor, i.e.
+/// both `float16` and `bfloat16` use `uint16_t` and we simply store the bit
+/// patterns.
+template <class T> struct SpinValues {
+    T down;
+    T up;
+
+    constexpr auto swapped() const noexcept -> SpinValues { return {up, down}; }
+};
+
+/// Returns a vector of eight 16-bit lanes. `i`'th lane is all ones if the
+/// `i`'th most significant bit of `src` is set and all zeros otherwise.
+TCM_FORCEINLINE auto byte_to_mask_epi16(uint8_t const src) noexcept -> __m128i
+{
+    auto const bits = _mm_setr_epi16(128, 64, 32, 16, 8, 4, 2, 1);
+    auto const x    = _mm_set1_epi16(static_cast<short>(src));
+    return _mm_cmpeq_epi16(_mm_and_si128(x, bits), bits);
+}
+
+/// Selects `values.up` where `mask` is set and `values.down` otherwise.
+TCM_FORCEINLINE auto select_epi16(__m128i const mask, short const down,
+                                  short const up) noexcept -> __m128i
+{
+    return _mm_or_si128(_mm_and_si128(mask, _mm_set1_epi16(up)),
+                        _mm_andnot_si128(mask, _mm_set1_epi16(down)));
+}
+
+/// Unpacks 8 spins stored in `src` into `dst`.
+TCM_FORCEINLINE auto unpack_byte(uint8_t const src, float* dst,
+                                 SpinValues<float> const values) noexcept
+    -> void
+{
+    auto const mask = byte_to_mask_epi16(src);
+    auto const low  = _mm_cvtepi16_epi32(mask);
+    auto const high = _mm_cvtepi16_epi32(_mm_unpackhi_epi64(mask, mask));
+    _mm256_storeu_ps(dst, _mm256_blendv_ps(
+                              _mm256_set1_ps(values.down),
+                              _mm256_set1_ps(values.up),
+                              _mm256_castsi256_ps(_mm256_setr_m128i(low, high))));
+}
+
+/// \overload
+TCM_FORCEINLINE auto unpack_byte(uint8_t const src, uint16_t* dst,
+                                 SpinValues<uint16_t> const values) noexcept
+    -> void
+{
+    auto const y =
+        select_epi16(byte_to_mask_epi16(src), static_cast<short>(values.down),
+                     static_cast<short>(values.up));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), y);
+}
+
+/// \overload
+TCM_FORCEINLINE auto unpack_byte(uint8_t const src, int8_t* dst,
+                                 SpinValues<int8_t> const values) noexcept
+    -> void
+{
+    auto const y = select_epi16(byte_to_mask_epi16(src), values.down, values.up);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), _mm_packs_epi16(y, y));
+}
+
+/// Unpacks `spin` into `dst` which must have space for `spin.size()` elements.
+///
+/// Unlike `SpinVector::copy_to`, this function never writes past the end of
+/// `dst`: the last `spin.size() % 8` spins are processed one by one.
+template <class T>
+TCM_FORCEINLINE auto unpack_row(SpinVector const& spin, T* dst,
+                                SpinValues<T> const values) noexcept -> void
+{
+    auto const chunks = spin.size() / 8;
+    auto const rest   = spin.size() % 8;
+    for (auto i = 0u; i < chunks; ++i, dst += 8) {
+        unpack_byte(spin.byte(i), dst, values);
+    }
+    if (rest != 0) {
+        auto const last = spin.byte(chunks);
+        for (auto i = 0u; i < rest; ++i) {
+            dst[i] = ((last >> (7u - i)) & 0x01) ? values.up : values.down;
+        }
+    }
+}
 } // namespace detail
 
 inline auto
@@ -859,10 +1091,11 @@ TCM_NOINLINE auto SpinVector::random(unsigned const size, Generator& generator)
     return spin;
 }
 
-template <class Generator>
-TCM_NOINLINE auto SpinVector::random(unsigned const size,
-                                     int const      magnetisation,
-                                     Generator&     generator) -> SpinVector
+namespace detail {
+/// Checks that `size` spins can have the given magnetisation and returns the
+/// number of spins up.
+inline auto number_ups_for(unsigned const size, int const magnetisation)
+    -> unsigned
 {
     TCM_CHECK(size <= SpinVector::max_size(), std::invalid_argument,
               fmt::format("invalid size {}; expected <={}", size,
@@ -877,18 +1110,118 @@ TCM_NOINLINE auto SpinVector::random(unsigned const size,
               fmt::format("{} spins cannot have a magnetisation of {}. `size + "
                           "magnetisation` must be even",
                           size, magnetisation));
-    float      buffer[SpinVector::max_size()];
-    auto const spin = gsl::span<float>{buffer, size};
-    auto const number_ups =
-        static_cast<size_t>((static_cast<int>(size) + magnetisation) / 2);
-    auto const middle = std::begin(spin) + number_ups;
-    std::fill(std::begin(spin), middle, 1.0f);
-    std::fill(middle, std::end(spin), -1.0f);
-    std::shuffle(std::begin(spin), std::end(spin), generator);
-    auto compact_spin = SpinVector{spin};
+    return static_cast<unsigned>((static_cast<int>(size) + magnetisation) / 2);
+}
+} // namespace detail
+
+template <class Generator>
+TCM_NOINLINE auto SpinVector::unsafe_random(unsigned const size,
+                                            unsigned const number_ups,
+                                            Generator&     generator)
+    TCM_NOEXCEPT -> SpinVector
+{
+    TCM_ASSERT(size <= max_size(), "invalid size");
+    TCM_ASSERT(number_ups <= size, "invalid number of spins up");
+    // We use Robert Floyd's algorithm to choose a random `k`-subset of
+    // `{0, ..., size - 1}` in exactly `k` steps. The bits are set directly, so
+    // there is no need for a temporary buffer. `k` is the smaller of the
+    // numbers of spins up and down, i.e. at most `size / 2` random numbers are
+    // generated.
+    auto const invert = 2 * number_ups > size;
+    auto const k      = invert ? size - number_ups : number_ups;
+    using Dist        = std::uniform_int_distribution<unsigned>;
+    using Param       = Dist::param_type;
+
+    auto const mask = [](auto const i) {
+        return static_cast<uint16_t>(1u << (15u - i % 16u));
+    };
+
+    SpinVector  spin;
+    auto* const words = spin._data.spin;
+    Dist        dist;
+    for (auto j = size - k; j < size; ++j) {
+        auto i = dist(generator, Param{0, j});
+        if (words[i / 16u] & mask(i)) { i = j; }
+        words[i / 16u] |= mask(i);
+    }
+    if (invert) {
+        auto const chunks = size / 16u;
+        auto const rest   = size % 16u;
+        for (auto i = 0u; i < chunks; ++i) {
+            words[i] = static_cast<uint16_t>(~words[i]);
+        }
+        if (rest != 0) {
+            words[chunks] = static_cast<uint16_t>(~words[chunks]
+                                                  & (0xFFFFu << (16u - rest)));
+        }
+    }
+    spin._data.size = static_cast<uint16_t>(size);
+    TCM_ASSERT(spin.is_valid(), "Bug! Post-condition violated");
+    return spin;
+}
+
+template <class Generator>
+TCM_NOINLINE auto SpinVector::random(unsigned const size,
+                                     int const      magnetisation,
+                                     Generator&     generator) -> SpinVector
+{
+    auto const compact_spin = unsafe_random(
+        size, detail::number_ups_for(size, magnetisation), generator);
     TCM_ASSERT(compact_spin.magnetisation() == magnetisation, "");
     return compact_spin;
 }
+
+/// Fills `out` with uniformly random spin configurations of length `size`
+/// and given magnetisation.
+template <class Generator>
+auto random_spins(unsigned const size, int const magnetisation,
+                  gsl::span<SpinVector> const out, Generator& generator)
+    -> void
+{
+    auto const number_ups = detail::number_ups_for(size, magnetisation);
+    for (auto& spin : out) {
+        spin = SpinVector::unsafe_random(size, number_ups, generator);
+    }
+}
+
+template <class Generator>
+auto random_spins(unsigned const size, int const magnetisation,
+                  size_t const count, Generator& generator)
+    -> aligned_vector<SpinVector>
+{
+    aligned_vector<SpinVector> out(count);
+    random_spins(size, magnetisation, out, generator);
+    return out;
+}
+
+/// For every spin configuration in `spins`, flips one randomly chosen spin
+/// up and one randomly chosen spin down. Magnetisation is thus preserved.
+///
+/// \precondition All configurations in `spins` have the same size and
+///               contain exactly `number_ups` spins up.
+/// \precondition `0 < number_ups < size`.
+template <class Generator>
+auto random_exchange(gsl::span<SpinVector> const spins,
+                     unsigned const number_ups, Generator& generator)
+    -> void
+{
+    if (spins.empty()) { return; }
+    auto const number_downs = spins[0].size() - number_ups;
+    TCM_ASSERT(number_ups > 0 && number_downs > 0, "nothing to exchange");
+    using Dist  = std::uniform_int_distribution<unsigned>;
+    using Param = Dist::param_type;
+    Dist dist;
+    for (auto& spin : spins) {
+        TCM_ASSERT(spin.size() == number_ups + number_downs,
+                   "all spin configurations must have the same size");
+        auto const up   = spin.find_nth_up(
+            dist(generator, Param{0, number_ups - 1}));
+        auto const down = spin.find_nth_down(
+            dist(generator, Param{0, number_downs - 1}));
+        spin.flip(up);
+        spin.flip(down);
+    }
+}
 // }}}
 
 auto all_spins(unsigned n, optional<int> magnetisation)
@@ -966,8 +1299,121 @@ auto unpack_to_tensor(RandomAccessIterator first, RandomAccessIterator last,
     unpack_to_tensor(first, last, out, std::move(proj));
     return out;
 }
+
+/// Unpacks spins into `dst` using the given `encoding`.
+///
+/// `dst` must be a contiguous tensor of either `float32`, `float16`,
+/// `bfloat16` or `int8`. Its shape should be `[size, number_spins]` or
+/// `[size, 2, number_spins]` if `encoding == SpinEncoding::one_hot`.
+template <class RandomAccessIterator, class Projection>
+auto unpack_to_tensor(RandomAccessIterator first, RandomAccessIterator last,
+                      torch::Tensor dst, SpinEncoding const encoding,
+                      Projection proj) -> void
+{
+    if (first == last) { return; }
+    if (encoding == SpinEncoding::sign
+        && dst.scalar_type() == torch::kFloat32) {
+        unpack_to_tensor(first, last, std::move(dst), std::move(proj));
+        return;
+    }
+    TCM_ASSERT(last - first > 0, "Invalid range");
+    auto const size         = static_cast<size_t>(last - first);
+    auto const number_spins = proj(*first).size();
+    auto const one_hot      = encoding == SpinEncoding::one_hot;
+    TCM_ASSERT(dst.dim() == (one_hot ? 3 : 2),
+               fmt::format("Invalid dimension {}", dst.dim()));
+    TCM_ASSERT(size == static_cast<size_t>(dst.size(0)),
+               fmt::format("Sizes don't match: size={}, dst.size(0)={}", size,
+                           dst.size(0)));
+    TCM_ASSERT(!one_hot || dst.size(1) == 2,
+               fmt::format("Sizes don't match: dst.size(1)={}; expected 2",
+                           dst.size(1)));
+    TCM_ASSERT(static_cast<int64_t>(number_spins) == dst.size(dst.dim() - 1),
+               fmt::format("Sizes don't match: number_spins={}, dst.size(-1)={}",
+                           number_spins, dst.size(dst.dim() - 1)));
+    TCM_ASSERT(dst.is_contiguous(), "Output tensor must be contiguous");
+
+    auto const run = [first, last, number_spins, one_hot, &proj](
+                         auto* data, auto const values) {
+        auto iter = first;
+        if (one_hot) {
+            // First channel encodes `Spin::down` and the second -- `Spin::up`.
+            for (; iter != last; ++iter, data += 2 * number_spins) {
+                auto const spin = proj(*iter);
+                detail::unpack_row(spin, data, values.swapped());
+                detail::unpack_row(spin, data + number_spins, values);
+            }
+        }
+        else {
+            for (; iter != last; ++iter, data += number_spins) {
+                detail::unpack_row(proj(*iter), data, values);
+            }
+        }
+    };
+    // For one-hot encoding, each channel is simply a {0, 1} mask
+    auto const binary = encoding != SpinEncoding::sign;
+    switch (dst.scalar_type()) {
+    case torch::kFloat32:
+        run(static_cast<float*>(dst.data_ptr()),
+            detail::SpinValues<float>{binary ? 0.0f : -1.0f, 1.0f});
+        break;
+    case torch::kFloat16:
+        // IEEE half precision: 1.0 is 0x3C00 and -1.0 is 0xBC00
+        run(static_cast<uint16_t*>(dst.data_ptr()),
+            detail::SpinValues<uint16_t>{
+                static_cast<uint16_t>(binary ? 0x0000 : 0xBC00), 0x3C00});
+        break;
+    case torch::kBFloat16:
+        // bfloat16 is the upper half of float32: 1.0 is 0x3F80 and -1.0 is
+        // 0xBF80
+        run(static_cast<uint16_t*>(dst.data_ptr()),
+            detail::SpinValues<uint16_t>{
+                static_cast<uint16_t>(binary ? 0x0000 : 0xBF80), 0x3F80});
+        break;
+    case torch::kInt8:
+        run(static_cast<int8_t*>(dst.data_ptr()),
+            detail::SpinValues<int8_t>{static_cast<int8_t>(binary ? 0 : -1),
+                                       1});
+        break;
+    default:
+        TCM_ERROR(std::domain_error,
+                  fmt::format("unsupported dtype: {}; expected one of float32, "
+                              "float16, bfloat16 or int8",
+                              dst.scalar_type()));
+    } // end switch
+}
+
+template <class RandomAccessIterator, class Projection = IdentityProjection>
+auto unpack_to_tensor(RandomAccessIterator first, RandomAccessIterator last,
+                      SpinEncoding const encoding, torch::ScalarType const dtype,
+                      Projection proj = Projection{}) -> torch::Tensor
+{
+    auto const options =
+        torch::TensorOptions().dtype(dtype).requires_grad(false);
+    if (first == last) { return torch::empty({0}, options); }
+    TCM_ASSERT(last - first > 0, "Invalid range");
+    auto const size         = static_cast<int64_t>(last - first);
+    auto const number_spins = static_cast<int64_t>(proj(*first).size());
+    auto       out          = encoding == SpinEncoding::one_hot
+                     ? torch::empty({size, 2, number_spins}, options)
+                     : torch::empty({size, number_spins}, options);
+    unpack_to_tensor(first, last, out, encoding, std::move(proj));
+    return out;
+}
 // [unpack_to_tensor] }}}
 
+/// Converts a vector to a NumPy array without copying the data.
+template <class T, class Allocator>
+inline auto to_numpy_array(std::vector<T, Allocator>&& xs) -> pybind11::array
+{
+    using V         = std::vector<T, Allocator>;
+    auto const size = xs.size();
+    auto const data = xs.data();
+    auto       base = pybind11::capsule{new V{std::move(xs)},
+                                  [](void* p) { delete static_cast<V*>(p); }};
+    return pybind11::array_t<T>{size, data, std::move(base)};
+}
+
 auto bind_spin(PyObject*) -> void;
 // auto bind_spin(pybind11::module) -> void;
 
@@ -0,0 +1,959 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "sr.hpp"
+#include <mkl_cblas.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+#include <array>
+#include <cmath>
+#include <limits>
+#include <numeric>
+
+TCM_NAMESPACE_BEGIN
+
+namespace {
+/// Columns are processed in blocks of this size by a single thread. The
+/// matrices are row-major, so this way every thread streams through
+/// contiguous chunks of rows and no reductions across threads are needed.
+constexpr auto column_block_size = size_t{64};
+
+/// Computes `yₚ = ∑ᵢ Re[Oᵢₚ uᵢ]` (or `Re[Oᵢₚ* uᵢ]` if `Conjugate`).
+template <bool Conjugate>
+auto column_reduce(std::complex<float> const* derivatives, size_t const rows,
+                   size_t const cols, complex_type const* u,
+                   real_type* y) noexcept -> void
+{
+    auto const number_blocks = static_cast<int64_t>(
+        (cols + column_block_size - 1) / column_block_size);
+#pragma omp parallel for default(none)                                         \
+    firstprivate(derivatives, rows, cols, u, y, number_blocks) schedule(static)
+    for (auto b = int64_t{0}; b < number_blocks; ++b) {
+        auto const begin = static_cast<size_t>(b) * column_block_size;
+        auto const end   = std::min(begin + column_block_size, cols);
+        std::fill(y + begin, y + end, real_type{0});
+        for (auto i = size_t{0}; i < rows; ++i) {
+            auto const* row = derivatives + i * cols;
+            auto const  re  = u[i].real();
+            auto const  im  = Conjugate ? u[i].imag() : -u[i].imag();
+            for (auto p = begin; p < end; ++p) {
+                y[p] += static_cast<real_type>(row[p].real()) * re
+                        + static_cast<real_type>(row[p].imag()) * im;
+            }
+        }
+    }
+}
+
+auto dot(gsl::span<real_type const> x, gsl::span<real_type const> y) noexcept
+    -> real_type
+{
+    TCM_ASSERT(x.size() == y.size(), "sizes don't match");
+    return std::inner_product(std::begin(x), std::end(x), std::begin(y),
+                              real_type{0});
+}
+
+auto check_weights(gsl::span<real_type const> weights, size_t const rows)
+    -> void
+{
+    TCM_CHECK(weights.empty() || weights.size() == rows,
+              std::invalid_argument,
+              fmt::format("weights has wrong length: {}; expected {}",
+                          weights.size(), rows));
+    for (auto const w : weights) {
+        TCM_CHECK(std::isfinite(w) && w >= real_type{0},
+                  std::invalid_argument,
+                  fmt::format("invalid weight: {}; expected a non-negative "
+                              "finite float",
+                              w));
+    }
+}
+
+/// Computes `Y += Re[(O - 1μᵀ)ᴴ W (O - 1μᵀ)] Ω` for a row-major `rows x cols`
+/// matrix `O` and a row-major `cols x rank` matrix `Ω`. If `mean` is `nullptr`,
+/// `μ = 0`, and if `weights` is `nullptr`, `W = 1`.
+auto accumulate_sketch(std::complex<float> const* derivatives,
+                       size_t const rows, size_t const cols,
+                       complex_type const* mean, real_type const* weights,
+                       real_type const* omega, size_t const rank,
+                       real_type* sketch) -> void
+{
+    TCM_CHECK(std::max(cols, rank)
+                  <= static_cast<size_t>(std::numeric_limits<int>::max()),
+              std::overflow_error,
+              fmt::format("too many parameters: {}", cols));
+    constexpr auto block_size = size_t{256};
+    // Like in SRMatrix::dense, every block of rows is converted to a real
+    // 2k x cols matrix A with rows √wᵢ Re[Oᵢ - μ] and √wᵢ Im[Oᵢ - μ]. Then
+    // the sketch is ∑ Aᵀ(A Ω) over blocks.
+    aligned_vector<real_type> block(2 * std::min(block_size, rows) * cols);
+    aligned_vector<real_type> product(2 * std::min(block_size, rows) * rank);
+    for (auto first = size_t{0}; first < rows; first += block_size) {
+        auto const  k    = std::min(block_size, rows - first);
+        auto const* data = derivatives + first * cols;
+        auto const* w    = weights != nullptr ? weights + first : nullptr;
+        auto*       a    = block.data();
+#pragma omp parallel for default(none) firstprivate(data, w, a, k, cols, mean) \
+    schedule(static)
+        for (auto i = int64_t{0}; i < static_cast<int64_t>(k); ++i) {
+            auto const  j     = static_cast<size_t>(i);
+            auto const  scale = w != nullptr ? std::sqrt(w[j]) : real_type{1};
+            auto const* row   = data + j * cols;
+            auto*       re    = a + (2 * j) * cols;
+            auto*       im    = a + (2 * j + 1) * cols;
+            for (auto p = size_t{0}; p < cols; ++p) {
+                auto o = static_cast<complex_type>(row[p]);
+                if (mean != nullptr) { o -= mean[p]; }
+                re[p] = scale * o.real();
+                im[p] = scale * o.imag();
+            }
+        }
+        cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasNoTrans,
+                    static_cast<int>(2 * k), static_cast<int>(rank),
+                    static_cast<int>(cols), /*alpha=*/1.0, block.data(),
+                    static_cast<int>(cols), omega, static_cast<int>(rank),
+                    /*beta=*/0.0, product.data(), static_cast<int>(rank));
+        cblas_dgemm(CblasRowMajor, CblasTrans, CblasNoTrans,
+                    static_cast<int>(cols), static_cast<int>(rank),
+                    static_cast<int>(2 * k), /*alpha=*/1.0, block.data(),
+                    static_cast<int>(cols), product.data(),
+                    static_cast<int>(rank), /*beta=*/1.0, sketch,
+                    static_cast<int>(rank));
+    }
+}
+
+/// Solves `A x = b` for a symmetric positive definite row-major `n x n`
+/// matrix `A` using Cholesky decomposition. Both `A` and `b` are overwritten.
+auto cholesky_solve(gsl::span<real_type> matrix, gsl::span<real_type> rhs)
+    -> void
+{
+    auto const n  = rhs.size();
+    auto const at = [p = matrix.data(), n](size_t const i,
+                                           size_t const j) -> real_type& {
+        return p[i * n + j];
+    };
+    TCM_ASSERT(matrix.size() == n * n, "sizes don't match");
+    // A = LLᵀ where L is stored in the lower triangle
+    for (auto j = size_t{0}; j < n; ++j) {
+        auto d = at(j, j);
+        for (auto k = size_t{0}; k < j; ++k) {
+            d -= at(j, k) * at(j, k);
+        }
+        if (!(d > real_type{0})) {
+            TCM_ERROR(std::runtime_error,
+                      fmt::format("matrix is not positive definite: leading "
+                                  "minor of order {} is not positive",
+                                  j + 1));
+        }
+        at(j, j) = std::sqrt(d);
+        for (auto i = j + 1; i < n; ++i) {
+            auto x = at(i, j);
+            for (auto k = size_t{0}; k < j; ++k) {
+                x -= at(i, k) * at(j, k);
+            }
+            at(i, j) = x / at(j, j);
+        }
+    }
+    // Forward substitution: L y = b
+    for (auto i = size_t{0}; i < n; ++i) {
+        for (auto k = size_t{0}; k < i; ++k) {
+            rhs[i] -= at(i, k) * rhs[k];
+        }
+        rhs[i] /= at(i, i);
+    }
+    // Back substitution: Lᵀ x = y
+    for (auto i = n; i-- > 0;) {
+        for (auto k = i + 1; k < n; ++k) {
+            rhs[i] -= at(k, i) * rhs[k];
+        }
+        rhs[i] /= at(i, i);
+    }
+}
+} // namespace
+
+auto center_derivatives(gsl::span<std::complex<float>> derivatives,
+                        size_t const rows, size_t const cols,
+                        gsl::span<real_type const> weights) -> void
+{
+    TCM_CHECK(derivatives.size() == rows * cols, std::invalid_argument,
+              fmt::format("derivatives has wrong size: {}; expected {}x{}",
+                          derivatives.size(), rows, cols));
+    check_weights(weights, rows);
+    if (rows == 0) { return; }
+    auto const uniform = real_type{1} / static_cast<real_type>(rows);
+    // Weights don't have to be normalised
+    auto const sum = std::accumulate(std::begin(weights), std::end(weights),
+                                     real_type{0});
+    TCM_CHECK(weights.empty() || sum > real_type{0}, std::invalid_argument,
+              "weights must not all be zero");
+    auto const scale = weights.empty() ? real_type{1} : real_type{1} / sum;
+    auto const number_blocks = static_cast<int64_t>(
+        (cols + column_block_size - 1) / column_block_size);
+    auto* const data = derivatives.data();
+    auto const* w    = weights.empty() ? nullptr : weights.data();
+#pragma omp parallel for default(none)                                         \
+    firstprivate(data, w, rows, cols, uniform, scale, number_blocks)           \
+        schedule(static)
+    for (auto b = int64_t{0}; b < number_blocks; ++b) {
+        auto const begin = static_cast<size_t>(b) * column_block_size;
+        auto const end   = std::min(begin + column_block_size, cols);
+        // Means are accumulated in double precision
+        std::array<complex_type, column_block_size> mean;
+        mean.fill(complex_type{0});
+        for (auto i = size_t{0}; i < rows; ++i) {
+            auto const* row    = data + i * cols;
+            auto const  weight = w != nullptr ? scale * w[i] : uniform;
+            for (auto p = begin; p < end; ++p) {
+                mean[p - begin] += weight * static_cast<complex_type>(row[p]);
+            }
+        }
+        for (auto i = size_t{0}; i < rows; ++i) {
+            auto* row = data + i * cols;
+            for (auto p = begin; p < end; ++p) {
+                row[p] -= static_cast<std::complex<float>>(mean[p - begin]);
+            }
+        }
+    }
+}
+
+SRMatrix::SRMatrix(gsl::span<std::complex<float> const> derivatives,
+                   size_t const rows, size_t const cols,
+                   gsl::span<real_type const> weights)
+    : _derivatives{derivatives.data()}
+    , _rows{rows}
+    , _cols{cols}
+    , _weights{}
+    , _diagonal{}
+    , _product{}
+{
+    TCM_CHECK(derivatives.size() == rows * cols, std::invalid_argument,
+              fmt::format("derivatives has wrong size: {}; expected {}x{}",
+                          derivatives.size(), rows, cols));
+    TCM_CHECK(rows > 0, std::invalid_argument, "there are no samples");
+    check_weights(weights, rows);
+    if (weights.empty()) {
+        _weights.resize(rows, real_type{1} / static_cast<real_type>(rows));
+    }
+    else {
+        auto const sum = std::accumulate(std::begin(weights), std::end(weights),
+                                         real_type{0});
+        TCM_CHECK(sum > real_type{0}, std::invalid_argument,
+                  "weights must not all be zero");
+        _weights.reserve(rows);
+        for (auto const w : weights) {
+            _weights.push_back(w / sum);
+        }
+    }
+
+    _diagonal.resize(cols);
+    auto const* data = _derivatives;
+    auto const* w    = _weights.data();
+    auto*       d    = _diagonal.data();
+    auto const  number_blocks = static_cast<int64_t>(
+        (cols + column_block_size - 1) / column_block_size);
+#pragma omp parallel for default(none)                                         \
+    firstprivate(data, w, d, rows, cols, number_blocks) schedule(static)
+    for (auto b = int64_t{0}; b < number_blocks; ++b) {
+        auto const begin = static_cast<size_t>(b) * column_block_size;
+        auto const end   = std::min(begin + column_block_size, cols);
+        for (auto i = size_t{0}; i < rows; ++i) {
+            auto const* row = data + i * cols;
+            for (auto p = begin; p < end; ++p) {
+                d[p] += w[i] * std::norm(static_cast<complex_type>(row[p]));
+            }
+        }
+    }
+}
+
+auto SRMatrix::operator()(gsl::span<real_type const> x,
+                          gsl::span<real_type> y) const -> void
+{
+    TCM_CHECK(x.size() == _cols && y.size() == _cols, std::invalid_argument,
+              fmt::format("x and y have wrong lengths: {} and {}; expected {}",
+                          x.size(), y.size(), _cols));
+    auto const  u    = _product.get(_rows);
+    auto const* data = _derivatives;
+    auto const* w    = _weights.data();
+    auto const* v    = x.data();
+    auto*       out  = u.data();
+    auto const  rows = static_cast<int64_t>(_rows);
+    auto const  cols = _cols;
+    // First pass: u = W (O x)
+#pragma omp parallel for default(none)                                         \
+    firstprivate(data, w, v, out, rows, cols) schedule(static)
+    for (auto i = int64_t{0}; i < rows; ++i) {
+        auto const* row = data + static_cast<size_t>(i) * cols;
+        auto        re  = real_type{0};
+        auto        im  = real_type{0};
+        for (auto p = size_t{0}; p < cols; ++p) {
+            re += static_cast<real_type>(row[p].real()) * v[p];
+            im += static_cast<real_type>(row[p].imag()) * v[p];
+        }
+        out[i] = w[i] * complex_type{re, im};
+    }
+    // Second pass: y = Re[Oᴴ u]
+    column_reduce</*Conjugate=*/true>(_derivatives, _rows, _cols, u.data(),
+                                      y.data());
+}
+
+auto SRMatrix::gradient(gsl::span<complex_type const> local_energies) const
+    -> aligned_vector<real_type>
+{
+    TCM_CHECK(local_energies.size() == _rows, std::invalid_argument,
+              fmt::format("local_energies has wrong length: {}; expected {}",
+                          local_energies.size(), _rows));
+    auto const u = _product.get(_rows);
+    for (auto i = size_t{0}; i < _rows; ++i) {
+        u[i] = real_type{2} * _weights[i] * std::conj(local_energies[i]);
+    }
+    aligned_vector<real_type> force(_cols);
+    column_reduce</*Conjugate=*/false>(_derivatives, _rows, _cols, u.data(),
+                                       force.data());
+    return force;
+}
+
+auto SRMatrix::dense() const -> aligned_vector<real_type>
+{
+    TCM_CHECK(_cols <= static_cast<size_t>(std::numeric_limits<int>::max()),
+              std::overflow_error,
+              fmt::format("too many parameters: {}", _cols));
+    constexpr auto block_size = size_t{256};
+    auto const     cols       = _cols;
+    aligned_vector<real_type> matrix(cols * cols);
+    // Every block of rows of O is converted to a real 2k x cols matrix with
+    // rows √wᵢ Re[Oᵢ] and √wᵢ Im[Oᵢ] such that S = ∑ AᵀA over blocks.
+    aligned_vector<real_type> block(2 * block_size * cols);
+    for (auto first = size_t{0}; first < _rows; first += block_size) {
+        auto const  k    = std::min(block_size, _rows - first);
+        auto const* data = _derivatives + first * cols;
+        auto const* w    = _weights.data() + first;
+        auto*       a    = block.data();
+#pragma omp parallel for default(none) firstprivate(data, w, a, k, cols)       \
+    schedule(static)
+        for (auto i = int64_t{0}; i < static_cast<int64_t>(k); ++i) {
+            auto const  j     = static_cast<size_t>(i);
+            auto const  scale = std::sqrt(w[j]);
+            auto const* row   = data + j * cols;
+            auto*       re    = a + (2 * j) * cols;
+            auto*       im    = a + (2 * j + 1) * cols;
+            for (auto p = size_t{0}; p < cols; ++p) {
+                re[p] = scale * static_cast<real_type>(row[p].real());
+                im[p] = scale * static_cast<real_type>(row[p].imag());
+            }
+        }
+        cblas_dsyrk(CblasRowMajor, CblasUpper, CblasTrans,
+                    static_cast<int>(cols), static_cast<int>(2 * k),
+                    /*alpha=*/1.0, block.data(), static_cast<int>(cols),
+                    /*beta=*/1.0, matrix.data(), static_cast<int>(cols));
+    }
+    // dsyrk only updates the upper triangle
+    for (auto p = size_t{0}; p < cols; ++p) {
+        for (auto q = size_t{0}; q < p; ++q) {
+            matrix[p * cols + q] = matrix[q * cols + p];
+        }
+    }
+    return matrix;
+}
+
+auto SRMatrix::sketch(gsl::span<real_type const> omega, size_t const rank) const
+    -> aligned_vector<real_type>
+{
+    TCM_CHECK(omega.size() == _cols * rank, std::invalid_argument,
+              fmt::format("omega has wrong size: {}; expected {}x{}",
+                          omega.size(), _cols, rank));
+    aligned_vector<real_type> out(_cols * rank);
+    if (rank > 0) {
+        accumulate_sketch(_derivatives, _rows, _cols, /*mean=*/nullptr,
+                          _weights.data(), omega.data(), rank, out.data());
+    }
+    return out;
+}
+
+auto solve_sr(SRMatrix const& matrix, gsl::span<real_type const> force,
+              CGOptions const& options)
+    -> std::tuple<aligned_vector<real_type>, unsigned, real_type>
+{
+    auto const n = matrix.size();
+    TCM_CHECK(force.size() == n, std::invalid_argument,
+              fmt::format("force has wrong length: {}; expected {}",
+                          force.size(), n));
+    // S is only positive semi-definite, so without a shift CG may break down
+    TCM_CHECK(std::isfinite(options.shift) && options.shift > 0,
+              std::invalid_argument,
+              fmt::format("invalid shift: {}; expected a positive float",
+                          options.shift));
+    TCM_CHECK(options.tolerance > 0, std::invalid_argument,
+              fmt::format("invalid tolerance: {}; expected a positive float",
+                          options.tolerance));
+
+    aligned_vector<real_type> x(n);
+    auto const norm_f = std::sqrt(dot(force, force));
+    if (norm_f == real_type{0}) { return {std::move(x), 0u, real_type{0}}; }
+
+    // Jacobi preconditioner
+    aligned_vector<real_type> inverse_diagonal(n);
+    for (auto p = size_t{0}; p < n; ++p) {
+        auto const d        = matrix.diagonal()[p] + options.shift;
+        inverse_diagonal[p] = d > real_type{0} ? real_type{1} / d
+                                               : real_type{1};
+    }
+
+    aligned_vector<real_type> r{std::begin(force), std::end(force)};
+    aligned_vector<real_type> z(n), d(n), q(n);
+    for (auto p = size_t{0}; p < n; ++p) {
+        z[p] = inverse_diagonal[p] * r[p];
+    }
+    d         = z;
+    auto rz   = dot(r, z);
+    auto norm = norm_f;
+    auto i    = 0u;
+    while (i < options.max_iterations) {
+        ++i;
+        matrix(d, q);
+        for (auto p = size_t{0}; p < n; ++p) {
+            q[p] += options.shift * d[p];
+        }
+        auto const curvature = dot(d, q);
+        // dᵀ(S + λ)d > 0 in exact arithmetic; anything else means that
+        // round-off has destroyed the Krylov basis. We return the current
+        // iterate and let the caller judge it by the residual.
+        if (!(curvature > real_type{0})) { break; }
+        auto const alpha = rz / curvature;
+        for (auto p = size_t{0}; p < n; ++p) {
+            x[p] += alpha * d[p];
+            r[p] -= alpha * q[p];
+        }
+        norm = std::sqrt(dot(r, r));
+        if (norm <= options.tolerance * norm_f) { break; }
+        for (auto p = size_t{0}; p < n; ++p) {
+            z[p] = inverse_diagonal[p] * r[p];
+        }
+        auto const rz_next = dot(r, z);
+        auto const beta    = rz_next / rz;
+        rz                 = rz_next;
+        for (auto p = size_t{0}; p < n; ++p) {
+            d[p] = z[p] + beta * d[p];
+        }
+    }
+    return {std::move(x), i, norm / norm_f};
+}
+
+SRAccumulator::SRAccumulator(size_t const number_parameters,
+                             size_t const rank, TestMatrix matrix)
+    : _count{0}
+    , _weight{0}
+    , _energy{0}
+    , _energy_m2{0}
+    , _derivatives(number_parameters)
+    , _covariance(number_parameters)
+    , _rank{rank}
+    , _test_matrix{std::move(matrix)}
+    , _sketch(number_parameters * rank)
+{}
+
+SRAccumulator::SRAccumulator(size_t const number_parameters,
+                             size_t const sketch_rank,
+                             RandomGenerator& generator)
+    : SRAccumulator{number_parameters, sketch_rank, nullptr}
+{
+    TCM_CHECK(sketch_rank <= number_parameters, std::invalid_argument,
+              fmt::format("sketch_rank must not exceed the number of "
+                          "parameters ({}), but got {}",
+                          number_parameters, sketch_rank));
+    if (sketch_rank > 0) {
+        aligned_vector<real_type> omega(number_parameters * sketch_rank);
+        std::normal_distribution<real_type> dist;
+        for (auto& x : omega) {
+            x = dist(generator);
+        }
+        _test_matrix =
+            std::make_shared<aligned_vector<real_type> const>(std::move(omega));
+    }
+}
+
+auto SRAccumulator::update(gsl::span<std::complex<float> const> derivatives,
+                           size_t const                         rows,
+                           gsl::span<complex_type const> local_energies,
+                           gsl::span<real_type const>    weights) -> void
+{
+    auto const cols = size();
+    TCM_CHECK(derivatives.size() == rows * cols, std::invalid_argument,
+              fmt::format("derivatives has wrong size: {}; expected {}x{}",
+                          derivatives.size(), rows, cols));
+    TCM_CHECK(local_energies.size() == rows, std::invalid_argument,
+              fmt::format("local_energies has wrong length: {}; expected {}",
+                          local_energies.size(), rows));
+    check_weights(weights, rows);
+    if (rows == 0) { return; }
+
+    // Statistics of the batch are computed with two passes over the data
+    SRAccumulator batch{cols, _rank, _test_matrix};
+    auto const    weight_of = [weights](size_t const i) {
+        return weights.empty() ? real_type{1} : weights[i];
+    };
+    for (auto i = size_t{0}; i < rows; ++i) {
+        batch._weight += weight_of(i);
+        batch._energy += weight_of(i) * local_energies[i];
+    }
+    TCM_CHECK(batch._weight > real_type{0}, std::invalid_argument,
+              "weights must not all be zero");
+    batch._energy /= batch._weight;
+    batch._count = rows;
+
+    // Coefficients of Oᵢ in ⟨O⟩ and in the covariance. Since
+    // ∑ᵢwᵢ(Eᵢ - ⟨E⟩) = 0, the latter needs no centering of O.
+    aligned_vector<complex_type> u(2 * rows);
+    for (auto i = size_t{0}; i < rows; ++i) {
+        auto const delta = local_energies[i] - batch._energy;
+        batch._energy_m2 += weight_of(i) * std::norm(delta);
+        u[i]        = weight_of(i) / batch._weight;
+        u[rows + i] = weight_of(i) * std::conj(delta);
+    }
+
+    auto const* data  = derivatives.data();
+    auto const* coeff = u.data();
+    auto*       mean  = batch._derivatives.data();
+    auto*       cov   = batch._covariance.data();
+    auto const  number_blocks = static_cast<int64_t>(
+        (cols + column_block_size - 1) / column_block_size);
+#pragma omp parallel for default(none)                                         \
+    firstprivate(data, coeff, mean, cov, rows, cols, number_blocks)            \
+        schedule(static)
+    for (auto b = int64_t{0}; b < number_blocks; ++b) {
+        auto const begin = static_cast<size_t>(b) * column_block_size;
+        auto const end   = std::min(begin + column_block_size, cols);
+        for (auto i = size_t{0}; i < rows; ++i) {
+            auto const* row = data + i * cols;
+            for (auto p = begin; p < end; ++p) {
+                auto const o = static_cast<complex_type>(row[p]);
+                mean[p] += coeff[i] * o;
+                cov[p] += coeff[rows + i] * o;
+            }
+        }
+    }
+    if (_rank > 0) {
+        accumulate_sketch(data, rows, cols, mean,
+                          weights.empty() ? nullptr : weights.data(),
+                          _test_matrix->data(), _rank, batch._sketch.data());
+    }
+    merge(batch);
+}
+
+auto SRAccumulator::merge(SRAccumulator const& other) -> void
+{
+    TCM_CHECK(size() == other.size() && _test_matrix == other._test_matrix,
+              std::invalid_argument,
+              "accumulators must be obtained from the same one");
+    if (other._count == 0) { return; }
+    auto const weight = _weight + other._weight;
+    auto const ratio  = other._weight / weight;
+    auto const scale  = _weight * ratio; // w_a w_b / (w_a + w_b)
+    auto const delta_energy = other._energy - _energy;
+
+    // δ = ⟨O⟩_b - ⟨O⟩_a contributes scale·Re[δᴴδ] to S and
+    // scale·δE*δ to the covariance
+    aligned_vector<complex_type> delta(size());
+    for (auto p = size_t{0}; p < size(); ++p) {
+        delta[p] = other._derivatives[p] - _derivatives[p];
+        _covariance[p] += other._covariance[p]
+                          + scale * std::conj(delta_energy) * delta[p];
+        _derivatives[p] += ratio * delta[p];
+    }
+    if (_rank > 0) {
+        auto const*                  omega = _test_matrix->data();
+        aligned_vector<complex_type> projection(_rank); // δ Ω
+        for (auto p = size_t{0}; p < size(); ++p) {
+            for (auto j = size_t{0}; j < _rank; ++j) {
+                projection[j] += delta[p] * omega[p * _rank + j];
+            }
+        }
+        for (auto p = size_t{0}; p < size(); ++p) {
+            auto*       row       = _sketch.data() + p * _rank;
+            auto const* other_row = other._sketch.data() + p * _rank;
+            for (auto j = size_t{0}; j < _rank; ++j) {
+                row[j] += other_row[j]
+                          + scale
+                                * (delta[p].real() * projection[j].real()
+                                   + delta[p].imag() * projection[j].imag());
+            }
+        }
+    }
+    _energy_m2 += other._energy_m2 + scale * std::norm(delta_energy);
+    _energy += ratio * delta_energy;
+    _weight = weight;
+    _count += other._count;
+}
+
+auto SRAccumulator::variance() const noexcept -> real_type
+{
+    return _count > 0 ? _energy_m2 / _weight : real_type{0};
+}
+
+auto SRAccumulator::gradient() const -> aligned_vector<real_type>
+{
+    aligned_vector<real_type> force(size());
+    if (_count == 0) { return force; }
+    for (auto p = size_t{0}; p < size(); ++p) {
+        force[p] = real_type{2} * _covariance[p].real() / _weight;
+    }
+    return force;
+}
+
+auto SRAccumulator::test_matrix() const noexcept -> gsl::span<real_type const>
+{
+    if (_test_matrix == nullptr) { return {}; }
+    return *_test_matrix;
+}
+
+auto SRAccumulator::sketch() const -> aligned_vector<real_type>
+{
+    aligned_vector<real_type> out{_sketch};
+    if (_count == 0) { return out; }
+    for (auto& x : out) {
+        x /= _weight;
+    }
+    return out;
+}
+
+NystromApproximation::NystromApproximation(gsl::span<real_type const> omega,
+                                           gsl::span<real_type const> sketch,
+                                           size_t const size, size_t const rank)
+    : _size{size}
+    , _rank{rank}
+    , _sketch{sketch.begin(), sketch.end()}
+    , _core(rank * rank)
+    , _gram(rank * rank)
+{
+    TCM_CHECK(rank > 0 && rank <= size, std::invalid_argument,
+              fmt::format("invalid rank: {}; expected a number in [1, {}]",
+                          rank, size));
+    TCM_CHECK(omega.size() == size * rank && sketch.size() == size * rank,
+              std::invalid_argument,
+              fmt::format("omega and sketch have wrong sizes: {} and {}; "
+                          "expected {}x{}",
+                          omega.size(), sketch.size(), size, rank));
+    TCM_CHECK(size <= static_cast<size_t>(std::numeric_limits<int>::max()),
+              std::overflow_error,
+              fmt::format("too many parameters: {}", size));
+    auto const n = static_cast<int>(size);
+    auto const r = static_cast<int>(rank);
+    cblas_dgemm(CblasRowMajor, CblasTrans, CblasNoTrans, r, r, n,
+                /*alpha=*/1.0, omega.data(), r, _sketch.data(), r,
+                /*beta=*/0.0, _core.data(), r);
+    cblas_dsyrk(CblasRowMajor, CblasUpper, CblasTrans, r, n, /*alpha=*/1.0,
+                _sketch.data(), r, /*beta=*/0.0, _gram.data(), r);
+    // ΩᵀSΩ is symmetric up to rounding errors, and dsyrk only updates the
+    // upper triangle
+    for (auto i = size_t{0}; i < rank; ++i) {
+        for (auto j = size_t{0}; j < i; ++j) {
+            auto const x = real_type{0.5}
+                           * (_core[i * rank + j] + _core[j * rank + i]);
+            _core[i * rank + j] = x;
+            _core[j * rank + i] = x;
+            _gram[i * rank + j] = _gram[j * rank + i];
+        }
+    }
+}
+
+NystromApproximation::NystromApproximation(SRMatrix const& matrix,
+                                           size_t const    rank,
+                                           RandomGenerator& generator)
+    : NystromApproximation{[&matrix, rank, &generator]() {
+        aligned_vector<real_type> omega(matrix.size() * rank);
+        std::normal_distribution<real_type> dist;
+        for (auto& x : omega) {
+            x = dist(generator);
+        }
+        auto sketch = matrix.sketch(omega, rank);
+        return NystromApproximation{omega, sketch, matrix.size(), rank};
+    }()}
+{}
+
+NystromApproximation::NystromApproximation(SRAccumulator const& accumulator)
+    : NystromApproximation{accumulator.test_matrix(), accumulator.sketch(),
+                           accumulator.size(), accumulator.rank()}
+{}
+
+auto NystromApproximation::solve(gsl::span<real_type const> force,
+                                 real_type const shift) const
+    -> aligned_vector<real_type>
+{
+    TCM_CHECK(force.size() == _size, std::invalid_argument,
+              fmt::format("force has wrong length: {}; expected {}",
+                          force.size(), _size));
+    TCM_CHECK(shift > real_type{0}, std::invalid_argument,
+              fmt::format("invalid shift: {}; expected a positive number",
+                          shift));
+    auto const n = static_cast<int>(_size);
+    auto const r = static_cast<int>(_rank);
+    // K = λΩᵀY + YᵀY. Directions in the null space of Y do not contribute
+    // to Y K⁻¹ Yᵀ, so a tiny regularisation makes K safely invertible.
+    aligned_vector<real_type> matrix(_rank * _rank);
+    auto trace = real_type{0};
+    for (auto i = size_t{0}; i < matrix.size(); ++i) {
+        matrix[i] = shift * _core[i] + _gram[i];
+    }
+    for (auto i = size_t{0}; i < _rank; ++i) {
+        trace += matrix[i * _rank + i];
+    }
+    auto const jitter =
+        std::numeric_limits<real_type>::epsilon()
+        * std::max(trace, std::numeric_limits<real_type>::min());
+    for (auto i = size_t{0}; i < _rank; ++i) {
+        matrix[i * _rank + i] += jitter;
+    }
+    // z = K⁻¹ Yᵀf
+    aligned_vector<real_type> z(_rank);
+    cblas_dgemv(CblasRowMajor, CblasTrans, n, r, /*alpha=*/1.0,
+                _sketch.data(), r, force.data(), 1, /*beta=*/0.0, z.data(),
+                1);
+    cholesky_solve(matrix, z);
+    // x = (f - Y z) / λ
+    aligned_vector<real_type> x{force.begin(), force.end()};
+    cblas_dgemv(CblasRowMajor, CblasNoTrans, n, r, /*alpha=*/-1.0,
+                _sketch.data(), r, z.data(), 1, /*beta=*/1.0, x.data(), 1);
+    for (auto& y : x) {
+        y /= shift;
+    }
+    return x;
+}
+
+auto bind_sr(PyObject* module) -> void
+{
+    namespace py = pybind11;
+    auto m       = py::module{py::reinterpret_borrow<py::object>(module)};
+
+    using DerivativesArray =
+        py::array_t<std::complex<float>, py::array::c_style>;
+    using RealArray =
+        py::array_t<real_type, py::array::c_style | py::array::forcecast>;
+    using ComplexArray =
+        py::array_t<complex_type, py::array::c_style | py::array::forcecast>;
+
+    auto const to_span = [](auto const& xs) {
+        TCM_CHECK(xs.ndim() == 1, std::domain_error,
+                  fmt::format("expected a 1-dimensional array, but got an "
+                              "array of dimension {}",
+                              xs.ndim()));
+        return gsl::span<std::remove_const_t<
+            std::remove_pointer_t<decltype(xs.data())>> const>{
+            xs.data(), static_cast<size_t>(xs.shape(0))};
+    };
+    auto const to_weights = [to_span](optional<RealArray> const& weights) {
+        return weights.has_value() ? to_span(*weights)
+                                   : gsl::span<real_type const>{};
+    };
+    auto const check_derivatives = [](DerivativesArray const& derivatives) {
+        TCM_CHECK(derivatives.ndim() == 2, std::domain_error,
+                  fmt::format("derivatives has wrong number of dimensions: "
+                              "{}; expected 2",
+                              derivatives.ndim()));
+        return std::make_tuple(static_cast<size_t>(derivatives.shape(0)),
+                               static_cast<size_t>(derivatives.shape(1)));
+    };
+
+    m.def(
+        "center_derivatives",
+        [to_weights, check_derivatives](DerivativesArray      derivatives,
+                                        optional<RealArray> weights) {
+            auto const [rows, cols] = check_derivatives(derivatives);
+            center_derivatives({derivatives.mutable_data(), rows * cols}, rows,
+                               cols, to_weights(weights));
+        },
+        py::arg{"derivatives"}.noconvert(), py::arg{"weights"} = py::none(),
+        R"EOF(
+            Centres logarithmic derivatives in place.
+
+            :param derivatives: a C-contiguous ``complex64`` matrix of shape
+                ``(#samples, #parameters)``.
+            :param weights: normalised probabilities of samples, or ``None``
+                if samples come from Monte Carlo sampling.
+        )EOF");
+
+    py::class_<SRMatrix>(m, "SRMatrix", R"EOF(
+        Stochastic reconfiguration matrix ``S = Re[Oᴴ W O]`` for **centered**
+        logarithmic derivatives ``O`` which is applied without forming it
+        explicitly. ``O`` is not copied.
+        )EOF")
+        .def(py::init([check_derivatives, to_weights](
+                          DerivativesArray derivatives,
+                          optional<RealArray> weights) {
+                 auto const [rows, cols] = check_derivatives(derivatives);
+                 return std::make_unique<SRMatrix>(
+                     gsl::span<std::complex<float> const>{derivatives.data(),
+                                                          rows * cols},
+                     rows, cols, to_weights(weights));
+             }),
+             py::arg{"derivatives"}.noconvert(),
+             py::arg{"weights"} = py::none(), py::keep_alive<1, 2>())
+        .def("__len__", &SRMatrix::size)
+        .def_property_readonly("diagonal",
+                               [](SRMatrix const& self) {
+                                   auto const d = self.diagonal();
+                                   return to_numpy_array(
+                                       aligned_vector<real_type>{d.begin(),
+                                                                 d.end()});
+                               })
+        .def(
+            "__matmul__",
+            [to_span](SRMatrix const& self, RealArray x) {
+                aligned_vector<real_type> y(self.size());
+                self(to_span(x), y);
+                return to_numpy_array(std::move(y));
+            },
+            py::arg{"x"}, R"EOF(Computes ``S x``.)EOF")
+        .def(
+            "gradient",
+            [to_span](SRMatrix const& self, ComplexArray local_energies) {
+                return to_numpy_array(
+                    self.gradient(to_span(local_energies)));
+            },
+            py::arg{"local_energies"},
+            R"EOF(Computes the energy gradient ``2 Re[Oᵀ W E*]``.)EOF")
+        .def(
+            "dense",
+            [](SRMatrix const& self) {
+                auto const n = static_cast<py::ssize_t>(self.size());
+                return to_numpy_array(self.dense()).attr("reshape")(n, n);
+            },
+            R"EOF(
+                Forms ``S`` explicitly using blocked ``dsyrk``. Only use this
+                when ``S`` fits into memory.
+            )EOF")
+        .def(
+            "solve",
+            [to_span](SRMatrix const& self, RealArray force,
+                      real_type const shift, real_type const tolerance,
+                      unsigned const max_iterations) {
+                auto [x, iterations, residual] =
+                    solve_sr(self, to_span(force),
+                             CGOptions{shift, tolerance, max_iterations});
+                return py::make_tuple(to_numpy_array(std::move(x)), iterations,
+                                      residual);
+            },
+            py::arg{"force"}, py::arg{"shift"} = 1e-2,
+            py::arg{"tolerance"} = 1e-7, py::arg{"max_iterations"} = 1000,
+            R"EOF(
+                Solves ``(S + shift) x = force`` using conjugate gradient with
+                Jacobi preconditioning.
+
+                :return: a tuple ``(x, iterations, relative_residual)``.
+            )EOF");
+
+    py::class_<SRAccumulator>(m, "SRAccumulator", R"EOF(
+        Streaming estimators of the energy, its variance, and the energy
+        gradient (and optionally of a sketch ``S Ω`` of the SR matrix).
+        Batches of samples are added with :py:meth:`update` and never stored.
+        )EOF")
+        .def(py::init([](size_t const number_parameters,
+                         size_t const sketch_rank) {
+                 return std::make_unique<SRAccumulator>(number_parameters,
+                                                        sketch_rank);
+             }),
+             py::arg{"number_parameters"}, py::arg{"sketch_rank"} = 0)
+        .def("__len__", &SRAccumulator::size)
+        .def_property_readonly("count", &SRAccumulator::count)
+        .def_property_readonly("rank", &SRAccumulator::rank)
+        .def_property_readonly("energy", &SRAccumulator::energy)
+        .def_property_readonly("variance", &SRAccumulator::variance)
+        .def_property_readonly("derivatives",
+                               [](SRAccumulator const& self) {
+                                   auto const d = self.derivatives();
+                                   return to_numpy_array(
+                                       aligned_vector<complex_type>{
+                                           d.begin(), d.end()});
+                               })
+        .def_property_readonly("gradient",
+                               [](SRAccumulator const& self) {
+                                   return to_numpy_array(self.gradient());
+                               })
+        .def_property_readonly(
+            "test_matrix",
+            [](SRAccumulator const& self) {
+                auto const omega = self.test_matrix();
+                return to_numpy_array(aligned_vector<real_type>{
+                                          omega.begin(), omega.end()})
+                    .attr("reshape")(self.size(), self.rank());
+            })
+        .def_property_readonly("sketch",
+                               [](SRAccumulator const& self) {
+                                   return to_numpy_array(self.sketch())
+                                       .attr("reshape")(self.size(),
+                                                        self.rank());
+                               })
+        .def(
+            "update",
+            [check_derivatives, to_span, to_weights](
+                SRAccumulator& self, DerivativesArray derivatives,
+                ComplexArray local_energies, optional<RealArray> weights) {
+                auto const [rows, cols] = check_derivatives(derivatives);
+                self.update({derivatives.data(), rows * cols}, rows,
+                            to_span(local_energies), to_weights(weights));
+            },
+            py::arg{"derivatives"}.noconvert(), py::arg{"local_energies"},
+            py::arg{"weights"} = py::none(),
+            R"EOF(
+                Adds a batch of samples.
+
+                :param derivatives: a C-contiguous ``complex64`` matrix of
+                    **not** centered logarithmic derivatives of shape
+                    ``(#samples, #parameters)``.
+                :param local_energies: local energies of the samples.
+                :param weights: probabilities of samples (with the same
+                    normalisation for all batches), or ``None`` if samples
+                    come from Monte Carlo sampling.
+            )EOF")
+        .def("merge", &SRAccumulator::merge, py::arg{"other"},
+             R"EOF(Adds all samples from ``other``.)EOF")
+        .def("__copy__",
+             [](SRAccumulator const& self) { return SRAccumulator{self}; });
+
+    py::class_<NystromApproximation>(m, "NystromApproximation", R"EOF(
+        Randomized Nyström approximation ``Y (ΩᵀY)⁺ Yᵀ`` of the SR matrix
+        ``S`` where ``Y = S Ω`` for a random Gaussian ``Ω``. It needs
+        ``O(#parameters x rank)`` memory.
+        )EOF")
+        .def(py::init([](SRMatrix const& matrix, size_t const rank) {
+                 return std::make_unique<NystromApproximation>(matrix, rank);
+             }),
+             py::arg{"matrix"}, py::arg{"rank"})
+        .def(py::init<SRAccumulator const&>(), py::arg{"accumulator"})
+        .def("__len__", &NystromApproximation::size)
+        .def_property_readonly("rank", &NystromApproximation::rank)
+        .def(
+            "solve",
+            [to_span](NystromApproximation const& self, RealArray force,
+                      real_type const shift) {
+                return to_numpy_array(self.solve(to_span(force), shift));
+            },
+            py::arg{"force"}, py::arg{"shift"} = 1e-2,
+            R"EOF(
+                Solves ``(Ŝ + shift) x = force`` using the Woodbury identity.
+            )EOF");
+}
+
+TCM_NAMESPACE_END
@@ -0,0 +1,255 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+
+#include "common.hpp"
+#include "config.hpp"
+#include "errors.hpp"
+#include "random.hpp"
+#include "scratch.hpp"
+#include "spin.hpp"
+
+#include <gsl/gsl-lite.hpp>
+
+#include <complex>
+#include <memory>
+#include <tuple>
+
+TCM_NAMESPACE_BEGIN
+
+/// Centres logarithmic derivatives in place, i.e. performs
+/// `Oᵢₚ ← Oᵢₚ - ∑ⱼ wⱼOⱼₚ` for every column `p`.
+///
+/// \param derivatives Row-major `rows x cols` matrix `O`.
+/// \param weights     Weights `w` (one per row, normalised internally) or an
+///                    empty span for Monte Carlo samples (i.e. `wᵢ = 1/rows`).
+auto center_derivatives(gsl::span<std::complex<float>> derivatives,
+                        size_t rows, size_t cols,
+                        gsl::span<real_type const> weights) -> void;
+
+struct CGOptions {
+    real_type shift          = 1e-2; ///< Diagonal shift `λ` in `(S + λ)x = f`
+    real_type tolerance      = 1e-7; ///< Relative residual tolerance
+    unsigned  max_iterations = 1000;
+};
+
+/// \brief The stochastic reconfiguration matrix
+///
+///     S = Re[Oᴴ W O],  W = diag(w),
+///
+/// for **centered** logarithmic derivatives `O`, which is never formed
+/// explicitly unless #dense is called.
+///
+/// `O` is not copied, i.e. it must outlive the #SRMatrix.
+class SRMatrix {
+  private:
+    std::complex<float> const*         _derivatives; ///< Row-major `O`
+    size_t                             _rows;
+    size_t                             _cols;
+    aligned_vector<real_type>          _weights;  ///< Always normalised
+    aligned_vector<real_type>          _diagonal; ///< `Sₚₚ`
+    mutable ScratchBuffer<complex_type> _product; ///< Buffer for `W O x`
+
+  public:
+    SRMatrix(gsl::span<std::complex<float> const> derivatives, size_t rows,
+             size_t cols, gsl::span<real_type const> weights);
+
+    SRMatrix(SRMatrix const&) = default;
+    SRMatrix(SRMatrix&&)      = default;
+    SRMatrix& operator=(SRMatrix const&) = default;
+    SRMatrix& operator=(SRMatrix&&) = default;
+
+    /// Returns the number of variational parameters.
+    auto size() const noexcept -> size_t { return _cols; }
+    auto number_samples() const noexcept -> size_t { return _rows; }
+
+    auto diagonal() const noexcept -> gsl::span<real_type const>
+    {
+        return _diagonal;
+    }
+
+    /// Computes `y = S x` as `Re[Oᴴ (W (O x))]` without forming `S`. This
+    /// requires two passes over `O` and no extra memory besides a vector of
+    /// length `number_samples()`.
+    auto operator()(gsl::span<real_type const> x, gsl::span<real_type> y) const
+        -> void;
+
+    /// Computes the energy gradient `f = 2 Re[Oᵀ W E*]`.
+    auto gradient(gsl::span<complex_type const> local_energies) const
+        -> aligned_vector<real_type>;
+
+    /// Forms `S` explicitly (row-major `size() x size()`).
+    ///
+    /// `O` is split into row blocks which are converted to real form and
+    /// accumulated into `S` using BLAS' `dsyrk`. Only use this when `S`
+    /// fits into memory.
+    auto dense() const -> aligned_vector<real_type>;
+
+    /// Computes `S Ω` for a row-major `size() x rank` matrix `Ω` (the result
+    /// is row-major `size() x rank` too). Cost is `O(number_samples() x
+    /// size() x rank)`.
+    auto sketch(gsl::span<real_type const> omega, size_t rank) const
+        -> aligned_vector<real_type>;
+};
+
+/// Solves `(S + λ)x = f` using conjugate gradient with Jacobi
+/// preconditioning, i.e. `M = diag(S) + λ`. `λ` must be positive. If CG
+/// breaks down, the current iterate is returned, i.e. callers should check
+/// the residual.
+///
+/// \return A tuple `(x, iterations, relative_residual)`.
+auto solve_sr(SRMatrix const& matrix, gsl::span<real_type const> force,
+              CGOptions const& options)
+    -> std::tuple<aligned_vector<real_type>, unsigned, real_type>;
+
+/// \brief Streaming estimators of the quantities needed for SR.
+///
+/// Every batch of samples is reduced to
+///
+///     ⟨E⟩,  ∑ᵢwᵢ|Eᵢ - ⟨E⟩|²,  ⟨O⟩,  and  ∑ᵢwᵢ(Eᵢ - ⟨E⟩)*(Oᵢ - ⟨O⟩)
+///
+/// (and optionally a sketch `S Ω` of the SR matrix for a random Gaussian
+/// `Ω`) which are then combined with the accumulated ones using the pairwise
+/// formulas of Chan, Golub & LeVeque. Hence, `O` is never materialised for
+/// more than one batch and memory usage is independent of the number of
+/// samples: `O(params)` (or `O(params x rank)` with a sketch).
+class SRAccumulator {
+  private:
+    using TestMatrix = std::shared_ptr<aligned_vector<real_type> const>;
+
+    uint64_t                     _count;
+    real_type                    _weight;      ///< ∑ᵢwᵢ
+    complex_type                 _energy;      ///< ⟨E⟩
+    real_type                    _energy_m2;   ///< ∑ᵢwᵢ|Eᵢ - ⟨E⟩|²
+    aligned_vector<complex_type> _derivatives; ///< ⟨O⟩
+    aligned_vector<complex_type> _covariance;  ///< ∑ᵢwᵢ(Eᵢ - ⟨E⟩)*(Oᵢ - ⟨O⟩)
+    size_t                       _rank;
+    TestMatrix                   _test_matrix; ///< Row-major `params x rank`
+    aligned_vector<real_type> _sketch; ///< ∑ᵢwᵢRe[(Oᵢ - ⟨O⟩)ᴴ(Oᵢ - ⟨O⟩)] Ω
+
+    SRAccumulator(size_t number_parameters, size_t rank, TestMatrix matrix);
+
+  public:
+    /// \param number_parameters Number of variational parameters.
+    /// \param sketch_rank       Number of columns of `Ω`; `0` disables
+    ///                          sketching.
+    explicit SRAccumulator(
+        size_t number_parameters, size_t sketch_rank = 0,
+        RandomGenerator& generator = global_random_generator());
+
+    SRAccumulator(SRAccumulator const&) = default;
+    SRAccumulator(SRAccumulator&&)      = default;
+    SRAccumulator& operator=(SRAccumulator const&) = default;
+    SRAccumulator& operator=(SRAccumulator&&) = default;
+
+    /// Adds a batch of samples.
+    ///
+    /// \param derivatives    Row-major `rows x size()` matrix of (not
+    ///                       centered) logarithmic derivatives.
+    /// \param local_energies Local energies `Eᵢ` (one per row).
+    /// \param weights        Weights `wᵢ` or an empty span for Monte Carlo
+    ///                       samples (i.e. `wᵢ = 1`). Weights of different
+    ///                       batches must have the same normalisation.
+    auto update(gsl::span<std::complex<float> const> derivatives, size_t rows,
+                gsl::span<complex_type const>  local_energies,
+                gsl::span<real_type const>     weights) -> void;
+
+    /// Adds all samples from `other`. Both accumulators must have been
+    /// obtained from the same one (i.e. share `Ω`).
+    auto merge(SRAccumulator const& other) -> void;
+
+    auto size() const noexcept -> size_t { return _derivatives.size(); }
+    auto count() const noexcept -> uint64_t { return _count; }
+    auto rank() const noexcept -> size_t { return _rank; }
+    auto energy() const noexcept -> complex_type { return _energy; }
+
+    /// Returns `∑ᵢwᵢ|Eᵢ - ⟨E⟩|² / ∑ᵢwᵢ`.
+    auto variance() const noexcept -> real_type;
+
+    /// Returns `⟨O⟩`.
+    auto derivatives() const noexcept -> gsl::span<complex_type const>
+    {
+        return _derivatives;
+    }
+
+    /// Returns the energy gradient `f = 2 Re[⟨(E - ⟨E⟩)* (O - ⟨O⟩)⟩]`.
+    auto gradient() const -> aligned_vector<real_type>;
+
+    /// Returns `Ω`.
+    auto test_matrix() const noexcept -> gsl::span<real_type const>;
+
+    /// Returns `S Ω` (row-major `size() x rank()`).
+    auto sketch() const -> aligned_vector<real_type>;
+};
+
+/// \brief Randomized Nyström approximation `Ŝ = Y (ΩᵀY)⁺ Yᵀ` of the SR
+/// matrix, where `Y = S Ω` for a random Gaussian `size() x rank()` matrix `Ω`.
+///
+/// Only `Y` and two `rank() x rank()` matrices are stored, i.e. memory usage
+/// is `O(params x rank)` instead of `O(params²)`.
+class NystromApproximation {
+  private:
+    size_t                    _size;
+    size_t                    _rank;
+    aligned_vector<real_type> _sketch; ///< `Y`, row-major `size() x rank()`
+    aligned_vector<real_type> _core;   ///< `ΩᵀY`
+    aligned_vector<real_type> _gram;   ///< `YᵀY`
+
+  public:
+    NystromApproximation(gsl::span<real_type const> omega,
+                         gsl::span<real_type const> sketch, size_t size,
+                         size_t rank);
+
+    /// Sketches `matrix` using a random Gaussian `Ω`.
+    NystromApproximation(
+        SRMatrix const& matrix, size_t rank,
+        RandomGenerator& generator = global_random_generator());
+
+    /// Uses the sketch collected by `accumulator`.
+    explicit NystromApproximation(SRAccumulator const& accumulator);
+
+    NystromApproximation(NystromApproximation const&) = default;
+    NystromApproximation(NystromApproximation&&)      = default;
+    NystromApproximation& operator=(NystromApproximation const&) = default;
+    NystromApproximation& operator=(NystromApproximation&&) = default;
+
+    auto size() const noexcept -> size_t { return _size; }
+    auto rank() const noexcept -> size_t { return _rank; }
+
+    /// Solves `(Ŝ + λ)x = f` using the Woodbury identity
+    ///
+    ///     (λ + Y (ΩᵀY)⁻¹ Yᵀ)⁻¹ = λ⁻¹ (1 - Y (λΩᵀY + YᵀY)⁻¹ Yᵀ).
+    ///
+    /// Only a `rank() x rank()` system has to be factorised.
+    auto solve(gsl::span<real_type const> force, real_type shift) const
+        -> aligned_vector<real_type>;
+};
+
+auto bind_sr(PyObject*) -> void;
+
+TCM_NAMESPACE_END
@@ -0,0 +1,422 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#include "symmetry.hpp"
+#include "parallel.hpp"
+#include <pybind11/complex.h>
+#include <pybind11/numpy.h>
+#include <pybind11/stl.h>
+
+#include <map>
+#include <numeric>
+
+TCM_NAMESPACE_BEGIN
+
+namespace {
+/// Characters are products of many complex exponentials, so we compare them
+/// with some tolerance.
+constexpr auto character_tolerance = real_type{1e-7};
+
+auto check_generator(unsigned const                  number_spins,
+                     SymmetryGroup::Generator const& generator) -> void
+{
+    auto const& permutation = generator.permutation;
+    TCM_CHECK(permutation.size() == number_spins, std::invalid_argument,
+              fmt::format("permutation has wrong length: {}; expected {}",
+                          permutation.size(), number_spins));
+    std::vector<bool> seen(number_spins, false);
+    for (auto const i : permutation) {
+        TCM_CHECK(i < number_spins && !seen[i], std::invalid_argument,
+                  fmt::format("invalid permutation: index {} is either out of "
+                              "bounds or repeated",
+                              i));
+        seen[i] = true;
+    }
+    TCM_CHECK(std::abs(std::abs(generator.character) - real_type{1})
+                  < character_tolerance,
+              std::invalid_argument,
+              fmt::format("invalid character ({}, {}); expected a complex "
+                          "number of unit norm",
+                          generator.character.real(),
+                          generator.character.imag()));
+}
+
+/// Pascal's triangle up to `n = 64`, i.e. everything that fits into
+/// `uint64_t`.
+auto binomial(unsigned const n, unsigned const k) noexcept -> uint64_t
+{
+    static auto const table = []() {
+        std::array<std::array<uint64_t, 65>, 65> t{};
+        for (auto i = 0u; i <= 64u; ++i) {
+            t[i][0] = 1;
+            for (auto j = 1u; j <= i; ++j) {
+                t[i][j] = t[i - 1][j - 1] + t[i - 1][j];
+            }
+        }
+        return t;
+    }();
+    TCM_ASSERT(n <= 64, "index out of bounds");
+    return k <= n ? table[n][k] : 0;
+}
+
+/// Returns the `rank`'th (counting from zero, in increasing order) integer
+/// with exactly `k` bits set among the lower `n` ones. This is the
+/// combinatorial number system.
+auto unrank_combination(unsigned const n, unsigned const k, uint64_t rank)
+    TCM_NOEXCEPT -> uint64_t
+{
+    TCM_ASSERT(rank < binomial(n, k), "rank out of bounds");
+    auto x = uint64_t{0};
+    auto c = n;
+    for (auto i = k; i > 0; --i) {
+        do {
+            --c;
+        } while (binomial(c, i) > rank);
+        x |= uint64_t{1} << c;
+        rank -= binomial(c, i);
+    }
+    return x;
+}
+
+/// Returns the next integer with the same number of bits set (Gosper's hack).
+constexpr auto next_combination(uint64_t const v) noexcept -> uint64_t
+{
+    auto const t = v | (v - 1);
+    return (t + 1)
+           | (((~t & (~t + 1)) - 1)
+              >> (static_cast<unsigned>(__builtin_ctzll(v)) + 1));
+}
+} // namespace
+
+SymmetryGroup::SymmetryGroup(unsigned const             number_spins,
+                             gsl::span<Generator const> generators)
+    : _permutations{}, _flips{}, _characters{}, _number_spins{number_spins}
+{
+    TCM_CHECK(number_spins <= SpinVector::max_size(), std::overflow_error,
+              fmt::format("invalid number_spins: {}; expected <={}",
+                          number_spins, SpinVector::max_size()));
+    for (auto const& g : generators) {
+        check_generator(number_spins, g);
+    }
+
+    // Elements are added in breadth-first order, and each of them is
+    // multiplied by all the generators until no new elements appear.
+    std::map<std::pair<std::vector<uint16_t>, bool>, size_t> indices;
+    auto const add = [this, &indices](std::vector<uint16_t> permutation,
+                                      bool const            flip,
+                                      complex_type const    character) {
+        auto const [where, inserted] = indices.emplace(
+            std::make_pair(std::move(permutation), flip), _characters.size());
+        if (!inserted) {
+            auto const existing = _characters[where->second];
+            TCM_CHECK(std::abs(existing - character) < character_tolerance,
+                      std::invalid_argument,
+                      fmt::format("characters are inconsistent with the group "
+                                  "structure: the same element has characters "
+                                  "({}, {}) and ({}, {})",
+                                  existing.real(), existing.imag(),
+                                  character.real(), character.imag()));
+            return;
+        }
+        TCM_CHECK(_characters.size() < max_size, std::overflow_error,
+                  fmt::format("symmetry group is too big; expected at most {} "
+                              "elements",
+                              max_size));
+        auto const& p = where->first.first;
+        _permutations.insert(std::end(_permutations), std::begin(p),
+                             std::end(p));
+        _flips.push_back(flip);
+        _characters.push_back(character);
+    };
+
+    std::vector<uint16_t> identity(number_spins);
+    std::iota(std::begin(identity), std::end(identity), uint16_t{0});
+    add(std::move(identity), false, complex_type{1, 0});
+    for (auto i = size_t{0}; i < size(); ++i) {
+        for (auto const& g : generators) {
+            // `g` is applied after the `i`'th element
+            std::vector<uint16_t> permutation(number_spins);
+            auto const* p = _permutations.data() + i * number_spins;
+            for (auto k = 0u; k < number_spins; ++k) {
+                permutation[k] = g.permutation[p[k]];
+            }
+            add(std::move(permutation), (_flips[i] != 0) != g.flip,
+                _characters[i] * g.character);
+        }
+    }
+}
+
+auto SymmetryGroup::canonicalise(SpinVector const& spin) const TCM_NOEXCEPT
+    -> Canonical
+{
+    auto const less  = LexicographicLess{};
+    auto       best  = spin;
+    auto       phase = complex_type{1, 0};
+    auto       norm  = complex_type{0, 0};
+    for (auto i = size_t{0}; i < size(); ++i) {
+        auto const s = apply(i, spin);
+        if (less(s, best)) {
+            best  = s;
+            phase = std::conj(_characters[i]);
+        }
+        if (s == spin) { norm += std::conj(_characters[i]); }
+    }
+    auto const n = norm.real() / static_cast<real_type>(size());
+    return {best, phase, n > character_tolerance ? n : real_type{0}};
+}
+
+auto SymmetryGroup::canonicalise(gsl::span<SpinVector const> spins,
+                                 gsl::span<Canonical>        out) const -> void
+{
+    TCM_CHECK(spins.size() == out.size(), std::invalid_argument,
+              fmt::format("sizes don't match: {} != {}", spins.size(),
+                          out.size()));
+    parallel_for(
+        0, static_cast<int64_t>(spins.size()),
+        [this, spins, out](auto const i) {
+            out[static_cast<size_t>(i)] =
+                canonicalise(spins[static_cast<size_t>(i)]);
+        },
+        /*cutoff=*/1024);
+}
+
+auto SymmetryGroup::is_representative(SpinVector const& spin) const
+    TCM_NOEXCEPT -> bool
+{
+    auto const less = LexicographicLess{};
+    auto       norm = complex_type{0, 0};
+    for (auto i = size_t{0}; i < size(); ++i) {
+        auto const s = apply(i, spin);
+        if (less(s, spin)) { return false; }
+        if (s == spin) { norm += std::conj(_characters[i]); }
+    }
+    return norm.real() / static_cast<real_type>(size()) > character_tolerance;
+}
+
+auto SymmetryGroup::representatives(optional<int> magnetisation) const
+    -> aligned_vector<SpinVector>
+{
+    auto const n = _number_spins;
+    TCM_CHECK(n <= 64, std::overflow_error,
+              fmt::format("enumerating representatives is only supported for "
+                          "systems of up to 64 spins, but number_spins={}",
+                          n));
+    TCM_CHECK(!magnetisation.has_value() || *magnetisation == 0
+                  || !has_spin_inversion(),
+              std::invalid_argument,
+              fmt::format("invalid magnetisation: {}; spin inversion only "
+                          "preserves the zero magnetisation sector",
+                          *magnetisation));
+    auto const k = magnetisation.has_value()
+                       ? optional<unsigned>{detail::number_ups_for(
+                           n, *magnetisation)}
+                       : nullopt;
+    TCM_CHECK(k.has_value() || n < 64, std::overflow_error,
+              "too many spin configurations; please, specify magnetisation");
+    auto const total = k.has_value() ? binomial(n, *k) : uint64_t{1} << n;
+
+    // The range of ranks is split into chunks. Each chunk starts by unranking
+    // its first configuration and then steps to the next ones. Since both
+    // preserve the order, concatenating the chunks gives a sorted basis.
+    auto const number_chunks = std::min(total, uint64_t{1024});
+    std::vector<aligned_vector<SpinVector>> chunks(number_chunks);
+    parallel_for(
+        0, static_cast<int64_t>(number_chunks),
+        [this, n, k, total, number_chunks, &chunks](auto const chunk) {
+            auto const c     = static_cast<uint64_t>(chunk);
+            auto const size  = total / number_chunks;
+            auto const rest  = total % number_chunks;
+            auto const begin = c * size + std::min(c, rest);
+            auto const end   = begin + size + (c < rest);
+            auto       x = k.has_value() ? unrank_combination(n, *k, begin)
+                                         : begin;
+            auto&      out = chunks[c];
+            for (auto r = begin; r != end; ++r) {
+                if (r != begin) { x = k.has_value() ? next_combination(x) : r; }
+                auto const spin = SpinVector{n, x};
+                if (is_representative(spin)) { out.push_back(spin); }
+            }
+        });
+
+    aligned_vector<SpinVector> basis;
+    basis.reserve(std::accumulate(
+        std::begin(chunks), std::end(chunks), size_t{0},
+        [](auto const acc, auto const& x) { return acc + x.size(); }));
+    for (auto const& chunk : chunks) {
+        basis.insert(std::end(basis), std::begin(chunk), std::end(chunk));
+    }
+    return basis;
+}
+
+auto apply(SpinHamiltonian const& hamiltonian, SymmetryGroup const& group,
+           complex_type const coeff, SpinVector const spin, QuantumState& psi)
+    -> void
+{
+    TCM_ASSERT(group.is_representative(spin),
+               "spin is not a representative of the symmetry sector");
+    // H commutes with P, so H|σ̃⟩ = 1/‖P|σ⟩‖ ∑ᵢ cᵢ P|σᵢ⟩, and
+    // P|σᵢ⟩ = χ*(gᵢ) ‖P|rᵢ⟩‖ |r̃ᵢ⟩ where gᵢ|σᵢ⟩ = |rᵢ⟩.
+    auto const norm = group.canonicalise(spin).norm;
+    hamiltonian.for_each(spin, [&group, &psi, coeff, norm](
+                                   complex_type const c, SpinVector const s) {
+        auto const canonical = group.canonicalise(s);
+        if (canonical.norm > real_type{0}) {
+            psi += {coeff * c * canonical.phase
+                        * std::sqrt(canonical.norm / norm),
+                    canonical.representative};
+        }
+    });
+}
+
+auto bind_symmetry(PyObject* module) -> void
+{
+    namespace py = pybind11;
+    auto m       = py::module{py::reinterpret_borrow<py::object>(module)};
+
+    py::class_<SymmetryGroup, std::shared_ptr<SymmetryGroup>>(m, "SymmetryGroup",
+                                                              R"EOF(
+            Group of lattice symmetries (site permutations and, optionally,
+            global spin inversion) together with a one-dimensional
+            representation.
+        )EOF")
+        .def(py::init([](unsigned const                           number_spins,
+                         std::vector<std::vector<uint16_t>> const& permutations,
+                         optional<std::vector<complex_type>> const& characters,
+                         optional<int> const spin_inversion) {
+                 TCM_CHECK(!characters.has_value()
+                               || characters->size() == permutations.size(),
+                           std::invalid_argument,
+                           fmt::format("characters has wrong length: {}; "
+                                       "expected {}",
+                                       characters->size(),
+                                       permutations.size()));
+                 std::vector<SymmetryGroup::Generator> generators;
+                 for (auto i = size_t{0}; i < permutations.size(); ++i) {
+                     generators.push_back(
+                         {permutations[i], false,
+                          characters.has_value() ? (*characters)[i]
+                                                 : complex_type{1, 0}});
+                 }
+                 if (spin_inversion.has_value()) {
+                     TCM_CHECK(*spin_inversion == 1 || *spin_inversion == -1,
+                               std::invalid_argument,
+                               fmt::format("invalid spin_inversion: {}; "
+                                           "expected either 1 or -1",
+                                           *spin_inversion));
+                     std::vector<uint16_t> identity(number_spins);
+                     std::iota(std::begin(identity), std::end(identity),
+                               uint16_t{0});
+                     generators.push_back(
+                         {std::move(identity), true,
+                          complex_type{static_cast<real_type>(
+                              *spin_inversion)}});
+                 }
+                 return std::make_shared<SymmetryGroup>(number_spins,
+                                                        generators);
+             }),
+             py::arg{"number_spins"}, py::arg{"permutations"},
+             py::arg{"characters"} = py::none(),
+             py::arg{"spin_inversion"} = py::none(),
+             R"EOF(
+                 Generates a symmetry group.
+
+                 :param number_spins: number of sites in the lattice.
+                 :param permutations: a list of generators. Each generator is
+                                      a permutation ``p`` of sites: site ``i``
+                                      is mapped to ``p[i]``.
+                 :param characters: characters (i.e. eigenvalues) of the
+                                    generators. Defaults to all ones.
+                 :param spin_inversion: if not ``None``, global spin flip is
+                                        added to the generators with the given
+                                        character (``1`` or ``-1``).
+             )EOF")
+        .def("__len__", [](SymmetryGroup const& self) { return self.size(); })
+        .def_property_readonly("number_spins", &SymmetryGroup::number_spins)
+        .def(
+            "canonicalise",
+            [](SymmetryGroup const&                        self,
+               py::array_t<SpinVector, py::array::c_style> array) {
+                TCM_CHECK(array.ndim() == 1, std::domain_error,
+                          fmt::format("array has wrong number of dimensions: "
+                                      "{}; expected 1",
+                                      array.ndim()));
+                auto const size = static_cast<size_t>(array.shape(0));
+                std::vector<SymmetryGroup::Canonical> canonical(size);
+                self.canonicalise({array.data(), size}, canonical);
+
+                aligned_vector<SpinVector> representatives(size);
+                aligned_vector<complex_type> phases(size);
+                aligned_vector<real_type>    norms(size);
+                for (auto i = size_t{0}; i < size; ++i) {
+                    representatives[i] = canonical[i].representative;
+                    phases[i]          = canonical[i].phase;
+                    norms[i]           = canonical[i].norm;
+                }
+                return py::make_tuple(to_numpy_array(std::move(representatives)),
+                                      to_numpy_array(std::move(phases)),
+                                      to_numpy_array(std::move(norms)));
+            },
+            py::arg{"array"}.noconvert(),
+            R"EOF(
+                Computes orbit representatives of spin configurations.
+
+                :return: a tuple ``(representatives, phases, norms)`` such that
+                         ``P|σᵢ⟩ = phases[i] * sqrt(norms[i]) * |r̃ᵢ⟩``.
+                         ``norms[i] == 0`` means that ``σᵢ`` does not belong
+                         to the sector.
+            )EOF")
+        .def(
+            "representatives",
+            [](SymmetryGroup const& self, optional<int> magnetisation) {
+                return to_numpy_array(
+                    self.representatives(std::move(magnetisation)));
+            },
+            py::arg{"magnetisation"} = py::none(),
+            R"EOF(
+                Returns all representatives in the sector sorted in
+                lexicographic order. Only systems of up to 64 spins are
+                supported.
+            )EOF");
+
+    m.def(
+        "apply_symmetric",
+        [](SpinHamiltonian const& hamiltonian, SymmetryGroup const& group,
+           SpinVector const& spin) {
+            TCM_CHECK(group.is_representative(spin), std::invalid_argument,
+                      "spin is not a representative of the symmetry sector");
+            QuantumState psi;
+            apply(hamiltonian, group, complex_type{1, 0}, spin, psi);
+            return psi;
+        },
+        py::arg{"hamiltonian"}, py::arg{"group"}, py::arg{"spin"},
+        R"EOF(
+            Computes H|σ̃⟩ in the symmetrised basis. ``spin`` must be a
+            representative (see :py:meth:`SymmetryGroup.representatives`).
+        )EOF");
+}
+
+TCM_NAMESPACE_END
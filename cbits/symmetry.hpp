@@ -0,0 +1,160 @@
+// Copyright (c) 2019, Tom Westerhout
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// * Redistributions of source code must retain the above copyright notice, this
+//   list of conditions and the following disclaimer.
+//
+// * Redistributions in binary form must reproduce the above copyright notice,
+//   this list of conditions and the following disclaimer in the documentation
+//   and/or other materials provided with the distribution.
+//
+// * Neither the name of the copyright holder nor the names of its
+//   contributors may be used to endorse or promote products derived from
+//   this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+// DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+// FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+// DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+// SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+// CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+// OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#pragma once
+
+#include "common.hpp"
+#include "config.hpp"
+#include "errors.hpp"
+#include "polynomial.hpp"
+#include "sort.hpp"
+#include "spin.hpp"
+
+#include <gsl/gsl-lite.hpp>
+
+#include <algorithm>
+#include <tuple>
+#include <vector>
+
+TCM_NAMESPACE_BEGIN
+
+// [SymmetryGroup] {{{
+/// \brief A group of lattice symmetries together with a one-dimensional
+/// representation (i.e. a symmetry sector).
+///
+/// Every element `g` is a site permutation optionally followed by the global
+/// spin flip, and has a character `χ(g)`. The group is generated from a list
+/// of generators, so characters of all other elements follow from the
+/// characters of the generators.
+///
+/// Symmetrised basis states are `|r̃⟩ = P|r⟩ / ‖P|r⟩‖` where
+/// `P = 1/|G| ∑ χ*(g) g` is the projector onto the sector and `r` is the
+/// *representative* of its orbit: the lexicographically smallest (see
+/// #LexicographicLess) element of `{g|r⟩ : g ∈ G}`. Orbits for which
+/// `P|r⟩ = 0` do not contribute to the sector.
+class SymmetryGroup {
+  public:
+    struct Generator {
+        std::vector<uint16_t> permutation; ///< Site `i` is mapped to
+                                           ///< `permutation[i]`.
+        bool                  flip;      ///< Whether to flip all spins.
+        complex_type          character; ///< `χ(g)`. Should have unit norm.
+    };
+
+    /// Canonical form of a spin configuration `|σ⟩`.
+    struct Canonical {
+        SpinVector   representative; ///< `|r⟩`
+        complex_type phase;          ///< `χ*(g)` where `g|σ⟩ = |r⟩`
+        real_type    norm;           ///< `‖P|r⟩‖²`, zero if `|r⟩` does not
+                                     ///< belong to the sector.
+    };
+
+  private:
+    /// Permutations of all group elements stored one after another.
+    std::vector<uint16_t>     _permutations;
+    std::vector<uint8_t>      _flips;
+    std::vector<complex_type> _characters;
+    unsigned                  _number_spins;
+
+    /// Upper bound on the group size to detect run-away closures.
+    static constexpr size_t max_size = size_t{1} << 16;
+
+  public:
+    SymmetryGroup(unsigned number_spins, gsl::span<Generator const> generators);
+
+    SymmetryGroup(SymmetryGroup const&) = default;
+    SymmetryGroup(SymmetryGroup&&)      = default;
+    SymmetryGroup& operator=(SymmetryGroup const&) = default;
+    SymmetryGroup& operator=(SymmetryGroup&&) = default;
+
+    /// Returns the number of elements in the group.
+    auto size() const noexcept -> size_t { return _characters.size(); }
+
+    constexpr auto number_spins() const noexcept -> unsigned
+    {
+        return _number_spins;
+    }
+
+    /// Applies the `i`'th element of the group to `spin`.
+    auto apply(size_t const i, SpinVector const& spin) const TCM_NOEXCEPT
+        -> SpinVector
+    {
+        TCM_ASSERT(i < size(), "index out of bounds");
+        TCM_ASSERT(spin.size() == _number_spins, "spin has wrong size");
+        auto const permuted = spin.permuted(
+            {_permutations.data() + i * _number_spins, _number_spins});
+        return _flips[i] ? permuted.inverted() : permuted;
+    }
+
+    auto character(size_t const i) const TCM_NOEXCEPT -> complex_type
+    {
+        TCM_ASSERT(i < size(), "index out of bounds");
+        return _characters[i];
+    }
+
+    /// Returns whether the group contains global spin inversion. Such groups
+    /// only preserve the zero magnetisation sector.
+    auto has_spin_inversion() const noexcept -> bool
+    {
+        return std::any_of(std::begin(_flips), std::end(_flips),
+                           [](auto const flip) { return flip != 0; });
+    }
+
+    /// Finds the representative of the orbit of `spin`.
+    ///
+    /// \precondition `spin.size() == number_spins()`.
+    auto canonicalise(SpinVector const& spin) const TCM_NOEXCEPT -> Canonical;
+
+    /// Canonicalises a batch of spin configurations in parallel.
+    auto canonicalise(gsl::span<SpinVector const> spins,
+                      gsl::span<Canonical>        out) const -> void;
+
+    /// Returns whether `spin` is the representative of its orbit *and* its
+    /// orbit belongs to the sector.
+    auto is_representative(SpinVector const& spin) const TCM_NOEXCEPT -> bool;
+
+    /// Enumerates representatives of all orbits in the sector (optionally,
+    /// with fixed magnetisation) in lexicographic order.
+    ///
+    /// \note Only systems of up to 64 spins are supported.
+    /// \note If the group contains spin inversion, `magnetisation` must be
+    /// either `nullopt` or `0`.
+    auto representatives(optional<int> magnetisation) const
+        -> aligned_vector<SpinVector>;
+};
+// [SymmetryGroup] }}}
+
+/// Performs `|ψ⟩ += c * H|σ̃⟩` in the symmetrised basis, i.e. keys of `psi`
+/// are representatives.
+///
+/// \precondition `group.is_representative(spin)`
+auto apply(SpinHamiltonian const& hamiltonian, SymmetryGroup const& group,
+           complex_type coeff, SpinVector spin, QuantumState& psi) -> void;
+
+auto bind_symmetry(PyObject*) -> void;
+
+TCM_NAMESPACE_END
@@ -0,0 +1,3 @@
+#include "../../hamiltonian_io.hpp"
+
+auto main() -> int { return 0; }
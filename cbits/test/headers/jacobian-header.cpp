@@ -0,0 +1,3 @@
+#include "../../jacobian.hpp"
+
+auto main() -> int { return 0; }
@@ -0,0 +1,3 @@
+#include "../../lanczos.hpp"
+
+auto main() -> int { return 0; }
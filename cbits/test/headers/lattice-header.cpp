@@ -0,0 +1,3 @@
+#include "../../lattice.hpp"
+
+auto main() -> int { return 0; }
@@ -0,0 +1,3 @@
+#include "../../observable.hpp"
+
+auto main() -> int { return 0; }
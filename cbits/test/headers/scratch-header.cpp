@@ -0,0 +1,3 @@
+#include "../../scratch.hpp"
+
+auto main() -> int { return 0; }
@@ -0,0 +1,3 @@
+#include "../../sector.hpp"
+
+auto main() -> int { return 0; }
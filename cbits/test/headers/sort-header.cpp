@@ -0,0 +1,3 @@
+#include "../../sort.hpp"
+
+auto main() -> int { return 0; }
@@ -0,0 +1,3 @@
+#include "../../sr.hpp"
+
+auto main() -> int { return 0; }
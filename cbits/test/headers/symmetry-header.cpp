@@ -0,0 +1,3 @@
+#include "../../symmetry.hpp"
+
+auto main() -> int { return 0; }
@@ -5,7 +5,6 @@ import glob
 from math import sqrt
 from math import pi as PI
 import os
-import pickle
 import pwd
 import sys
 import tempfile
@@ -430,9 +429,9 @@ class Runner(object):
     def __load_exact(self):
         if self.config.exact is None:
             return None
-        _, y = _core.with_file_like(self.config.exact, "rb", pickle.load)
-        y = torch.from_numpy(y).squeeze()
-        x = _C.all_spins(self.mc_options.number_spins, self.mc_options.magnetisation)
+        x, y = _core.load_exact(self.config.exact)
+        x = np.array(x)
+        y = torch.from_numpy(np.array(y)).squeeze()
         dataset = _core.make_spin_dataloader(x, y, batch_size=2048)
         evaluator = create_supervised_evaluator(
             _core.combine_amplitude_and_sign(self.amplitude, self.sign),
@@ -459,7 +458,7 @@ class Runner(object):
             values = apply_polynomial(self.polynomial, spins, state)
             values = safe_real_exp(values)
 
-        size = len(set((_C.unsafe_get(spins, i) for i in range(len(spins)))))
+        size = len(_C.unique(spins))
         stop = time.time()
         tqdm.write(
             " Done in {:.2f} seconds. ".format(stop - start)
@@ -3,6 +3,7 @@ import torch
 from . import _C_nqs as _C
 from . import core
 from . import hamiltonian
+from . import observables
 from . import functional
 from . import rbm
 
@@ -31,7 +31,6 @@
 
 import os
 import sys
-import tempfile
 from typing import Optional, Tuple
 
 import numpy as np
@@ -313,6 +312,52 @@ def random_split(dataset, k, replacement=False, weights=None):
         ]
 
 
+def load_exact(filename: str) -> Tuple[np.ndarray, np.ndarray]:
+    r"""Loads exact ground state from ``filename``.
+
+    Two formats are supported: binary files written by ``_C.lanczos`` (in
+    which case spins and coefficients are memory-mapped rather than read)
+    and pickled ``(spins, coefficients)`` tuples.
+
+    Binary files must contain the ground state in the full magnetisation
+    sector, i.e. either no symmetries were used or ``_C.lanczos`` was called
+    with ``expand=True``. Files storing only symmetry representatives are
+    rejected, because their coefficients are not amplitudes of the listed
+    spin configurations.
+    """
+    with open(filename, "rb") as f:
+        header = f.read(64)
+    if len(header) == 64 and header[:7] == b"NQSGS\0\0":
+        if header[7:8] != b"\2":
+            raise ValueError(
+                "{!r} was written by an older version of _C.lanczos; please, "
+                "regenerate it".format(filename)
+            )
+        group_size = int(np.frombuffer(header, dtype=np.uint64, count=1, offset=32)[0])
+        if group_size != 1:
+            raise ValueError(
+                "{!r} contains only symmetry representatives (group of size {}); "
+                "please, regenerate it with _C.lanczos(..., expand=True)".format(
+                    filename, group_size
+                )
+            )
+        dimension = int(np.frombuffer(header, dtype=np.uint64, count=1, offset=16)[0])
+        spins = np.memmap(
+            filename, dtype=_C.CompactSpin.dtype, mode="r", offset=64, shape=(dimension,)
+        )
+        values = np.memmap(
+            filename,
+            dtype=np.float64,
+            mode="r",
+            offset=64 + spins.itemsize * dimension,
+            shape=(dimension,),
+        )
+        return spins, values
+    import pickle
+
+    return with_file_like(filename, "rb", pickle.load)
+
+
 def import_network(filename: str):
     r"""Loads ``Net`` class defined in Python source file ``filename``."""
     import importlib
@@ -498,7 +543,7 @@ def _forward_with_batches(state, input, batch_size):
 
 def local_energy(
     state: torch.jit.ScriptModule,
-    hamiltonian: _C.Heisenberg,
+    hamiltonian: _C.SpinHamiltonian,
     spins: np.ndarray,
     log_values: Optional[np.ndarray] = None,
     batch_size: int = 128,
@@ -524,26 +569,32 @@ def local_energy(
             if log_values is None:
                 log_values = _forward_with_batches(state, spins, batch_size)
                 log_values = log_values.numpy().view(np.complex64)
-
-            # Since torch.jit.ScriptModules can't be directly passed to C++
-            # code as torch::jit::script::Modules, we first save ψ to a
-            # temporary file and then load it back in C++ code.
-            with tempfile.NamedTemporaryFile(delete=False) as f:
-                filename = f.name
-            try:
-                state.save(filename)
-                log_H_values = (
-                    _C.PolynomialState(
-                        _C.Polynomial(hamiltonian, [0.0]),
-                        filename,
-                        (batch_size, len(_C.unsafe_get(spins, 0))),
-                    )(spins)
+            log_values = log_values.reshape(-1)
+
+            # H|σ⟩ for all σ at once: off-diagonal terms of H|spins[i]⟩ are
+            # neighbours[offsets[i]:offsets[i + 1]].
+            offsets, neighbours, elements, diagonal = hamiltonian.apply_batch(spins)
+            energies = diagonal.astype(np.complex128)
+            if len(neighbours) != 0:
+                log_neighbours = (
+                    _forward_with_batches(state, neighbours, batch_size)
                     .numpy()
                     .view(np.complex64)
+                    .reshape(-1)
+                )
+                counts = np.diff(offsets)
+                ratios = elements * np.exp(
+                    log_neighbours - np.repeat(log_values, counts)
                 )
-            finally:
-                os.remove(filename)
-            return np.exp(log_H_values - log_values).squeeze(axis=1)
+                # Segmented sum. np.add.reduceat mishandles empty segments
+                segments = np.repeat(np.arange(len(counts)), counts)
+                energies += np.bincount(
+                    segments, weights=ratios.real, minlength=len(counts)
+                )
+                energies += 1j * np.bincount(
+                    segments, weights=ratios.imag, minlength=len(counts)
+                )
+            return energies.astype(np.complex64)
 
 
 @torch.jit.script
@@ -555,7 +606,15 @@ def _log_amplitudes_to_probabilities(values: torch.Tensor) -> torch.Tensor:
     return prob
 
 
-def make_monte_carlo_options(config, number_spins: int) -> _C._Options:
+def make_monte_carlo_options(
+    config, number_spins: int, hamiltonian: Optional[_C.SpinHamiltonian] = None
+) -> _C._Options:
+    r"""Constructs Monte Carlo options from ``config``.
+
+    If ``hamiltonian`` is given, Metropolis moves only exchange anti-aligned
+    spins connected by its edges rather than arbitrary pairs of spins. This
+    improves acceptance on large lattices.
+    """
     if number_spins <= 0:
         raise ValueError(
             "invalid number spins: {}; expected a positive integer".format(number_spins)
@@ -576,6 +635,7 @@ def make_monte_carlo_options(config, number_spins: int) -> _C._Options:
         number_samples=config.number_samples,
         sweep_size=sweep_size,
         number_discarded=number_discarded,
+        hamiltonian=hamiltonian,
     )
 
 
@@ -32,7 +32,9 @@
 # OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 import cmath
-from typing import List, Tuple
+import os
+import tempfile
+from typing import List, Optional, Tuple
 import numpy as np
 
 from .core import _C, with_file_like
@@ -45,11 +47,18 @@ class Heisenberg(object):
     Isotropic Heisenberg Hamiltonian on a lattice.
     """
 
-    def __init__(self, specs: List[Tuple[float, int, int]]):
+    def __init__(
+        self,
+        specs: List[Tuple[float, int, int]],
+        symmetries: Optional[List[List[int]]] = None,
+    ):
         """
-        Initialises the Hamiltonian given a list of edges.
+        Initialises the Hamiltonian given a list of edges and (optionally) a
+        list of site permutations which leave it invariant.
         """
         self._specs = specs
+        self._symmetries = symmetries if symmetries is not None else []
+        self._cxx = None
         smallest = min(map(lambda t: min(t[1:]), specs))
         largest = max(map(lambda t: max(t[1:]), specs))
         if smallest != 0:
@@ -59,9 +68,35 @@ class Heisenberg(object):
             )
         self._number_spins = largest + 1
 
+    @staticmethod
+    def _from_cxx(
+        hamiltonian: _C.Heisenberg, symmetries: List[List[int]]
+    ) -> "Heisenberg":
+        """
+        Wraps an existing ``_C.Heisenberg`` without converting its edges to
+        Python objects.
+        """
+        self = Heisenberg.__new__(Heisenberg)
+        self._specs = None
+        self._symmetries = symmetries
+        self._cxx = hamiltonian
+        self._number_spins = hamiltonian.max_index + 1
+        return self
+
     def to_cxx(self) -> _C.Heisenberg:
+        if self._cxx is not None:
+            return self._cxx
         return _C.Heisenberg(self._specs)
 
+    @property
+    def specs(self) -> List[Tuple[float, int, int]]:
+        """
+        :return: edges as a list of tuples ``(coupling, i, j)``.
+        """
+        if self._specs is None:
+            self._specs = self._cxx.edges
+        return self._specs
+
     @property
     def number_spins(self) -> int:
         """
@@ -71,26 +106,75 @@ class Heisenberg(object):
 
     @property
     def edges(self) -> List[Tuple[int, int]]:
-        return [(i, j) for _, i, j in self._specs]
+        return [(i, j) for _, i, j in self.specs]
+
+    @property
+    def symmetries(self) -> List[List[int]]:
+        """
+        :return: site permutations which generate the symmetry group.
+        """
+        return self._symmetries
+
+    def symmetry_group(
+        self,
+        characters: Optional[List[complex]] = None,
+        spin_inversion: Optional[int] = None,
+    ) -> _C.SymmetryGroup:
+        """
+        Constructs the symmetry sector given characters of the generators
+        (see :py:attr:`symmetries`) and, optionally, of the global spin flip.
+        """
+        return _C.SymmetryGroup(
+            self._number_spins, self._symmetries, characters, spin_inversion
+        )
 
 
 def _read_hamiltonian(stream):
-    specs = []
-    for (coupling, edges) in map(
-        lambda x: x.strip().split(maxsplit=1),
-        filter(lambda x: not x.startswith(b"#"), stream),
-    ):
-        coupling = float(coupling)
-        # TODO: Parse the edges properly, it's not that difficult...
-        edges = eval(edges)
-        for i, j in edges:
-            specs.append((coupling, i, j))
-    return Heisenberg(specs)
+    name = getattr(stream, "name", "<stream>")
+    specs, symmetries = _C.parse_hamiltonian(stream.read(), str(name))
+    return Heisenberg(specs, symmetries)
 
 
-def read_hamiltonian(stream) -> Heisenberg:
+def read_hamiltonian(stream, cache: Optional[str] = None) -> Heisenberg:
     """
     Reads the Hamiltonian from ``stream``. ``stream`` could be either a
     file-like object or a ``str`` file name.
+
+    If ``cache`` is not ``None``, the Hamiltonian is also saved to ``cache``
+    in a binary format (see :py:func:`_C.save_hamiltonian_cache`). As long as
+    the cache is newer than ``stream``, subsequent calls memory-map the cache
+    instead of parsing the text file.
+    """
+    if (
+        cache is not None
+        and isinstance(stream, str)
+        and os.path.exists(cache)
+        and os.path.getmtime(cache) >= os.path.getmtime(stream)
+    ):
+        return Heisenberg._from_cxx(*_C.load_hamiltonian_cache(cache))
+    hamiltonian = with_file_like(stream, "rb", _read_hamiltonian)
+    if cache is not None:
+        save_hamiltonian_cache(cache, hamiltonian)
+    return hamiltonian
+
+
+def save_hamiltonian_cache(cache: str, hamiltonian: Heisenberg) -> None:
+    """
+    Saves ``hamiltonian`` to ``cache`` (see :py:func:`_C.save_hamiltonian_cache`).
+
+    The cache is first written to a temporary file in the same directory which
+    then atomically replaces ``cache``, so that concurrent readers never see a
+    partially written file.
     """
-    return with_file_like(stream, "rb", _read_hamiltonian)
+    directory = os.path.dirname(os.path.abspath(cache))
+    fd, tmp = tempfile.mkstemp(
+        dir=directory, prefix=os.path.basename(cache) + ".", suffix=".tmp"
+    )
+    os.close(fd)
+    try:
+        _C.save_hamiltonian_cache(tmp, hamiltonian.specs, hamiltonian.symmetries)
+        os.replace(tmp, cache)
+    except BaseException:
+        if os.path.exists(tmp):
+            os.remove(tmp)
+        raise
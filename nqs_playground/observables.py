@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+
+# Copyright Tom Westerhout (c) 2019
+#
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#     * Redistributions of source code must retain the above copyright
+#       notice, this list of conditions and the following disclaimer.
+#
+#     * Redistributions in binary form must reproduce the above
+#       copyright notice, this list of conditions and the following
+#       disclaimer in the documentation and/or other materials provided
+#       with the distribution.
+#
+#     * Neither the name of Tom Westerhout nor the names of other
+#       contributors may be used to endorse or promote products derived
+#       from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+# LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+# A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+# OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+# DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+# THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+from typing import List, Optional, Sequence, Tuple
+import numpy as np
+import torch
+
+from .core import _C, _forward_with_batches
+
+__all__ = [
+    "spin_correlation",
+    "measure",
+    "spin_correlations",
+    "structure_factor",
+]
+
+
+def spin_correlation(i: int, j: int, longitudinal: bool = False) -> _C.SpinHamiltonian:
+    r"""Returns ``Sᵢ·Sⱼ`` (or ``SᶻᵢSᶻⱼ`` if ``longitudinal``) as a
+    :py:class:`_C.SpinHamiltonian` suitable for :py:func:`measure`.
+    """
+    if i == j:
+        raise ValueError("i and j must be different")
+    return _C.SpinHamiltonian([(0.25, 0.0 if longitudinal else 0.25, i, j)])
+
+
+def measure(
+    state: torch.jit.ScriptModule,
+    observables: List[_C.SpinHamiltonian],
+    spins: np.ndarray,
+    log_values: Optional[np.ndarray] = None,
+    batch_size: int = 128,
+) -> Tuple[np.ndarray, np.ndarray]:
+    r"""Estimates ``⟨ψ|O|ψ⟩/⟨ψ|ψ⟩`` for all ``O`` in ``observables`` using
+    Monte Carlo samples ``spins`` (see :py:class:`_C.ObservableEstimator`).
+
+    :return: a tuple ``(means, errors)`` where ``errors`` are standard errors
+        of the means (assuming independent samples).
+    """
+    estimator = _C.ObservableEstimator(observables)
+    with torch.no_grad():
+        with torch.jit.optimized_execution(True):
+            if log_values is None:
+                log_values = _forward_with_batches(state, spins, batch_size)
+                log_values = log_values.numpy().view(np.complex64)
+            log_values = log_values.reshape(-1)
+            _, neighbours = estimator.neighbours(spins)
+            if len(neighbours) != 0:
+                neighbour_log_values = (
+                    _forward_with_batches(state, neighbours, batch_size)
+                    .numpy()
+                    .view(np.complex64)
+                    .reshape(-1)
+                )
+            else:
+                neighbour_log_values = np.empty(0, dtype=np.complex64)
+            estimator.update(spins, log_values, neighbour_log_values)
+    return estimator.means, np.sqrt(estimator.variances / estimator.count)
+
+
+def spin_correlations(
+    state: torch.jit.ScriptModule,
+    pairs: Sequence[Tuple[int, int]],
+    spins: np.ndarray,
+    longitudinal: bool = False,
+    **kwargs
+) -> Tuple[np.ndarray, np.ndarray]:
+    r"""Estimates ``⟨Sᵢ·Sⱼ⟩`` (or ``⟨SᶻᵢSᶻⱼ⟩``) for all ``(i, j)`` in
+    ``pairs``. Extra arguments are passed to :py:func:`measure`.
+    """
+    means, errors = measure(
+        state, [spin_correlation(i, j, longitudinal) for i, j in pairs], spins, **kwargs
+    )
+    return means.real, errors
+
+
+def structure_factor(
+    state: torch.jit.ScriptModule,
+    momenta: np.ndarray,
+    positions: np.ndarray,
+    spins: np.ndarray,
+    **kwargs
+) -> Tuple[np.ndarray, np.ndarray]:
+    r"""Estimates the static structure factor
+
+        S(q) = 1/N ∑ᵢⱼ exp(iq·(rᵢ - rⱼ)) ⟨Sᵢ·Sⱼ⟩
+
+    for every ``q`` in ``momenta``. ``positions[i]`` is the position of site
+    ``i``. Extra arguments are passed to :py:func:`measure`.
+    """
+    momenta = np.asarray(momenta, dtype=np.float64).reshape(len(momenta), -1)
+    positions = np.asarray(positions, dtype=np.float64).reshape(len(positions), -1)
+    n = positions.shape[0]
+    observables = []
+    for q in momenta:
+        phases = positions @ q
+        # Terms with i == j contribute Sᵢ·Sᵢ = 3/4 each and are added below
+        observables.append(
+            _C.SpinHamiltonian(
+                [
+                    (c, c, i, j)
+                    for i in range(n)
+                    for j in range(i + 1, n)
+                    for c in [np.cos(phases[i] - phases[j]) / (2 * n)]
+                ]
+            )
+        )
+    means, errors = measure(state, observables, spins, **kwargs)
+    return means.real + 0.75, errors
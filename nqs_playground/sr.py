@@ -34,7 +34,6 @@ from collections import namedtuple
 import json
 import math
 import os
-import pickle
 import sys
 import tempfile
 from typing import Dict, List, Tuple, Optional, Union
@@ -48,18 +47,61 @@ from . import core, hamiltonian
 from .core import _C
 
 
+# Networks with at most this many parameters use a dense solve of the SR
+# equations. For larger ones, conjugate gradient is used instead.
+_DENSE_SR_THRESHOLD = 4096
+
+# Default rank of the randomized Nyström approximation of S.
+_DEFAULT_SKETCH_RANK = 256
+
+
 def num_parameters(module: torch.nn.Module) -> int:
     r"""Given a ``torch.nn.Module``, returns total number of parameters in it.
     """
     return sum(map(torch.numel, module.parameters()))
 
 
+def _as_multilayer_perceptron(module: torch.nn.Module) -> Optional[List[Tuple]]:
+    r"""If ``module`` is a ``torch.nn.Sequential`` (possibly compiled with
+    TorchScript) of ``Linear`` layers, each optionally followed by a ReLU,
+    Softplus, or Tanh activation, returns its layers in the format expected
+    by ``_C.mlp_jacobian``. Otherwise, returns ``None``.
+    """
+
+    def name(m):
+        return getattr(m, "original_name", type(m).__name__)
+
+    if name(module) != "Sequential":
+        return None
+    activations = {"ReLU": "relu", "Softplus": "softplus", "Tanh": "tanh"}
+    layers = []
+    for m in module.children():
+        kind = name(m)
+        if kind == "Linear":
+            layers.append([m.weight, m.bias, "identity"])
+        elif kind in activations and layers and layers[-1][2] == "identity":
+            if kind == "Softplus" and (
+                getattr(m, "beta", 1) != 1 or getattr(m, "threshold", 20) != 20
+            ):
+                return None
+            layers[-1][2] = activations[kind]
+        else:
+            return None
+    if not layers or layers[-1][0].size(0) != 1:
+        return None
+    return [(w.detach(), None if b is None else b.detach(), f) for w, b, f in layers]
+
+
 def jacobian(module: torch.nn.Module, inputs: torch.Tensor, out=None) -> torch.Tensor:
     r"""Given a ``torch.nn.Module`` and a ``torch.Tensor`` of inputs, computes
     the Jacobian ∂module(inputs)/∂W where W are module's parameters.
 
     It is assumed that if ``inputs`` has shape ``(batch_size, in_features)``,
     then ``module(inputs)`` has shape ``(batch_size, 1)``.
+
+    Multilayer perceptrons with ``float32`` parameters, inputs and output are
+    handled natively using a single batched forward and backward pass. For all
+    other modules, we fall back to computing gradients row by row.
     """
     parameters = list(module.parameters())
     shape = (inputs.size(0), num_parameters(module))
@@ -67,6 +109,15 @@ def jacobian(module: torch.nn.Module, inputs: torch.Tensor, out=None) -> torch.T
         out = torch.zeros(*shape)
     else:
         assert out.size() == shape
+    layers = _as_multilayer_perceptron(module)
+    if (
+        layers is not None
+        and inputs.dtype == torch.float32
+        and out.dtype == torch.float32
+        and all(p.dtype == torch.float32 for p in parameters)
+    ):
+        _C.mlp_jacobian(layers, inputs.contiguous(), out)
+        return out
     for i, xs in enumerate(inputs):
         dws = torch.autograd.grad(
             module(xs.view(1, -1)),
@@ -158,6 +209,36 @@ def covariance_matrix(
     return np.ascontiguousarray(matrix.real)
 
 
+def accumulate(
+    modules: Tuple[torch.nn.Module, torch.nn.Module],
+    hamiltonian: _C.SpinHamiltonian,
+    batches,
+    sketch_rank: int = 0,
+) -> _C.SRAccumulator:
+    r"""Computes the energy, its variance, and the energy gradient (and
+    optionally a sketch of S) without keeping all samples in memory.
+
+    :param modules: amplitude and phase modules (see
+        :py:func:`logarithmic_derivative`).
+    :param hamiltonian: Hamiltonian ``H``.
+    :param batches: an iterable of ``(spins, weights)`` tuples, where
+        ``weights`` is ``None`` for Monte Carlo samples (see
+        :py:func:`energy_gradient`). Only one batch is processed at a time.
+    :param sketch_rank: number of columns of the random test matrix ``Ω``
+        used to sketch ``S``. ``0`` disables sketching.
+    """
+    amplitude, phase = modules
+    accumulator = _C.SRAccumulator(
+        num_parameters(amplitude) + num_parameters(phase), sketch_rank
+    )
+    state = core.combine_amplitude_and_phase(amplitude, phase)
+    for spins, weights in batches:
+        local_energies = core.local_energy(state, hamiltonian, spins)
+        derivatives = logarithmic_derivative(modules, _C.unpack(spins))
+        accumulator.update(derivatives, local_energies, weights)
+    return accumulator
+
+
 class Runner:
     def __init__(self, config):
         self.config = config
@@ -199,14 +280,28 @@ class Runner:
         self.tb_writer.add_graph(self.amplitude, torch.rand(32, self.number_spins))
 
     def __add_mc_options(self):
-        self.mc_options = core.make_monte_carlo_options(self.config, self.number_spins)
+        proposal = self.config.proposal
+        if proposal is None:
+            proposal = "random"
+        if proposal not in {"random", "bond"}:
+            raise ValueError(
+                "invalid config.proposal: {}; ".format(self.config.proposal)
+                + "expected either 'random' or 'bond'"
+            )
+        # With "bond", Metropolis moves only exchange anti-aligned spins
+        # connected by an edge of the Hamiltonian
+        self.mc_options = core.make_monte_carlo_options(
+            self.config,
+            self.number_spins,
+            hamiltonian=self.hamiltonian if proposal == "bond" else None,
+        )
 
     def __load_exact(self):
         if self.config.exact is None:
             return None
-        x, y = core.with_file_like(self.config.exact, "rb", pickle.load)
+        x, y = core.load_exact(self.config.exact)
         x = _C.unpack(x)
-        y = torch.from_numpy(y).squeeze()
+        y = torch.from_numpy(np.array(y)).squeeze()
         y /= np.linalg.norm(y)
 
         def compute():
@@ -269,30 +364,35 @@ class Runner:
         logarithmic_derivatives = logarithmic_derivative(
             (self.amplitude, self.phase), _C.unpack(spins)
         )
-        # Centering
-        if weights is not None:
-            mean_derivative = (weights @ logarithmic_derivatives).reshape(1, -1)
-        else:
-            mean_derivative = np.mean(logarithmic_derivatives, axis=0).reshape(1, -1)
-        logarithmic_derivatives -= mean_derivative
-
-        force = energy_gradient(local_energies, logarithmic_derivatives, weights)
+        # Centering and S are handled in C++ without forming S explicitly
+        _C.center_derivatives(logarithmic_derivatives, weights)
+        S = _C.SRMatrix(logarithmic_derivatives, weights)
+        force = S.gradient(local_energies)
         self.tb_writer.add_scalar("SR/grad", np.linalg.norm(force), self._iteration)
-        S = covariance_matrix(logarithmic_derivatives, weights)
         return force, S
 
     def solve(self, matrix, vector):
-        n = matrix.shape[0]
-        # diag = np.diag(matrix)
-        # diag = np.where(diag <= 0.0, 1.0, diag)
-        # diag = np.sqrt(diag)
-        #
-        # matrix = matrix / (diag.reshape(-1, 1) @ diag.reshape(1, -1))
-        # vector = vector / diag
-
-        matrix += 1e-2 * np.eye(matrix.shape[0])
-        x = scipy.linalg.solve(matrix, vector)
-        # x /= diag
+        solver = self.config.sr_solver
+        if solver is None:
+            # S is formed explicitly only when it is small enough
+            solver = "exact" if len(matrix) <= _DENSE_SR_THRESHOLD else "cg"
+        if solver == "exact":
+            dense = matrix.dense()
+            dense += 1e-2 * np.eye(dense.shape[0])
+            return scipy.linalg.solve(dense, vector)
+        if solver == "nystrom":
+            rank = self.config.sketch_rank
+            if rank is None:
+                rank = min(len(matrix), _DEFAULT_SKETCH_RANK)
+            return _C.NystromApproximation(matrix, rank).solve(vector, shift=1e-2)
+        if solver != "cg":
+            raise ValueError(
+                "invalid config.sr_solver: {}; ".format(solver)
+                + "expected one of 'exact', 'cg', 'nystrom'"
+            )
+        x, iterations, residual = matrix.solve(vector, shift=1e-2)
+        self.tb_writer.add_scalar("SR/cg_iterations", iterations, self._iteration)
+        self.tb_writer.add_scalar("SR/cg_residual", residual, self._iteration)
         return x
 
     def set_gradient(self, grad):
@@ -338,8 +438,11 @@ Config = namedtuple(
         "magnetisation",
         "sweep_size",
         "number_discarded",
+        "sr_solver",
+        "sketch_rank",
+        "proposal",
     ],
-    defaults=[None, None, None, None],
+    defaults=[None, None, None, None, None, None, None],
 )
 
 
@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+
+# Copyright Tom Westerhout (c) 2019
+#
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#     * Redistributions of source code must retain the above copyright
+#       notice, this list of conditions and the following disclaimer.
+#
+#     * Redistributions in binary form must reproduce the above
+#       copyright notice, this list of conditions and the following
+#       disclaimer in the documentation and/or other materials provided
+#       with the distribution.
+#
+#     * Neither the name of Tom Westerhout nor the names of other
+#       contributors may be used to endorse or promote products derived
+#       from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+# LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+# A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+# OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+# DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+# THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+import pytest
+import torch
+
+from nqs_playground.sr import _as_multilayer_perceptron, jacobian
+
+
+class _Opaque(torch.nn.Module):
+    r"""Hides the structure of ``inner`` so that ``jacobian`` falls back to
+    autograd. Parameters are shared and come in the same order.
+    """
+
+    def __init__(self, inner):
+        super().__init__()
+        self.inner = inner
+
+    def forward(self, x):
+        return self.inner(x)
+
+
+def _make_mlp(in_features, activation, bias):
+    return torch.nn.Sequential(
+        torch.nn.Linear(in_features, 12, bias=bias),
+        activation(),
+        torch.nn.Linear(12, 7, bias=bias),
+        activation(),
+        torch.nn.Linear(7, 1, bias=True),
+    )
+
+
+@pytest.mark.parametrize(
+    "activation", [torch.nn.Tanh, torch.nn.ReLU, torch.nn.Softplus]
+)
+@pytest.mark.parametrize("bias", [True, False])
+def test_mlp_jacobian_matches_autograd(activation, bias):
+    torch.manual_seed(1234)
+    module = _make_mlp(10, activation, bias)
+    assert _as_multilayer_perceptron(module) is not None
+    inputs = torch.randn(37, 10)
+
+    expected = jacobian(_Opaque(module), inputs)
+    predicted = jacobian(module, inputs)
+    assert predicted.size() == expected.size()
+    assert torch.allclose(predicted, expected, rtol=1e-4, atol=1e-5)
+    # ∂y/∂b of the last layer is one for every input
+    assert torch.all(predicted[:, -1] == 1)
+
+
+def test_mlp_jacobian_strided_output():
+    torch.manual_seed(4321)
+    module = _make_mlp(6, torch.nn.Tanh, bias=True)
+    inputs = torch.randn(20, 6)
+    n = sum(p.numel() for p in module.parameters())
+
+    # Same layout as logarithmic_derivative uses for the amplitude
+    out = torch.zeros(20, n + 3, 2)
+    jacobian(module, inputs, out[:, :n, 0])
+    expected = jacobian(_Opaque(module), inputs)
+    assert torch.allclose(out[:, :n, 0], expected, rtol=1e-4, atol=1e-5)
+    assert torch.all(out[:, n:, :] == 0)
+    assert torch.all(out[:, :n, 1] == 0)
+
+
+def test_jacobian_float64_falls_back_to_autograd():
+    torch.manual_seed(2468)
+    module = _make_mlp(5, torch.nn.Tanh, bias=True).double()
+    assert _as_multilayer_perceptron(module) is not None
+    inputs = torch.randn(9, 5, dtype=torch.float64)
+    n = sum(p.numel() for p in module.parameters())
+
+    out = torch.zeros(9, n, dtype=torch.float64)
+    jacobian(module, inputs, out)
+    expected = torch.zeros(9, n, dtype=torch.float64)
+    jacobian(_Opaque(module), inputs, expected)
+    assert torch.equal(out, expected)
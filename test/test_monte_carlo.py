@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+
+# Copyright Tom Westerhout (c) 2019
+#
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#     * Redistributions of source code must retain the above copyright
+#       notice, this list of conditions and the following disclaimer.
+#
+#     * Redistributions in binary form must reproduce the above
+#       copyright notice, this list of conditions and the following
+#       disclaimer in the documentation and/or other materials provided
+#       with the distribution.
+#
+#     * Neither the name of Tom Westerhout nor the names of other
+#       contributors may be used to endorse or promote products derived
+#       from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+# LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+# A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+# OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+# DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+# THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+from collections import Counter
+
+import pytest
+import torch
+
+from nqs_playground.core import _C
+
+
+def _keys(spins, number_spins):
+    r"""Maps every spin configuration to an integer."""
+    x = _C.unpack(spins)
+    powers = 2 ** torch.arange(number_spins, dtype=torch.int64)
+    return ((x > 0).to(torch.int64) * powers).sum(dim=1).tolist()
+
+
+@pytest.mark.parametrize("use_hamiltonian", [False, True])
+def test_metropolis_stationary_distribution(tmp_path, use_hamiltonian):
+    r"""Histograms of Metropolis samples should converge to |ψ|²."""
+    torch.manual_seed(2019)
+    number_spins = 6
+    linear = torch.nn.Linear(number_spins, 1)
+    with torch.no_grad():
+        linear.weight.mul_(2)
+    ψ = torch.jit.script(torch.nn.Sequential(linear))
+    filename = str(tmp_path / "psi.pt")
+    ψ.save(filename)
+
+    hamiltonian = None
+    if use_hamiltonian:
+        hamiltonian = _C.Heisenberg(
+            [(1.0, i, (i + 1) % number_spins) for i in range(number_spins)]
+        )
+    options = _C._Options(
+        number_spins=number_spins,
+        magnetisation=0,
+        number_chains=4,
+        number_samples=25000,
+        sweep_size=number_spins,
+        number_discarded=500,
+        hamiltonian=hamiltonian,
+    )
+    spins, _, acceptance = _C._sample_some(filename, options)
+    assert 0 < acceptance <= 1
+
+    basis = _C.all_spins(number_spins, 0)
+    with torch.no_grad():
+        amplitudes = ψ(_C.unpack(basis)).squeeze(dim=1).double()
+    # The sampler treats the output of ψ as an amplitude and samples from ψ².
+    probabilities = amplitudes ** 2
+    probabilities /= probabilities.sum()
+    expected = dict(zip(_keys(basis, number_spins), probabilities.tolist()))
+
+    observed = Counter(_keys(spins, number_spins))
+    total = sum(observed.values())
+    # Every chain produces ⌈number_samples / number_chains⌉ samples.
+    assert total == (
+        (options.number_samples + options.number_chains - 1) // options.number_chains
+    ) * options.number_chains
+    assert set(observed) <= set(expected)
+    distance = 0.5 * sum(
+        abs(observed.get(key, 0) / total - p) for key, p in expected.items()
+    )
+    assert distance < 0.03